@@ -0,0 +1,338 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+/**
+	@file
+	@brief Measures how much memory the per-node strings and path sets of a large synthetic build graph take.
+
+	Each node's toolchain, architecture, configuration, script and dependency/source lists are built two ways: with the
+	plain std::string / std::set<std::string> fields BuildGraphNode used to have, and with the Symbol / SymbolSet fields
+	it has now. Each variant runs in its own child process so the resident set sizes don't interfere.
+
+	The synthetic graph is a number of source files, each including a few headers out of a shared pool, compiled for
+	several architectures and configurations in several working copies, like a team sharing one splashctl.
+ */
+
+#include "../splashcore/splashcore.h"
+#include "../log/log.h"
+
+#include <sys/wait.h>
+
+using namespace std;
+
+void ShowUsage();
+
+/// @brief Shape of the synthetic graph
+struct BenchConfig
+{
+	int sources;
+	int headersPerSource;
+	int headerPool;
+	int arches;
+	int configs;
+	int copies;
+};
+
+/// @brief The fields the way BuildGraphNode used to store them
+struct LegacyNodeFields
+{
+	string toolchain;
+	string toolchainHash;
+	string arch;
+	string config;
+	string script;
+	set<string> dependencies;
+	set<string> sources;
+};
+
+/// @brief The fields the way BuildGraphNode stores them now
+struct InternedNodeFields
+{
+	Symbol toolchain;
+	Symbol toolchainHash;
+	Symbol arch;
+	Symbol config;
+	Symbol script;
+	SymbolSet dependencies;
+	SymbolSet sources;
+};
+
+/// @brief Results of one run, passed back from the child process
+struct BenchResult
+{
+	size_t nodes;
+	size_t rssBytes;
+	double seconds;
+};
+
+/**
+	@brief Gets our resident set size, in bytes
+ */
+size_t GetRSS()
+{
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if(!fp)
+		return 0;
+	unsigned long size = 0;
+	unsigned long rss = 0;
+	if(2 != fscanf(fp, "%lu %lu", &size, &rss))
+		rss = 0;
+	fclose(fp);
+	return rss * sysconf(_SC_PAGESIZE);
+}
+
+void FinishNode(LegacyNodeFields& /*node*/)
+{
+}
+
+void FinishNode(InternedNodeFields& node)
+{
+	//Same as BuildGraphNode::Finalize()
+	node.dependencies.Freeze();
+	node.sources.Freeze();
+}
+
+/**
+	@brief Creates every node of the synthetic graph
+ */
+template<class T> void BuildNodes(const BenchConfig& config, vector<T*>& nodes)
+{
+	//Every working copy has the same files, so the paths (and hashes) come out the same for each
+	for(int wc=0; wc<config.copies; wc++)
+	{
+		for(int a=0; a<config.arches; a++)
+		{
+			char arch[64];
+			snprintf(arch, sizeof(arch), "arch%d-unknown-linux-gnu", a);
+
+			//Fake toolchain hash, but the right length
+			char hash[65];
+			snprintf(hash, sizeof(hash), "%064x", a);
+
+			for(int c=0; c<config.configs; c++)
+			{
+				char cfg[32];
+				snprintf(cfg, sizeof(cfg), "config%d", c);
+
+				//Same LCG sequence for every arch/config, so the header lists are too
+				unsigned int seed = 1;
+				for(int i=0; i<config.sources; i++)
+				{
+					auto node = new T;
+					node->toolchain = string("c++/gnu");
+					node->toolchainHash = string(hash);
+					node->arch = string(arch);
+					node->config = string(cfg);
+
+					char tmp[128];
+					snprintf(tmp, sizeof(tmp), "src/module%d/build.yml", i / 20);
+					node->script = string(tmp);
+
+					snprintf(tmp, sizeof(tmp), "src/module%d/file%d.cpp", i / 20, i);
+					node->sources.emplace(tmp);
+					node->dependencies.emplace(tmp);
+
+					for(int h=0; h<config.headersPerSource; h++)
+					{
+						seed = seed * 1103515245 + 12345;
+						snprintf(tmp, sizeof(tmp), "include/lib%u/header%u.h",
+							(seed >> 16) % 16,
+							(seed >> 8) % config.headerPool);
+						node->dependencies.emplace(tmp);
+					}
+
+					FinishNode(*node);
+					nodes.push_back(node);
+				}
+			}
+		}
+	}
+}
+
+/**
+	@brief Builds the synthetic graph with one field layout, in a child process, and reports what it cost
+ */
+template<class T> bool RunBench(const BenchConfig& config, BenchResult& result)
+{
+	int fds[2];
+	if(0 != pipe(fds))
+		return false;
+
+	pid_t pid = fork();
+	if(pid < 0)
+		return false;
+
+	//Child: do the work, send back the results
+	if(pid == 0)
+	{
+		close(fds[0]);
+
+		vector<T*> nodes;
+		nodes.reserve((size_t)config.sources * config.arches * config.configs * config.copies);
+
+		size_t start = GetRSS();
+		double tstart = GetTime();
+		BuildNodes(config, nodes);
+
+		BenchResult r;
+		r.seconds = GetTime() - tstart;
+		r.rssBytes = GetRSS() - start;
+		r.nodes = nodes.size();
+		if(sizeof(r) != write(fds[1], &r, sizeof(r)))
+			_exit(1);
+		_exit(0);
+	}
+
+	//Parent: wait for it
+	close(fds[1]);
+	bool ok = (sizeof(result) == read(fds[0], &result, sizeof(result)));
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	return ok && WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+
+/**
+	@brief Program entry point
+ */
+int main(int argc, char* argv[])
+{
+	Severity console_verbosity = Severity::NOTICE;
+
+	BenchConfig config;
+	config.sources = 2000;
+	config.headersPerSource = 60;
+	config.headerPool = 500;
+	config.arches = 2;
+	config.configs = 2;
+	config.copies = 4;
+
+	//Parse command-line arguments
+	for(int i=1; i<argc; i++)
+	{
+		string s(argv[i]);
+
+		//Let the logger eat its args first
+		if(ParseLoggerArguments(i, argc, argv, console_verbosity))
+			continue;
+
+		else if(s == "--help")
+		{
+			ShowUsage();
+			return 0;
+		}
+
+		else if( (s == "--sources") && (i+1 < argc) )
+			config.sources = atoi(argv[++i]);
+		else if( (s == "--headers") && (i+1 < argc) )
+			config.headersPerSource = atoi(argv[++i]);
+		else if( (s == "--header-pool") && (i+1 < argc) )
+			config.headerPool = atoi(argv[++i]);
+		else if( (s == "--arches") && (i+1 < argc) )
+			config.arches = atoi(argv[++i]);
+		else if( (s == "--configs") && (i+1 < argc) )
+			config.configs = atoi(argv[++i]);
+		else if( (s == "--copies") && (i+1 < argc) )
+			config.copies = atoi(argv[++i]);
+
+		else
+		{
+			ShowUsage();
+			return 1;
+		}
+	}
+
+	//Set up logging
+	g_log_sinks.emplace(g_log_sinks.begin(), new ColoredSTDLogSink(console_verbosity));
+
+	if( (config.sources < 1) || (config.headersPerSource < 0) || (config.headerPool < 1) ||
+		(config.arches < 1) || (config.configs < 1) || (config.copies < 1) )
+	{
+		LogError("All counts must be positive\n");
+		return 1;
+	}
+
+	LogNotice("Synthetic graph: %d sources x %d headers (from a pool of %d), %d arches, %d configs, %d working copies\n",
+		config.sources,
+		config.headersPerSource,
+		config.headerPool,
+		config.arches,
+		config.configs,
+		config.copies);
+
+	//Inline size of the node itself
+	size_t oldsize = sizeof(BuildGraphNode) - sizeof(InternedNodeFields) + sizeof(LegacyNodeFields);
+	LogNotice("sizeof(BuildGraphNode):  %zu bytes (%zu with std::string / std::set fields)\n",
+		sizeof(BuildGraphNode), oldsize);
+
+	//Heap usage of the fields that changed
+	BenchResult legacy;
+	BenchResult interned;
+	if(!RunBench<LegacyNodeFields>(config, legacy) || !RunBench<InternedNodeFields>(config, interned))
+	{
+		LogError("Benchmark child process failed\n");
+		return 1;
+	}
+
+	double mb = 1024 * 1024;
+	LogNotice("std::string / std::set:  %zu nodes, %8.1f MB RSS, %6zu bytes/node, %.3f sec\n",
+		legacy.nodes,
+		legacy.rssBytes / mb,
+		legacy.rssBytes / legacy.nodes,
+		legacy.seconds);
+	LogNotice("Symbol / SymbolSet:      %zu nodes, %8.1f MB RSS, %6zu bytes/node, %.3f sec\n",
+		interned.nodes,
+		interned.rssBytes / mb,
+		interned.rssBytes / interned.nodes,
+		interned.seconds);
+	if(legacy.rssBytes)
+		LogNotice("Saved %.1f%%\n", 100.0 * (1.0 - (double)interned.rssBytes / legacy.rssBytes));
+
+	return 0;
+}
+
+void ShowUsage()
+{
+	printf(
+		"Usage: splashbench [options]\n"
+		"\n"
+		"options may be zero or more of the following:\n"
+		"    --arches <n>                   Number of architectures each source is built for (default 2)\n"
+		"    --configs <n>                  Number of configurations each source is built in (default 2)\n"
+		"    --copies <n>                   Number of working copies with the same files (default 4)\n"
+		"    --debug                        Sets log level to debug\n"
+		"    --header-pool <n>              Number of distinct headers to include from (default 500)\n"
+		"    --headers <n>                  Number of headers each source includes (default 60)\n"
+		"    -l, --logfile <fname>          Directs logging to the file <fname>\n"
+		"    -q, --quiet                    Decreases log verbosity by one step\n"
+		"    --sources <n>                  Number of source files (default 2000)\n"
+		"    --verbose                      Sets log level to verbose\n"
+		);
+}
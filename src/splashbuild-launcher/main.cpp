@@ -93,11 +93,10 @@ int main(int argc, char* argv[])
 	//Figure out how many virtual CPUs we have
 	string scount = ShellCommand("cat /proc/cpuinfo  | grep vendor_id | wc -l");
 	int cpucount = atoi(scount.c_str());
-	LogNotice("Found %d virtual CPU cores, starting workers...\n", cpucount);
+	LogNotice("Found %d virtual CPU cores, starting worker with one slot per core...\n", cpucount);
 
-	//Launch the apps
+	//Launch the app. It forks off one process per slot by itself.
 	vector<pid_t> daemons;
-	for(int i=0; i<cpucount; i++)
 	{
 		//Fork off the background process
 		pid_t pid = fork();
@@ -119,16 +118,15 @@ int main(int argc, char* argv[])
 				LogFatal("dup2 #3 failed\n");
 
 			//Open the logfile
-			char logpath[32];
-			snprintf(logpath, sizeof(logpath), "/tmp/splashbuild-%d.log", i);
+			const char* logpath = "/tmp/splashbuild.log";
 
 			//Find the directory our exe is in (splashbuild should be in the same spot)
 			string launcher_path = CanonicalizePath("/proc/self/exe");
 			string splashbuild_path = GetDirOfFile(launcher_path) + "/splashbuild";
 
-			//Format the node number as ascii for the argument
-			char snodenum[32];
-			snprintf(snodenum, sizeof(snodenum), "%d", i);
+			//Format the slot count as ascii for the argument
+			char sslots[32];
+			snprintf(sslots, sizeof(sslots), "%d", cpucount);
 
 			//Run the process
 			execl(
@@ -137,7 +135,9 @@ int main(int argc, char* argv[])
 				"--debug",
 				ctl_server.c_str(),
 				"--nodenum",
-				snodenum,
+				"0",
+				"--slots",
+				sslots,
 				"--uuid",
 				uuid.c_str(),
 				"--logfile-lines",
@@ -40,9 +40,12 @@ map<string, Toolchain*> g_toolchains;
 void CleanBuildDir();
 void ProcessDependencyScan(Socket& sock, DependencyScan rxm);
 void ProcessBuildRequest(Socket& sock, const NodeBuildRequest& rxm);
+void ProcessBuildBatch(Socket& sock, const NodeBuildBatch& rxm);
+void RunBuild(Socket& sock, const NodeBuildRequest& rxm, NodeBuildResults* replym, set<string>& canceled);
 Toolchain* PrepBuild(string toolhash);
 bool RefreshCachedFile(Socket& sock, string hash, string fname);
 bool GrabSourceFile(Socket& sock, string fname, string hash);
+void WatchForCancel(Socket& sock, int done, string current, set<string>& canceled);
 
 bool DoScanDependencies(
 	Socket& sock,
@@ -52,7 +55,8 @@ bool DoScanDependencies(
 	string aname,
 	string& output,
 	set<BuildFlag>& libFlags,
-	DependencyResults* replym);
+	DependencyResults* replym,
+	string hash = "");
 
 bool GrabMissingDependencies(
 	Socket& sock,
@@ -75,6 +79,9 @@ int main(int argc, char* argv[])
 	string ctl_server;
 	int port = 49000;
 	int nodenum = 0;
+	int slots = 1;
+	unsigned int rambudget = 0;
+	unsigned int scanbudget = 256;
 	string uuid;
 
 	//Parse command-line arguments
@@ -104,6 +111,15 @@ int main(int argc, char* argv[])
 		else if( (s == "--uuid") && (i+1 < argc) )
 			uuid = argv[++i];
 
+		else if( (s == "--slots") && (i+1 < argc) )
+			slots = atoi(argv[++i]);
+
+		else if( (s == "--ram") && (i+1 < argc) )
+			rambudget = atoi(argv[++i]);
+
+		else if( (s == "--scan-cache") && (i+1 < argc) )
+			scanbudget = atoi(argv[++i]);
+
 		//Last arg without switch is control server.
 		//TODO: mandatory arguments to introduce these?
 		else
@@ -111,6 +127,9 @@ int main(int argc, char* argv[])
 
 	}
 
+	if(slots < 1)
+		slots = 1;
+
 	char sworker[64];
 	snprintf(sworker, sizeof(sworker), "sb%d", nodenum);
 
@@ -130,19 +149,6 @@ int main(int argc, char* argv[])
 		printf("\n");
 	}
 
-	//Initialize the cache
-	//Use separate caches for each instance if we multithread for now.
-	//TODO: figure out how to share?
-	g_cache = new Cache(sworker);
-
-	//Set up the config object from our arguments
-	g_clientSettings = new ClientSettings(ctl_server, port, uuid);
-
-	//Connect to the server
-	Socket sock(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-	if(!ConnectToServer(sock, ClientHello::CLIENT_BUILD, string("-") + sworker))
-		return 1;
-
 	//Look for compilers
 	LogVerbose("Enumerating compilers...\n");
 	{
@@ -154,13 +160,75 @@ int main(int argc, char* argv[])
 	}
 	LogVerbose("%zu compilers found\n", g_toolchains.size());
 
-	//Get some basic metadata about our hardware and tell the server
+	//Dependency scan results are shared by all slots and projects on this machine, and kept across restarts.
+	//Results that depend on system headers/libraries are keyed on a fingerprint of those directories, so they
+	//go stale on their own when packages are installed or upgraded; no need to restart us or clear the cache.
+	//Without a home directory, keep them in our temporary directory instead (so only until the machine reboots).
+	string scandir;
+	const char* home = getenv("HOME");
+	if( (home != NULL) && (home[0] != '\0') )
+		scandir = string(home) + "/.splash/scans";
+	else
+	{
+		scandir = g_tmpdir + "/scans";
+		LogWarning("HOME is not set, keeping dependency scan results in %s\n", scandir.c_str());
+	}
+	uint64_t scanlimit = (uint64_t)scanbudget * 1024 * 1024;
+	MakeDirectoryRecursive(scandir, 0700);
+	DependencyCache::TrimStorage(scandir, scanlimit);
+	for(auto it : g_toolchains)
+		it.second->SetDependencyCachePath(scandir, scanlimit);
+
+	//Get some basic metadata about our hardware
 	SplashMsg binfo;
 	auto binfom = binfo.mutable_buildinfo();
 	binfom->set_cpucount(atoi(ShellCommand("cat /proc/cpuinfo  | grep processor | wc -l").c_str()));
 	binfom->set_cpuspeed(atoi(ShellCommand("cat /proc/cpuinfo | grep bogo | head -n 1 | cut -d : -f 2").c_str()));
 	binfom->set_ramsize(atol(ShellCommand("cat /proc/meminfo  | grep MemTotal  | cut -d : -f 2").c_str()) / 1024);
 	binfom->set_numchains(g_toolchains.size());
+	binfom->set_slots(slots);
+	if(rambudget == 0)
+		rambudget = binfom->ramsize();
+	binfom->set_rambudget(rambudget);
+
+	//Fork off one worker process per additional slot.
+	//Builds run relative to the current directory, so each slot needs its own process, working directory,
+	//cache, and server connection. All slots share our UUID so the server knows they're on the same machine
+	//(and share one RAM budget).
+	//Do this after finding compilers so we only pay for that once.
+	for(int i=1; i<slots; i++)
+	{
+		pid_t pid = fork();
+		if(pid < 0)
+			LogFatal("Fork failed\n");
+
+		//Child process: set up as a new slot, and go away if the parent dies
+		if(pid == 0)
+		{
+			prctl(PR_SET_PDEATHSIG, SIGQUIT);
+
+			snprintf(sworker, sizeof(sworker), "sb%d", nodenum + i);
+			g_tmpdir = string("/tmp/") + sworker;
+			MakeDirectoryRecursive(g_tmpdir, 0700);
+			g_builddir = g_tmpdir + "/workdir";
+			MakeDirectoryRecursive(g_builddir, 0700);
+			chdir(g_builddir.c_str());
+			break;
+		}
+	}
+
+	//Initialize the cache
+	//Use separate caches for each slot for now.
+	//TODO: figure out how to share?
+	g_cache = new Cache(sworker);
+
+	//Set up the config object from our arguments
+	g_clientSettings = new ClientSettings(ctl_server, port, uuid);
+
+	//Connect to the server and tell it about our hardware
+	Socket sock(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	if(!ConnectToServer(sock, ClientHello::CLIENT_BUILD, string("-") + sworker))
+		return 1;
 	if(!SendMessage(sock, binfo, ctl_server))
 		return 1;
 
@@ -223,12 +291,21 @@ int main(int argc, char* argv[])
 				ProcessBuildRequest(sock, rxm.nodebuildrequest());
 				break;
 
+			//Requesting several small compile operations at once
+			case SplashMsg::kNodeBuildBatch:
+				ProcessBuildBatch(sock, rxm.nodebuildbatch());
+				break;
+
 			//Asking for more data
 			case SplashMsg::kContentRequestByHash:
 				if(!ProcessContentRequest(sock, g_clientSettings->GetServerHostname(), rxm))
 					return false;
 				break;
 
+			//Asking us to stop a build that already finished (the server repeats these until it hears back)
+			case SplashMsg::kCancelBuild:
+				break;
+
 			default:
 				LogDebug("Got an unknown message, ignoring it\n");
 				break;
@@ -366,7 +443,7 @@ void ProcessDependencyScan(Socket& sock, DependencyScan rxm)
 	string output;
 	set<BuildFlag> libFlags;
 	chdir(g_builddir.c_str());
-	bool ok = DoScanDependencies(sock, chain, flags, rxm.arch(), aname, output, libFlags, replym);
+	bool ok = DoScanDependencies(sock, chain, flags, rxm.arch(), aname, output, libFlags, replym, hash);
 
 	//Process the results
 	for(auto lib : libFlags)
@@ -389,7 +466,8 @@ bool DoScanDependencies(
 	string aname,
 	string& output,
 	set<BuildFlag>& libFlags,
-	DependencyResults* replym)
+	DependencyResults* replym,
+	string hash)
 {
 	LogDebug("DoScanDependencies for %s\n", aname.c_str());
 	LogIndenter li;
@@ -412,7 +490,8 @@ bool DoScanDependencies(
 			hashes,
 			output,
 			missingFiles,
-			libFlags))
+			libFlags,
+			hash))
 		{
 			//trim off trailing newlines
 			while(isspace(output[output.length() - 1]))
@@ -568,18 +647,165 @@ bool GrabSourceFile(Socket& sock, string fname, string hash)
 	return true;
 }
 
+/**
+	@brief Waits for the server to cancel the build we're running, and kills it if that happens.
+
+	Runs in a separate thread until the build finishes (the main thread signals the event).
+
+	@param sock			Socket to the server
+	@param done			eventfd signaled by the main thread when the build is done
+	@param current		Output file name of the build we're running
+	@param canceled		Output file names of other builds in the batch the server canceled (only safe to read after
+						this thread has exited). Cancellations that arrive while we're fetching files instead are
+						recorded by RecvReply().
+ */
+void WatchForCancel(Socket& sock, int done, string current, set<string>& canceled)
+{
+	while(true)
+	{
+		//Wait for a message or the end of the build, whichever comes first
+		pollfd pfds[2];
+		pfds[0].fd = sock;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = done;
+		pfds[1].events = POLLIN;
+		int ret = poll(pfds, 2, -1);
+		if( (ret < 0) && (errno == EINTR) )
+			continue;
+		if( (ret > 0) && (pfds[1].revents & POLLIN) )
+			return;
+
+		//If we lost the server, there's no point in finishing the build either
+		SplashMsg msg;
+		if( (ret < 0) || !RecvMessage(sock, msg) )
+		{
+			CancelShellCommands();
+			return;
+		}
+
+		if(msg.Payload_case() != SplashMsg::kCancelBuild)
+		{
+			LogWarning("Got an unexpected message (type %d) during a build, ignoring it\n", msg.Payload_case());
+			continue;
+		}
+
+		//Canceling the build we're running? Kill it
+		string fname = msg.cancelbuild().fname();
+		if(fname == current)
+		{
+			LogDebug("Server canceled build of %s\n", fname.c_str());
+			CancelShellCommands();
+			return;
+		}
+
+		//Canceling something later in the batch, skip it when we get there
+		canceled.emplace(fname);
+	}
+}
+
 /**
 	@brief Process a "build request" message from a client
  */
 void ProcessBuildRequest(Socket& sock, const NodeBuildRequest& rxm)
 {
-	LogDebug("Build request\n");
+	NodeBuildBatch batch;
+	*batch.add_requests() = rxm;
+	ProcessBuildBatch(sock, batch);
+}
+
+/**
+	@brief Process a "build batch" message from a client.
+
+	The server sends batches of small jobs that aren't worth a round trip each. We fetch everything we're missing for
+	the whole batch in one go, then run the builds one after another and send back results for each as soon as it's
+	done. Every build in the batch gets a result, even if it fails before starting.
+ */
+void ProcessBuildBatch(Socket& sock, const NodeBuildBatch& rxm)
+{
+	LogDebug("Build batch (%d jobs)\n", rxm.requests_size());
 	LogIndenter li;
 
+	//Any cancellations we heard about before now were for earlier requests
+	set<string> stale;
+	TakeCanceledBuilds(stale);
+	set<string> canceled;
+
+	//Pull in every input we don't already have
+	map<string, string> missing;
+	vector<bool> incomplete(rxm.requests_size(), false);
+	for(int i=0; i<rxm.requests_size(); i++)
+	{
+		auto& req = rxm.requests(i);
+		for(int j=0; j<req.sources_size(); j++)
+		{
+			auto& src = req.sources(j);
+			if(!g_cache->IsCached(src.hash()))
+			{
+				missing[src.fname()] = src.hash();
+				incomplete[i] = true;
+			}
+		}
+		for(int j=0; j<req.deps_size(); j++)
+		{
+			auto& dep = req.deps(j);
+			if(!g_cache->IsCached(dep.hash()))
+			{
+				missing[dep.fname()] = dep.hash();
+				incomplete[i] = true;
+			}
+		}
+	}
+
+	//If that didn't work, fail every build that needed something from it rather than building without it
+	bool fetched = true;
+	if(!missing.empty())
+		fetched = RefreshRemoteFilesByHash(sock, g_clientSettings->GetServerHostname(), missing);
+	if(!fetched)
+		LogWarning("Failed to get input files for build batch\n");
+
+	//Run the builds
+	for(int i=0; i<rxm.requests_size(); i++)
+	{
+		SplashMsg reply;
+		auto replym = reply.mutable_nodebuildresults();
+		auto& req = rxm.requests(i);
+		replym->set_fname(req.fname());
+
+		//The server may have canceled some of the builds while we were fetching files
+		TakeCanceledBuilds(canceled);
+
+		if(canceled.find(req.fname()) != canceled.end())
+		{
+			LogDebug("Build of %s canceled before it started\n", req.fname().c_str());
+			replym->set_success(false);
+			replym->set_stdout("Build canceled");
+		}
+		else if(!fetched && incomplete[i])
+		{
+			replym->set_success(false);
+			replym->set_stdout("ERROR: Failed to get input files");
+		}
+		else
+			RunBuild(sock, req, replym, canceled);
+
+		SendMessage(sock, reply);
+	}
+}
+
+/**
+	@brief Runs a single build and fills out the results
+ */
+void RunBuild(Socket& sock, const NodeBuildRequest& rxm, NodeBuildResults* replym, set<string>& canceled)
+{
+	replym->set_success(false);
+
 	//Do setup stuff
 	Toolchain* chain = PrepBuild(rxm.toolchain());
 	if(!chain)
+	{
+		replym->set_stdout("ERROR: Toolchain not installed on build server");
 		return;
+	}
 	chdir(g_builddir.c_str());
 
 	//Look up the list of sources
@@ -603,7 +829,10 @@ void ProcessBuildRequest(Socket& sock, const NodeBuildRequest& rxm)
 		string fname = it.first;
 		LogTrace("source %s\n", fname.c_str());
 		if(!GrabSourceFile(sock, fname, it.second))
+		{
+			replym->set_stdout(string("ERROR: Failed to get source file ") + fname);
 			return;
+		}
 		fnames.emplace(g_builddir + "/" + fname);
 	}
 	for(auto it : deps)
@@ -615,7 +844,19 @@ void ProcessBuildRequest(Socket& sock, const NodeBuildRequest& rxm)
 			continue;
 
 		if(!GrabSourceFile(sock, fname, it.second))
+		{
+			replym->set_stdout(string("ERROR: Failed to get dependency ") + fname);
 			return;
+		}
+	}
+
+	//If the server canceled us while we were getting the files, don't bother starting
+	TakeCanceledBuilds(canceled);
+	if(canceled.find(rxm.fname()) != canceled.end())
+	{
+		LogDebug("Build of %s canceled before it started\n", rxm.fname().c_str());
+		replym->set_stdout("Build canceled");
+		return;
 	}
 
 	//Look up the list of flags
@@ -627,26 +868,41 @@ void ProcessBuildRequest(Socket& sock, const NodeBuildRequest& rxm)
 		flags.emplace(BuildFlag(flag));
 	}
 
-	//Format the return message
-	SplashMsg reply;
-	auto replym = reply.mutable_nodebuildresults();
-
-	//Do the actual build
+	//Do the actual build.
+	//The server doesn't send us anything but cancellations until we reply, so watch for those in the meantime.
+	ResetShellCommands();
+	int done = eventfd(0, EFD_CLOEXEC);
+	if(done < 0)
+	{
+		replym->set_stdout(string("ERROR: Failed to create eventfd: ") + strerror(errno));
+		return;
+	}
+	thread watcher(WatchForCancel, ref(sock), done, rxm.fname(), ref(canceled));
 	string stdout;
 	map<string, string> outputs;
-	if(!chain->Build(
+	bool ok = chain->Build(
 		rxm.arch(),
 		fnames,
 		GetBasenameOfFile(rxm.fname()),
 		flags,
 		outputs,
-		stdout))
+		stdout);
+	//Wake up the watcher right away rather than letting it time out, small jobs can't afford the wait
+	uint64_t one = 1;
+	if(write(done, &one, sizeof(one)) != (ssize_t)sizeof(one))
+		LogFatal("Failed to wake up the cancel watcher (%s)\n", strerror(errno));
+	watcher.join();
+	close(done);
+
+	//If we were canceled, don't bother sending back whatever partial output we got
+	if(ShellCommandsCanceled())
 	{
-		//Return the error code
-		replym->set_success(false);
+		LogDebug("Build canceled\n");
+		ok = false;
+		stdout = "Build canceled\n";
+		outputs.clear();
 	}
-	else
-		replym->set_success(true);
+	replym->set_success(ok);
 
 	//Do some cleanup on the stdout:
 	//* Remove blank lines and whitespace at the end
@@ -657,7 +913,6 @@ void ProcessBuildRequest(Socket& sock, const NodeBuildRequest& rxm)
 
 	//Set other flags
 	replym->set_stdout(stdout);
-	replym->set_fname(rxm.fname());
 
 	//Add our outputs
 	for(auto it : outputs)
@@ -669,12 +924,10 @@ void ProcessBuildRequest(Socket& sock, const NodeBuildRequest& rxm)
 		bf->set_data(GetFileContents(it.first));
 	}
 
-	//Successful completion of the run, send the results to the server
 	if(!replym->success())
 		LogDebug("Build failed\n");
 	//else
 	//	LogDebug("Build complete\n");
-	SendMessage(sock, reply);
 }
 
 void ShowVersion()
@@ -689,6 +942,13 @@ void ShowVersion()
 
 void ShowUsage()
 {
-	printf("Usage: splashbuild ctlserver\n");
+	printf(
+		"Usage: splashbuild [options] ctlserver\n"
+		"\n"
+		"    --nodenum N     Number of the first worker (used to name temporary directories)\n"
+		"    --ram MB        RAM available to jobs across all slots (default: all installed RAM)\n"
+		"    --scan-cache MB Disk space for cached dependency scan results (default: 256)\n"
+		"    --slots N       Number of jobs to run at once (default: 1)\n"
+		"    --uuid UUID     Machine ID to report to the server\n");
 	exit(0);
 }
@@ -38,7 +38,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <atomic>
 #include <string>
+#include <thread>
+
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <poll.h>
 
 void FindCPPCompilers();
 void FindLinkers();
@@ -35,7 +35,13 @@ using namespace std;
 // Construction / destruction
 
 BuildGraph::BuildGraph(WorkingCopy* wc)
-	: m_workingCopy(wc)
+	: m_finalizeBatch(NULL)
+	, m_finalizePending(NULL)
+	, m_finalizeNext(0)
+	, m_finalizeBusy(0)
+	, m_finalizeQuit(false)
+	, m_workingCopy(wc)
+	, m_garbagePossible(false)
 	, m_buildArtifactPath("build")			//TODO: make this configurable in the root Splashfile or something?
 	, m_sysIncludePath("__sysinclude__")
 {
@@ -45,6 +51,15 @@ BuildGraph::~BuildGraph()
 {
 	LogDebug("Destroying build graph\n");
 
+	//Shut down the finalization threads
+	{
+		lock_guard<mutex> lock(m_finalizeMutex);
+		m_finalizeQuit = true;
+	}
+	m_finalizeStartCondition.notify_all();
+	for(auto& t : m_finalizeThreads)
+		t.join();
+
 	//Delete all targets
 	for(auto it : m_targets)
 		delete it.second;
@@ -52,7 +67,7 @@ BuildGraph::~BuildGraph()
 
 	//Delete all nodes (in no particular order)
 	for(auto it : m_nodesByHash)
-		delete it.second;
+		DeleteNode(it.second);
 	m_nodesByHash.clear();
 }
 
@@ -77,6 +92,33 @@ BuildGraphNode* BuildGraph::GetNodeWithHash(string hash)
 	return m_nodesByHash[hash];
 }
 
+/**
+	@brief Find the node with a given pre-scan identity, or NULL if there isn't one
+ */
+BuildGraphNode* BuildGraph::GetNodeWithScanKey(string key)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	auto it = m_nodesByScanKey.find(key);
+	if(it == m_nodesByScanKey.end())
+		return NULL;
+	return it->second;
+}
+
+/**
+	@brief Record the node with a given pre-scan identity, replacing any stale node previously recorded for it
+ */
+void BuildGraph::SetNodeForScanKey(string key, BuildGraphNode* node)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	auto it = m_nodesByScanKey.find(key);
+	if(it != m_nodesByScanKey.end())
+		m_scanKeys.erase(it->second);
+	m_nodesByScanKey[key] = node;
+	m_scanKeys[node] = key;
+}
+
 /**
 	@brief Get a set of all targets, by name, de-duplicated by carch.
  */
@@ -179,11 +221,59 @@ void BuildGraph::GetNodes(set<string>& nodes)
 		nodes.emplace(it.first);
 }
 
+/**
+	@brief Get all targets which depend, directly or otherwise, on at least one of the given files
+
+	Only edges of finalized nodes are known, so nodes still waiting on a dependency scan are not considered. Changes to
+	build scripts are not considered either.
+
+	@param files		File names (relative to the working copy root)
+	@param targets		Set of target nodes (for all architectures and configurations) which have to be rebuilt
+ */
+void BuildGraph::GetAffectedTargets(const set<string>& files, set<BuildGraphNode*>& targets)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	//Walk the reverse edges out from the changed files
+	set<BuildGraphNode*> affected;
+	set<string> visited(files);
+	vector<string> pending(files.begin(), files.end());
+	while(!pending.empty())
+	{
+		auto path = pending.back();
+		pending.pop_back();
+
+		auto it = m_dependentNodes.find(path);
+		if(it == m_dependentNodes.end())
+			continue;
+
+		for(auto node : it->second)
+		{
+			if(!affected.emplace(node).second)
+				continue;
+			if(visited.emplace(node->GetFilePath()).second)
+				pending.push_back(node->GetFilePath());
+		}
+	}
+
+	//Report the ones that are current targets
+	for(auto it : m_targets)
+	{
+		for(auto jt : *it.second)
+		{
+			if(affected.find(jt.second) != affected.end())
+				targets.emplace(jt.second);
+		}
+	}
+}
+
 /**
 	@brief Checks if the requested target exists (for some arch/config combination)
  */
 bool BuildGraph::HasTarget(string target)
 {
+	lock_guard<recursive_mutex> lock(m_mutex);
+
 	for(auto it : m_targets)
 	{
 		TargetMap& cm = *it.second;
@@ -204,6 +294,8 @@ bool BuildGraph::HasTarget(string target)
  */
 void BuildGraph::GetTargets(set<BuildGraphNode*>& nodes, string target, string arch, string config, bool libs_too)
 {
+	lock_guard<recursive_mutex> lock(m_mutex);
+
 	//if(libs_too)
 	//	LogTrace("GetTargets with libs\n");
 
@@ -304,9 +396,18 @@ BuildGraphNode* BuildGraph::GetNodeWithPath(std::string fname)
 }
 
 /**
-	@brief Simple mark-and-sweep garbage collector to remove nodes we no longer have any references to
+	@brief Reference counting garbage collector to remove nodes we no longer have any references to
 
 	(for example, after deleting a dependency)
+
+	Each node is referenced by every target pointing to it, and by every referenced node depending on it. Since
+	finalized nodes never change, a node's references to its dependencies are taken once (when it first becomes
+	referenced, or when it's finalized if that comes later - see FinalizeCallback) and dropped when it's deleted.
+	So we only ever have to look at the targets, and at nodes which were added or lost a reference since last time,
+	not the whole graph.
+
+	Must be called with the graph locked continuously since the last node was finalized, so nothing can add
+	unfinalized nodes in between.
  */
 void BuildGraph::CollectGarbage()
 {
@@ -315,42 +416,150 @@ void BuildGraph::CollectGarbage()
 	//LogDebug("Collecting garbage\n");
 	//LogIndenter li;
 
-	//First pass: Mark all nodes unreferenced
-	//LogDebug("    Marking %zu nodes as unreferenced\n", m_nodesByHash.size());
-	for(auto it : m_nodesByHash)
-		it.second->SetUnref();
+	set<BuildGraphNode*> garbage;
 
-	//Second pass: Mark all of our targets as referenced.
-	//They will propagate the reference flag as needed.
-	//TODO: Mark tests as referenced (if tests are not the same as targets)
-	//LogDebug("    Marking architectures for %zu targets as referenced\n", m_targets.size());
+	//Update references from the target lists.
+	//There are few enough targets compared to other nodes that it's fine to look at all of them.
+	//TODO: Reference tests (if tests are not the same as targets)
+	set<BuildGraphNode*> roots;
 	for(auto it : m_targets)
 	{
-		//LogDebug("        Marking %zu targets for architecture %s as referenced\n",
-		//	it.second->size(), it.first.second.c_str());
 		for(auto jt : *it.second)
+			roots.emplace(jt.second);
+	}
+	for(auto n : roots)
+	{
+		if(m_roots.find(n) == m_roots.end())
+			AddReference(n);
+	}
+	for(auto n : m_roots)
+	{
+		if( (roots.find(n) == roots.end()) && (--m_refcounts[n] == 0) )
+			garbage.emplace(n);
+	}
+	m_roots.swap(roots);
+
+	//Anything new is garbage unless something references it.
+	//If a referenced node hasn't been finalized yet, we don't know what it depends on. New nodes may be its
+	//dependencies (object files it created while starting finalization, for example), so keep them until it is.
+	bool deferred = !m_deferredReferences.empty();
+	if(!deferred)
+	{
+		garbage.insert(m_newNodes.begin(), m_newNodes.end());
+		m_newNodes.clear();
+	}
+
+	//Delete everything that ended up with no references, and drop the references they held
+	//LogDebug("    Deleting %zu unreferenced nodes\n", garbage.size());
+	while(!garbage.empty())
+	{
+		auto node = *garbage.begin();
+		garbage.erase(garbage.begin());
+
+		auto rt = m_refcounts.find(node);
+		if(rt != m_refcounts.end())
+		{
+			if(rt->second != 0)
+				continue;
+			m_refcounts.erase(rt);
+		}
+
+		auto dt = m_referencedDependencies.find(node);
+		if(dt != m_referencedDependencies.end())
+		{
+			for(auto d : dt->second)
+			{
+				if(--m_refcounts[d] == 0)
+					garbage.emplace(d);
+			}
+			m_referencedDependencies.erase(dt);
+		}
+		m_deferredReferences.erase(node);
+		m_newNodes.erase(node);
+
+		//If the node was replaced in the graph by another with the same hash, leave the new one alone
+		auto it = m_nodesByHash.find(node->GetHash());
+		if( (it != m_nodesByHash.end()) && (it->second == node) )
+			m_nodesByHash.erase(it);
+		m_dirtyNodes.erase(node);
+		auto kt = m_scanKeys.find(node);
+		if(kt != m_scanKeys.end())
 		{
-			//LogDebug("            Marking nodes for target %s as referenced\n", jt.first.c_str());
-			jt.second->SetRef();
+			m_nodesByScanKey.erase(kt->second);
+			m_scanKeys.erase(kt);
 		}
+		for(auto d : node->GetDependencies())
+		{
+			auto et = m_dependentNodes.find(d);
+			if(et == m_dependentNodes.end())
+				continue;
+			et->second.erase(node);
+			if(et->second.empty())
+				m_dependentNodes.erase(et);
+		}
+		DeleteNode(node);
 	}
 
-	//Third pass: Make a list (by hash) of nodes to delete (can't delete them during iteration)
-	list<std::string> garbage;
-	//LogDebug("    Scanning for unreferenced nodes\n");
-	for(auto it : m_nodesByHash)
+	//If we had to keep new nodes around, look at them again next time
+	m_garbagePossible = deferred;
+}
+
+/**
+	@brief Adds a reference to a node, and if it wasn't referenced before, to all of its dependencies
+ */
+void BuildGraph::AddReference(BuildGraphNode* node)
+{
+	list<BuildGraphNode*> pending;
+	pending.push_back(node);
+	while(!pending.empty())
 	{
-		if(!it.second->IsReferenced())
-			garbage.push_back(it.first);
+		auto n = pending.front();
+		pending.pop_front();
+
+		//Already referenced, or still holding references to its dependencies? Nothing more to do
+		if( (m_refcounts[n]++ != 0) ||
+			(m_referencedDependencies.find(n) != m_referencedDependencies.end()) )
+		{
+			continue;
+		}
+
+		//If it's not finalized we don't know its dependencies yet. FinalizeCallback() will reference them.
+		if(!n->IsFinalized())
+		{
+			m_deferredReferences.emplace(n);
+			continue;
+		}
+
+		ReferenceDependencies(n, pending);
 	}
-	//LogDebug("        Found %d nodes\n", garbage.size());
+}
 
-	//Final step: actually delete them
-	//LogDebug("    Deleting unreferenced nodes\n");
-	for(auto hash : garbage)
+/**
+	@brief Records that a referenced node holds references to its dependencies
+
+	The dependencies are added to pending, and the caller is responsible for adding the references to them.
+ */
+void BuildGraph::ReferenceDependencies(BuildGraphNode* node, list<BuildGraphNode*>& pending)
+{
+	//Sources are a subset of dependencies, no need to process that
+	auto& deps = m_referencedDependencies[node];
+	for(auto x : node->GetDependencies())
 	{
-		delete m_nodesByHash[hash];
-		m_nodesByHash.erase(hash);
+		auto h = m_workingCopy->GetFileHash(x);
+		if(!HasNodeWithHash(h))
+		{
+			LogError(
+				"Node %s (with hash %s)\n"
+				"is a dependency of us (%s), but not in graph\n",
+				x.c_str(),
+				h.c_str(),
+				node->GetFilePath().c_str());
+			continue;
+		}
+
+		auto d = m_nodesByHash[h];
+		deps.push_back(d);
+		pending.push_back(d);
 	}
 }
 
@@ -364,8 +573,16 @@ void BuildGraph::CollectGarbage()
 	@param hash			Cache ID of the new script content
 	@param body			True if we should scan the body (file_config is included)
 	@param config		True if we should scan the recursive_config section
+	@param forceChildren	True to re-run every script below this one, even if its inherited config didn't change.
+							Needed when something other than the scripts (e.g. the set of toolchains) changed.
  */
-void BuildGraph::UpdateScript(string path, string hash, bool body, bool config, set<string>& dirtyScripts)
+void BuildGraph::UpdateScript(
+	string path,
+	string hash,
+	bool body,
+	bool config,
+	set<string>& dirtyScripts,
+	bool forceChildren)
 {
 	lock_guard<recursive_mutex> lock(m_mutex);
 
@@ -378,47 +595,98 @@ void BuildGraph::UpdateScript(string path, string hash, bool body, bool config,
 	//Reload the build script (and its dependencies).
 	//If we do not have any toolchains AT ALL, there's no point in doing this, though.
 	if(g_nodeManager->HasAnyToolchains())
-		InternalUpdateScript(path, hash, body, config, dirtyScripts);
+		InternalUpdateScript(path, hash, body, config, dirtyScripts, forceChildren);
 }
 
 /**
 	@brief Reloads a build script
  */
-void BuildGraph::InternalUpdateScript(string path, string hash, bool body, bool config, set<string>& dirtyScripts)
+void BuildGraph::InternalUpdateScript(
+	string path,
+	string hash,
+	bool body,
+	bool config,
+	set<string>& dirtyScripts,
+	bool forceChildren)
 {
+	//If we're changing recursive configuration, note what every script below us inherits right now
+	vector<string> scripts;
+	map<string, string> oldConfigs;
+	if(config)
+	{
+		GetScriptsBelow(GetDirOfFile(path), scripts);
+		for(auto s : scripts)
+			oldConfigs[s] = GetInheritedConfigKey(s);
+	}
+
 	//Delete all targets/tests declared in the file
 	InternalRemove(path);
 
 	//Read the new script and execute it
 	//Don't check if the file is in cache already, it was just updated and is thus LRU
-	ParseScript(g_cache->ReadCachedFile(hash), path, body, config, dirtyScripts);
+	ParseScript(hash, path, body, config, dirtyScripts);
 
-	//If we changed a script in a parent directory, go through all of our subdirectories and re-parse them
-	//since recursively inherited configuration may have changed.
-	//TODO: index somehow rather than having to do O(n) search of all known build scripts?
-	//TODO: can we patch the configs in at run time somehow rather than re-running it?
+	//If we changed a script in a parent directory, go through all of our subdirectories and re-parse the ones whose
+	//inherited configuration actually changed. Targets everywhere else keep their existing nodes (and scan results).
+	//Each one is only re-run once, parents before children, so everything sees the final inherited config.
+	//The key only covers our own configuration, so if the caller knows something else changed, re-run them all.
 	if(config)
 	{
 		LogIndenter li;
 
-		string dir = GetDirOfFile(path);
-		for(auto it : m_buildScriptPaths)
+		for(auto s : scripts)
 		{
-			//Path must have our path as a substring, but not be the same script
-			string s = it.first;
-			size_t pos = s.find(dir);
-			if( (pos != 0) || (s == path) )
+			if(s == path)
+				continue;
+			if(!forceChildren && (GetInheritedConfigKey(s) == oldConfigs[s]) )
 				continue;
 
-			//LogDebug("Build script %s needs to be re-run to reflect changed recursive configurations\n",
-			//	s.c_str());
-			//LogDebug("pos=%zu dir=%s path=%s\n", pos, dir.c_str(), path.c_str());
+			LogDebug("Build script %s needs to be re-run to reflect changed recursive configurations\n", s.c_str());
 
-			InternalUpdateScript(s, m_buildScriptPaths[s], body, config, dirtyScripts);
+			InternalRemove(s);
+			ParseScript(m_buildScriptPaths[s], s, body, config, dirtyScripts);
 		}
 	}
 }
 
+/**
+	@brief Gets all known build scripts in a directory or any of its subdirectories, shallowest first
+
+	m_buildScriptPaths is sorted by path, so everything under a directory is one contiguous range of it and we
+	don't have to look at any other scripts.
+
+	@param dir		Directory to search (empty string for the root of the working copy)
+	@param scripts	Paths of the scripts found
+ */
+void BuildGraph::GetScriptsBelow(string dir, vector<string>& scripts)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	auto it = m_buildScriptPaths.begin();
+	if(dir != "")
+	{
+		dir += "/";
+		it = m_buildScriptPaths.lower_bound(dir);
+	}
+	for(; it != m_buildScriptPaths.end(); it++)
+	{
+		if(it->first.compare(0, dir.length(), dir) != 0)
+			break;
+		scripts.push_back(it->first);
+	}
+
+	//Sort by depth, then by path
+	sort(scripts.begin(), scripts.end(),
+		[](const string& a, const string& b)
+		{
+			auto da = count(a.begin(), a.end(), '/');
+			auto db = count(b.begin(), b.end(), '/');
+			if(da != db)
+				return da < db;
+			return a < b;
+		});
+}
+
 /**
 	@brief Deletes a build script from the working copy
 
@@ -440,8 +708,11 @@ void BuildGraph::RemoveScript(string path)
  */
 void BuildGraph::InternalRemove(string path)
 {
+	//Anything the script's targets used might now be garbage
+	m_garbagePossible = true;
+
 	//Remove any recursive toolchain configurations declared in this file
-	for(auto x : m_toolchainSettings)
+	for(auto& x : m_toolchainSettings)
 		x.second.PurgeConfig(path);
 
 	//Find targets declared in that script
@@ -468,20 +739,35 @@ void BuildGraph::InternalRemove(string path)
 /**
 	@brief Loads and executes the YAML commands in the supplied script
 
-	@param script		Script content
+	@param hash			Cache ID of the script content
 	@param path			Relative path of the script (for error messages etc)
 	@param body			True if we should scan the body (file_config is included)
 	@param config		True if we should scan the recursive_config section
 	@param dirtyScripts	Set of scripts that might have to be rebuilt as a result of this one changing
  */
-void BuildGraph::ParseScript(const string& script, string path, bool body, bool config, set<string>& dirtyScripts)
+void BuildGraph::ParseScript(string hash, string path, bool body, bool config, set<string>& dirtyScripts)
 {
 	//LogDebug("Loading build script %s\n", path.c_str());
 
+	//If PreparseScripts already did the YAML parsing, just execute it
+	auto it = m_parsedScripts.find(hash);
+	if(it != m_parsedScripts.end())
+	{
+		if(it->second.error != "")
+		{
+			LogParseError("YAML parsing failed: %s\n", it->second.error.c_str());
+			return;
+		}
+
+		for(auto node : it->second.docs)
+			LoadYAMLDoc(node, path, body, config, dirtyScripts);
+		return;
+	}
+
 	try
 	{
 		//Read the root node
-		vector<YAML::Node> nodes = YAML::LoadAll(script);
+		vector<YAML::Node> nodes = YAML::LoadAll(g_cache->ReadCachedFile(hash));
 		for(auto node : nodes)
 			LoadYAMLDoc(node, path, body, config, dirtyScripts);
 	}
@@ -491,6 +777,78 @@ void BuildGraph::ParseScript(const string& script, string path, bool body, bool
 	}
 }
 
+/**
+	@brief Runs the YAML parser on a batch of build scripts in parallel, ahead of executing them.
+
+	Executing a script has to be done under our mutex, one script at a time, in order (parents before children so
+	inherited configuration is right). Parsing is independent per script though, and is most of the CPU time when a
+	large working copy is first loaded.
+
+	The parsed scripts are used by UpdateScript until ClearParsedScripts() is called.
+
+	@param hashes		Cache IDs of the scripts to parse
+ */
+void BuildGraph::PreparseScripts(const set<string>& hashes)
+{
+	//Skip anything we have already
+	vector<string> todo;
+	{
+		lock_guard<recursive_mutex> lock(m_mutex);
+		for(auto h : hashes)
+		{
+			if(m_parsedScripts.find(h) == m_parsedScripts.end())
+				todo.push_back(h);
+		}
+	}
+	if(todo.empty())
+		return;
+
+	//Parse without holding our mutex, so other users of the graph aren't blocked in the meantime
+	vector<ParsedScript> results(todo.size());
+	atomic<size_t> next(0);
+	auto worker = [&]
+	{
+		while(true)
+		{
+			size_t i = next ++;
+			if(i >= todo.size())
+				break;
+
+			try
+			{
+				results[i].docs = YAML::LoadAll(g_cache->ReadCachedFile(todo[i]));
+			}
+			catch(YAML::ParserException& exc)
+			{
+				results[i].error = exc.what();
+			}
+		}
+	};
+
+	//This thread does its share of the work too
+	size_t nthreads = max(1U, thread::hardware_concurrency());
+	nthreads = min(nthreads, todo.size());
+	vector<thread> threads;
+	for(size_t i=1; i<nthreads; i++)
+		threads.push_back(thread(worker));
+	worker();
+	for(auto& t : threads)
+		t.join();
+
+	lock_guard<recursive_mutex> lock(m_mutex);
+	for(size_t i=0; i<todo.size(); i++)
+		m_parsedScripts[todo[i]] = results[i];
+}
+
+/**
+	@brief Frees the scripts parsed by PreparseScripts once they're no longer needed
+ */
+void BuildGraph::ClearParsedScripts()
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+	m_parsedScripts.clear();
+}
+
 /**
 	@brief Loads and executes the YAML commands in a single document within a build script
 
@@ -557,10 +915,17 @@ void BuildGraph::LoadConfig(YAML::Node& node, bool recursive, string path)
  */
 void BuildGraph::AddNode(BuildGraphNode* node)
 {
+	lock_guard<recursive_mutex> lock(m_mutex);
+
 	//LogDebug("    Adding node %s to %p (%d nodes so far)\n", node->GetHash().c_str(), this, m_nodesByHash.size());
 
-	//Add the node
-	m_nodesByHash[node->GetHash()] = node;
+	//Add the node, and remember to finalize it during the next rebuild (instead of anything it replaced)
+	auto& slot = m_nodesByHash[node->GetHash()];
+	m_dirtyNodes.erase(slot);
+	slot = node;
+	m_dirtyNodes.emplace(node);
+	m_newNodes.emplace(node);
+	m_garbagePossible = true;
 
 	//Put it in the working copy
 	//Don't re-scan anything though
@@ -568,6 +933,63 @@ void BuildGraph::AddNode(BuildGraphNode* node)
 	m_workingCopy->UpdateFile(node->GetFilePath(), node->GetHash(), false, false, ignored);
 }
 
+/**
+	@brief Adds a node for a source file, unless we have one already
+
+	The node is shared with any other working copy that has the same version of the file (see NodePool).
+
+	@return The node
+ */
+BuildGraphNode* BuildGraph::AddSourceFileNode(string fname, string hash)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	if(HasNodeWithHash(hash))
+		return m_nodesByHash[hash];
+
+	BuildGraphNode* node;
+	if(g_nodePool)
+		node = g_nodePool->GetSourceFileNode(fname, hash);
+	else
+		node = new SourceFileNode(this, fname, hash);
+	AddNode(node);
+	return node;
+}
+
+/**
+	@brief Adds a node for a system library, unless we have one already
+
+	The node is shared with any other working copy that has the same version of the library (see NodePool).
+
+	@return The node
+ */
+BuildGraphNode* BuildGraph::AddSystemLibraryNode(string fname, string hash)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	if(HasNodeWithHash(hash))
+		return m_nodesByHash[hash];
+
+	BuildGraphNode* node;
+	if(g_nodePool)
+		node = g_nodePool->GetSystemLibraryNode(fname, hash);
+	else
+		node = new SystemLibraryNode(this, fname, hash);
+	AddNode(node);
+	return node;
+}
+
+/**
+	@brief Deletes a node we no longer need, or drops our reference to it if it's shared
+ */
+void BuildGraph::DeleteNode(BuildGraphNode* node)
+{
+	if(node->IsShared())
+		g_nodePool->Release(node);
+	else
+		delete node;
+}
+
 /**
 	@brief Loads configuration for a single target
  */
@@ -896,8 +1318,7 @@ bool BuildGraph::ProcessConstantTable(string scriptpath, string tablepath, strin
 		return false;
 	}
 	string hash = m_workingCopy->GetFileHash(rtpath);
-	if(!HasNodeWithHash(hash))
-		AddNode(new SourceFileNode(this, rtpath, hash));
+	AddSourceFileNode(rtpath, hash);
 	//LogDebug("Table has hash %s\n", hash.c_str());
 
 	//Look up the content of the file so we can crunch it
@@ -930,6 +1351,41 @@ bool BuildGraph::ProcessConstantTable(string scriptpath, string tablepath, strin
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Settings manipulation
 
+/**
+	@brief Gets a string describing all of the configuration a build script sees (for every toolchain).
+
+	Two scripts (or one script at two points in time) with the same key generate the same targets with the same flags.
+
+	@param path			Path to the build script
+ */
+string BuildGraph::GetInheritedConfigKey(string path)
+{
+	string key;
+	for(auto& it : m_toolchainSettings)
+	{
+		auto& settings = it.second;
+		key += it.first + "\n";
+
+		set<string> arches;
+		settings.GetDefaultArchitectures(arches, path);
+		for(auto a : arches)
+			key += "  arch " + a + "\n";
+
+		set<string> configs;
+		settings.GetConfigNames(path, configs);
+		for(auto c : configs)
+		{
+			key += "  config " + c + "\n";
+
+			set<BuildFlag> flags;
+			settings.GetFlags(c, path, flags);
+			for(auto f : flags)
+				key += "    " + static_cast<string>(f) + "\n";
+		}
+	}
+	return key;
+}
+
 /**
 	@brief Get the default architecture list for a given toolchain and scope
 
@@ -976,37 +1432,146 @@ void BuildGraph::GetFlags(string toolchain, string config, string path, set<Buil
 // Graph rebuilds
 
 /**
-	@brief Rebuilds all topology
+	@brief Rebuilds all topology that changed
 
 	We need to be able to do incremental rebuilds of the graph to avoid redoing everything when a single build script
 	changes (like the monstrosity that was Splash v0.1 did).
+
+	Finalized nodes are immutable: if anything a node depends on changes, the scripts using it are re-run and create
+	new nodes (with new hashes) for it and everything downstream of it. So the only nodes we have to finalize are the
+	ones added since the last rebuild. Nodes which can't be finalized yet (not the current version of their file in
+	the working copy) are retried next time, until they're collected as garbage.
  */
 void BuildGraph::Rebuild()
 {
 	//LogDebug("Rebuilding graph\n");
 	LogIndenter li;
 
-	lock_guard<recursive_mutex> lock(m_mutex);
+	//The graph isn't locked while nodes are finalized (see FinalizeNodes), so make sure nobody else rebuilds (and
+	//collects garbage) while we're working on it
+	lock_guard<mutex> rlock(m_rebuildMutex);
 
-	//Make a set of all of our nodes
-	//LogDebug("Building node set\n");
-	set<BuildGraphNode*> nodes;
-	for(auto it : m_nodesByHash)
-		nodes.emplace(it.second);
+	//Finalize each new node.
+	//Finalizing a node may add more (object files for an executable etc). These are normally finalized by the node
+	//that created them, but go around again until nothing new shows up just in case.
+	set<BuildGraphNode*> pending;
+	while(true)
+	{
+		unique_lock<recursive_mutex> lock(m_mutex);
+
+		//Nothing left to finalize? Collect any garbage we generated.
+		//Keep the graph locked from the check until GC is done, so nobody can slip in a target (and the
+		//unfinalized nodes under it) that GC would then see half-built.
+		if(m_dirtyNodes.empty())
+		{
+			m_dirtyNodes.insert(pending.begin(), pending.end());
+			if(m_garbagePossible)
+				CollectGarbage();
+			break;
+		}
+
+		vector<BuildGraphNode*> nodes(m_dirtyNodes.begin(), m_dirtyNodes.end());
+		m_dirtyNodes.clear();
+
+		//LogDebug("Finalizing %zu nodes\n", nodes.size());
+		for(auto n : nodes)
+			n->StartFinalization();
+		lock.unlock();
+
+		FinalizeNodes(nodes, pending);
+	}
+}
+
+/**
+	@brief Finalizes a batch of nodes whose finalization has been started, from several threads at once
+
+	Nodes are finalized without the graph locked. Each one locks itself (and the dependencies it finalizes along the
+	way), and only takes the graph mutex for lookups and for FinalizeCallback(), so the lock order while finalizing
+	is node before graph. Anything that locks the graph and then a node must hold the rebuild mutex, so it can't run
+	at the same time as this.
+
+	Threads simply take the next node in the list rather than having per-thread queues: all of the nodes are known
+	up front and none of them spawn more work in this batch, so there's nothing to steal.
+
+	@param nodes	The nodes to finalize
+	@param pending	Nodes that couldn't be finalized yet are added here
+ */
+void BuildGraph::FinalizeNodes(const vector<BuildGraphNode*>& nodes, set<BuildGraphNode*>& pending)
+{
+	unique_lock<mutex> lock(m_finalizeMutex);
+
+	//Start the helper threads the first time around.
+	//This thread does its share of the work too.
+	if(m_finalizeThreads.empty())
+	{
+		size_t nthreads = max(1U, thread::hardware_concurrency());
+		for(size_t i=1; i<nthreads; i++)
+			m_finalizeThreads.push_back(thread(&BuildGraph::FinalizeThreadProc, this));
+	}
+
+	m_finalizeBatch = &nodes;
+	m_finalizePending = &pending;
+	m_finalizeNext = 0;
+	m_finalizeStartCondition.notify_all();
+
+	RunFinalizeBatch(lock);
+
+	//Wait for the helpers to finish the nodes they took
+	while(m_finalizeBusy != 0)
+		m_finalizeDoneCondition.wait(lock);
+	m_finalizeBatch = NULL;
+	m_finalizePending = NULL;
+}
+
+/**
+	@brief Thread function for the finalization helpers: work on each batch as it shows up
+ */
+void BuildGraph::FinalizeThreadProc()
+{
+	unique_lock<mutex> lock(m_finalizeMutex);
+	while(true)
+	{
+		while(!m_finalizeQuit && ( (m_finalizeBatch == NULL) || (m_finalizeNext >= m_finalizeBatch->size()) ) )
+			m_finalizeStartCondition.wait(lock);
+		if(m_finalizeQuit)
+			return;
+
+		RunFinalizeBatch(lock);
+	}
+}
+
+/**
+	@brief Finalizes nodes from the current batch until there are none left to take
+
+	@param lock		Lock on m_finalizeMutex, released while each node is finalized
+ */
+void BuildGraph::RunFinalizeBatch(unique_lock<mutex>& lock)
+{
+	while( (m_finalizeBatch != NULL) && (m_finalizeNext < m_finalizeBatch->size()) )
+	{
+		auto n = (*m_finalizeBatch)[m_finalizeNext ++];
+		m_finalizeBusy ++;
+		lock.unlock();
 
-	//Finalize each node in the graph
-	//LogDebug("Finalizing nodes\n");
-	for(auto n : nodes)
-		n->StartFinalization();
-	for(auto n : nodes)
+		//Wait for the scans without the node locked, so nodes depending on this one aren't held up
+		n->WaitForScans();
 		n->Finalize();
+		bool finalized = n->IsFinalized();
+
+		lock.lock();
+		if(!finalized)
+			m_finalizePending->emplace(n);
+		m_finalizeBusy --;
+	}
 
-	//Collect any garbage we generated
-	CollectGarbage();
+	if(m_finalizeBusy == 0)
+		m_finalizeDoneCondition.notify_all();
 }
 
 void BuildGraph::FinalizeCallback(BuildGraphNode* node, string old_hash)
 {
+	lock_guard<recursive_mutex> lock(m_mutex);
+
 	//Update the node to the new hash
 	string new_hash = node->GetHash();
 	if(old_hash != new_hash)
@@ -1015,6 +1580,19 @@ void BuildGraph::FinalizeCallback(BuildGraphNode* node, string old_hash)
 		m_nodesByHash[new_hash] = node;
 	}
 
+	//Index the reverse edges so we can find everything a changed file affects
+	for(auto d : node->GetDependencies())
+		m_dependentNodes[d].emplace(node);
+
+	//If we were referenced before we knew our dependencies, reference them now (see AddReference)
+	if(m_deferredReferences.erase(node))
+	{
+		list<BuildGraphNode*> deps;
+		ReferenceDependencies(node, deps);
+		for(auto d : deps)
+			AddReference(d);
+	}
+
 	//Add dependencies to that node's script
 	string script = node->GetScript();
 	if(script != "")
@@ -1127,3 +1705,131 @@ string BuildGraph::GetIntermediateFilePath(
 
 	return path;
 }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Persistence
+
+/**
+	@brief Adds the dependency scan results of our object nodes to a snapshot
+
+	Only results that are still valid for the current working copy are saved, along with the hash of each file found
+	by the scan so they can be checked again when loaded.
+ */
+void BuildGraph::SaveScanResults(WorkingCopySnapshot& snap)
+{
+	//Asking the object nodes for their results locks them, which we can't do with the graph locked while they're
+	//being finalized (see FinalizeNodes). Wait for any rebuild in progress to finish.
+	lock_guard<mutex> rlock(m_rebuildMutex);
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	for(auto it : m_nodesByScanKey)
+	{
+		auto obj = dynamic_cast<CPPObjectNode*>(it.second);
+		if(obj == NULL)
+			continue;
+
+		set<string> deps;
+		set<BuildFlag> flags;
+		if(!obj->GetScanResults(deps, flags))
+			continue;
+
+		auto scan = snap.add_scans();
+		scan->set_key(it.first);
+		for(auto d : deps)
+		{
+			auto dep = scan->add_deps();
+			dep->set_fname(d);
+			dep->set_hash(m_workingCopy->GetFileHash(d));
+		}
+		for(auto f : flags)
+			scan->add_flags(static_cast<string>(f));
+	}
+
+	//Carry over anything we loaded but haven't needed yet (the target may not have been re-created so far)
+	//unless the client has since synced a different version of one of its files.
+	//Files not synced yet are given the benefit of the doubt, GetSavedScan checks them again when claimed.
+	for(auto it : m_savedScans)
+	{
+		bool valid = true;
+		for(auto d : it.second.deps())
+		{
+			if(m_workingCopy->HasFile(d.fname()) && (m_workingCopy->GetFileHash(d.fname()) != d.hash()) )
+			{
+				valid = false;
+				break;
+			}
+		}
+
+		if(valid)
+			*snap.add_scans() = it.second;
+	}
+}
+
+/**
+	@brief Loads dependency scan results from a snapshot
+
+	The results are used by object nodes created later on with the same pre-scan identity (see GetSavedScan).
+ */
+void BuildGraph::LoadScanResults(const WorkingCopySnapshot& snap)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	for(auto scan : snap.scans())
+		m_savedScans[scan.key()] = scan;
+}
+
+/**
+	@brief Claims the saved dependency scan results for an object node, if we have any
+
+	Results are only returned if every file found by the scan still has the same hash, since a changed header can pull
+	in different dependencies. Either way, the saved results are discarded afterwards.
+
+	System headers only get into the working copy when a scan finds them (see Scheduler::BlockOnScanResults), so right
+	after a restart most of them are missing. As in Scheduler::LookupScan, that's fine: we add them with the saved
+	hash, as long as their content is still in the cache.
+
+	@param key		Pre-scan identity of the node (see CPPObjectNode::GetScanKey)
+	@param deps		Files found by the scan
+	@param flags	Flags found by the scan
+
+	@return True if results were found
+ */
+bool BuildGraph::GetSavedScan(string key, set<string>& deps, set<BuildFlag>& flags)
+{
+	SnapshotScan scan;
+	{
+		lock_guard<recursive_mutex> lock(m_mutex);
+
+		auto it = m_savedScans.find(key);
+		if(it == m_savedScans.end())
+			return false;
+		scan = it->second;
+		m_savedScans.erase(it);
+	}
+
+	map<string, string> sysfiles;
+	for(auto d : scan.deps())
+	{
+		string fname = d.fname();
+		if(m_workingCopy->HasFile(fname))
+		{
+			if(m_workingCopy->GetFileHash(fname) != d.hash())
+				return false;
+		}
+		else if( (fname.find("__sys") != string::npos) && g_cache->IsCached(d.hash()) )
+			sysfiles[fname] = d.hash();
+		else
+			return false;
+	}
+
+	//Don't worry about changing anything with newly added files (same as after a fresh scan)
+	set<string> ignored;
+	for(auto it : sysfiles)
+		m_workingCopy->UpdateFile(it.first, it.second, false, false, ignored);
+
+	for(auto d : scan.deps())
+		deps.emplace(d.fname());
+	for(auto f : scan.flags())
+		flags.emplace(BuildFlag(f));
+	return true;
+}
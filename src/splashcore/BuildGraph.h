@@ -39,8 +39,8 @@ class WorkingCopy;
 /**
 	@brief A DAG of buildable objects
 
-	TODO: eventually consider having some of the graph nodes (source files etc) be shared across working copies
-	to reduce memory usage in large projects
+	Source file and system library nodes are shared across working copies (see NodePool) to reduce memory usage in
+	large projects. Nodes for generated files belong to a single graph.
 
 	Magic architecture "generic" = arch independent
 	Magic configuration "all" = config independent
@@ -51,8 +51,18 @@ public:
 	BuildGraph(WorkingCopy* wc);
 	virtual ~BuildGraph();
 
-	void UpdateScript(std::string path, std::string hash, bool body, bool config, std::set<std::string>& dirtyScripts);
+	void UpdateScript(
+		std::string path,
+		std::string hash,
+		bool body,
+		bool config,
+		std::set<std::string>& dirtyScripts,
+		bool forceChildren = false);
 	void RemoveScript(std::string path);
+	void GetScriptsBelow(std::string dir, std::vector<std::string>& scripts);
+
+	void PreparseScripts(const std::set<std::string>& hashes);
+	void ClearParsedScripts();
 
 	/**
 		@brief Gets the working copy.
@@ -65,8 +75,12 @@ public:
 	bool HasNodeWithHash(std::string hash);
 	BuildGraphNode* GetNodeWithHash(std::string hash);
 	BuildGraphNode* GetNodeWithPath(std::string fname);
+	BuildGraphNode* GetNodeWithScanKey(std::string key);
+	void SetNodeForScanKey(std::string key, BuildGraphNode* node);
 
 	void AddNode(BuildGraphNode* node);
+	BuildGraphNode* AddSourceFileNode(std::string fname, std::string hash);
+	BuildGraphNode* AddSystemLibraryNode(std::string fname, std::string hash);
 
 	void GetFlags(std::string toolchain, std::string config, std::string path, std::set<BuildFlag>& flags);
 
@@ -95,10 +109,21 @@ public:
 	void GetArches(std::set<std::string>& arches, std::string target);
 	void GetConfigs(std::set<std::string>& configs);
 	void GetNodes(std::set<std::string>& nodes);
+	void GetAffectedTargets(const std::set<std::string>& files, std::set<BuildGraphNode*>& targets);
 
 	std::recursive_mutex& GetMutex()
 	{ return m_mutex; }
 
+	/**
+		@brief Gets the mutex held for the duration of Rebuild().
+
+		Rebuild() finalizes nodes without the graph mutex held, so anything that needs every node to be finalized
+		(building, listing targets, etc) or locks nodes while holding the graph mutex should take this first, then
+		the graph mutex.
+	 */
+	std::mutex& GetRebuildMutex()
+	{ return m_rebuildMutex; }
+
 	void GetTargets(
 		std::set<BuildGraphNode*>& nodes,
 		std::string target,
@@ -109,9 +134,14 @@ public:
 	std::string GetBuildArtifactPath()
 	{ return m_buildArtifactPath; }
 
-	//Update dependencies of everything
+	//Update dependencies of everything that changed
 	void Rebuild();
 
+	//Persistence of dependency scan results (see WorkingCopy::SaveSnapshot)
+	void SaveScanResults(WorkingCopySnapshot& snap);
+	void LoadScanResults(const WorkingCopySnapshot& snap);
+	bool GetSavedScan(std::string key, std::set<std::string>& deps, std::set<BuildFlag>& flags);
+
 	//Update the location of a node during rebuilding
 	void FinalizeCallback(BuildGraphNode* node, std::string old_hash);
 
@@ -121,7 +151,10 @@ public:
 		This is used to force a re-scan of the dependent target as needed.
 	 */
 	void AddTargetDependencyHint(std::string libname, std::string targetscript)
-	{ m_dependentScripts[libname].emplace(targetscript); }
+	{
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		m_dependentScripts[libname].emplace(targetscript);
+	}
 
 	/**
 		@brief Get the set of build scripts that have to be re-scanned if a given target changes
@@ -142,10 +175,11 @@ protected:
 		std::string hash,
 		bool body,
 		bool config,
-		std::set<std::string>& dirtyScripts);
+		std::set<std::string>& dirtyScripts,
+		bool forceChildren);
 
 	void ParseScript(
-		const std::string& script,
+		std::string hash,
 		std::string path,
 		bool body,
 		bool config,
@@ -163,7 +197,14 @@ protected:
 	bool ProcessConstantTables(const YAML::Node& node, std::string path);
 	bool ProcessConstantTable(std::string scriptpath, std::string tablepath, std::string generator);
 
+	void FinalizeNodes(const std::vector<BuildGraphNode*>& nodes, std::set<BuildGraphNode*>& pending);
+	void FinalizeThreadProc();
+	void RunFinalizeBatch(std::unique_lock<std::mutex>& lock);
+
 	void CollectGarbage();
+	void DeleteNode(BuildGraphNode* node);
+	void AddReference(BuildGraphNode* node);
+	void ReferenceDependencies(BuildGraphNode* node, std::list<BuildGraphNode*>& pending);
 
 	void GetLibrariesForTarget(BuildGraphNode* target, std::set<BuildGraphNode*>& nodes);
 
@@ -172,6 +213,8 @@ protected:
 		std::string path,
 		std::set<std::string>& configs);
 
+	std::string GetInheritedConfigKey(std::string path);
+
 	void GetDefaultArchitecturesForToolchain(
 		std::string toolchain,
 		std::string path,
@@ -180,6 +223,37 @@ protected:
 	//Our mutex (need to be able to lock when already locked)
 	std::recursive_mutex m_mutex;
 
+	//Held for the duration of Rebuild()
+	std::mutex m_rebuildMutex;
+
+	//Threads helping Rebuild() finalize nodes (see FinalizeNodes).
+	//Started the first time they're needed and kept until the graph is destroyed.
+	std::vector<std::thread> m_finalizeThreads;
+
+	//Protects the batch state below
+	std::mutex m_finalizeMutex;
+
+	//Signaled when a batch is ready (or the threads should exit)
+	std::condition_variable m_finalizeStartCondition;
+
+	//Signaled when the last node of a batch is done
+	std::condition_variable m_finalizeDoneCondition;
+
+	//The batch being finalized, NULL if there isn't one
+	const std::vector<BuildGraphNode*>* m_finalizeBatch;
+
+	//Nodes of the batch that couldn't be finalized
+	std::set<BuildGraphNode*>* m_finalizePending;
+
+	//Index of the next node in the batch to finalize
+	size_t m_finalizeNext;
+
+	//Number of nodes being finalized right now
+	size_t m_finalizeBusy;
+
+	//Set when the graph is being destroyed
+	bool m_finalizeQuit;
+
 	//The working copy of the repository we're attached to (so we can access file content etc)
 	WorkingCopy* m_workingCopy;
 
@@ -187,10 +261,27 @@ protected:
 	//Map from path to hash
 	std::map<std::string, std::string> m_buildScriptPaths;
 
+	/**
+		@brief A build script that has been through the YAML parser but not executed yet
+	 */
+	struct ParsedScript
+	{
+		std::vector<YAML::Node> docs;
+		std::string error;
+	};
+
+	//Build scripts parsed ahead of time by PreparseScripts
+	//Map from hash to parsed content
+	std::map<std::string, ParsedScript> m_parsedScripts;
+
 	//Dependencies of source files
 	//Map from source file to set<script>
 	std::map<std::string, std::set<std::string> > m_sourceFileDependencies;
 
+	//Reverse dependency edges of finalized nodes
+	//Map from file name to set<node depending on it>
+	std::map<std::string, std::set<BuildGraphNode*> > m_dependentNodes;
+
 	//Track where targets were declared
 	//Map from path to target names (architecture doesn't matter)
 	typedef std::unordered_set<std::string> TargetSet;
@@ -221,6 +312,35 @@ protected:
 	//The nodes (map from hash to pointer)
 	std::map<std::string, BuildGraphNode*> m_nodesByHash;
 
+	//Nodes added since the last rebuild which haven't been finalized yet
+	std::set<BuildGraphNode*> m_dirtyNodes;
+
+	//True if nodes or targets were added or removed since the last garbage collection
+	bool m_garbagePossible;
+
+	//Garbage collection state (see CollectGarbage)
+	//Number of references to each node (from the target list, and from other referenced nodes)
+	std::map<BuildGraphNode*, unsigned int> m_refcounts;
+
+	//The dependencies each referenced node holds a reference to
+	std::map<BuildGraphNode*, std::vector<BuildGraphNode*> > m_referencedDependencies;
+
+	//Referenced nodes which weren't finalized yet, so they'll take references to their dependencies later
+	std::set<BuildGraphNode*> m_deferredReferences;
+
+	//Nodes which were targets as of the last garbage collection
+	std::set<BuildGraphNode*> m_roots;
+
+	//Nodes added since the last garbage collection
+	std::set<BuildGraphNode*> m_newNodes;
+
+	//Object nodes by pre-scan identity (see CPPObjectNode::GetScanKey), and the reverse mapping for cleanup
+	std::map<std::string, BuildGraphNode*> m_nodesByScanKey;
+	std::map<BuildGraphNode*, std::string> m_scanKeys;
+
+	//Dependency scan results loaded from a snapshot which no object node has claimed yet, by pre-scan identity
+	std::map<std::string, SnapshotScan> m_savedScans;
+
 	//Relative path for build artifacts to go
 	//(also used as logical path for temporary files the client never sees)
 	std::string m_buildArtifactPath;
@@ -40,8 +40,7 @@ using namespace std;
 	TODO: how do we use this? Disallow?
  */
 BuildGraphNode::BuildGraphNode()
-	: m_ref(false)
-	, m_job(NULL)
+	: m_job(NULL)
 	, m_finalizationStarted(false)
 	, m_finalized(false)
 {
@@ -59,8 +58,7 @@ BuildGraphNode::BuildGraphNode(
 	BuildFlag::FlagUsage usage,
 	string path,
 	string hash)
-	: m_ref(false)
-	, m_graph(graph)
+	: m_graph(graph)
 	, m_toolchain("")
 	, m_toolchainHash("")
 	, m_hash(hash)
@@ -71,10 +69,11 @@ BuildGraphNode::BuildGraphNode(
 	, m_path(path)
 	, m_usage(usage)
 	, m_job(NULL)
-	, m_finalizationStarted(false)
-	, m_finalized(false)
+	, m_finalizationStarted(graph == NULL)
+	, m_finalized(graph == NULL)
 	, m_invalidInput(false)
 {
+	//Shared nodes have no working copy to check against, and nothing to do when finalizing anyway
 }
 
 /**
@@ -89,8 +88,7 @@ BuildGraphNode::BuildGraphNode(
 	string scriptpath,
 	string path,
 	set<BuildFlag> flags)
-	: m_ref(false)
-	, m_graph(graph)
+	: m_graph(graph)
 	, m_toolchain(toolchain)
 	, m_arch(arch)
 	, m_config("generic")
@@ -126,8 +124,7 @@ BuildGraphNode::BuildGraphNode(
 	string scriptpath,
 	string path,
 	YAML::Node& node)
-	: m_ref(false)
-	, m_graph(graph)
+	: m_graph(graph)
 	, m_toolchain(toolchain)
 	, m_arch(arch)
 	, m_config(config)
@@ -240,9 +237,7 @@ void BuildGraphNode::LoadSourceFileNodes(
 		}
 
 		//Nope, need to create one
-		auto src = new SourceFileNode(m_graph, fname, hash);
-		m_graph->AddNode(src);
-		sourcenodes.emplace(src);
+		sourcenodes.emplace(m_graph->AddSourceFileNode(fname, hash));
 	}
 }
 
@@ -297,6 +292,17 @@ void BuildGraphNode::StartFinalization()
 	DoStartFinalization();
 }
 
+/**
+	@brief Block until any background work started by StartFinalization() is done
+
+	Finalize() would wait for it anyway, but it does so with this node locked. Calling this first keeps nodes that
+	depend on us from being held up while the scans run.
+ */
+void BuildGraphNode::WaitForScans()
+{
+	//Most nodes have nothing running in the background
+}
+
 /**
 	@brief Finalize this node
 
@@ -307,6 +313,10 @@ void BuildGraphNode::Finalize()
 {
 	lock_guard<recursive_mutex> lock(m_mutex);
 
+	//Shared nodes are always finalized
+	if(IsShared())
+		return;
+
 	//See if we are in the working copy.
 	//If we're not pointed to by the WC then we're an old version and should NOT be updated
 	//(since we're probably about to get GC'd)
@@ -322,9 +332,24 @@ void BuildGraphNode::Finalize()
 	if(!m_finalized)
 	{
 		DoFinalize();
+
+		//Our inputs can't change any more, swap them for the shared copies
+		m_dependencies.Freeze();
+		m_sources.Freeze();
+
+		//Mark ourself finalized before telling the graph. Other threads may reference our dependencies as soon as
+		//we're marked (see BuildGraph::AddReference), and FinalizeCallback() takes care of any that got in first.
+		m_finalized = true;
 		m_graph->FinalizeCallback(this, old_hash);
+
+		//If we were asked to build before we knew what that involved, the job can go now.
+		//Now that we know all of our inputs (headers included), let it look up their sizes first.
+		if(m_job != NULL)
+		{
+			m_job->UpdateInputSizes();
+			g_scheduler->OnJobRunnable(m_job);
+		}
 	}
-	m_finalized = true;
 
 	//Update the records for us in the working copy
 	//Don't re-scan anything, it's too late to change anything by this point
@@ -347,56 +372,6 @@ void BuildGraphNode::DoStartFinalization()
 {
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// GC reference marking
-
-/**
-	@brief Mark the node as referenced
- */
-void BuildGraphNode::SetRef()
-{
-	lock_guard<recursive_mutex> lock(m_mutex);
-
-	if(m_ref)
-		return;
-
-	m_ref = true;
-
-	//Mark our dependencies as referenced (if they're not already)
-	//Sources are a subset of dependencies, no need to process that
-	auto wc = m_graph->GetWorkingCopy();
-	for(auto x : m_dependencies)
-	{
-		auto h = wc->GetFileHash(x);
-
-		if(m_graph->HasNodeWithHash(h))
-			m_graph->GetNodeWithHash(h)->SetRef();
-		else
-		{
-			LogError(
-				"Node %s (with hash %s)\n"
-				"is a dependency of us (%s), but not in graph\n",
-				x.c_str(),
-				h.c_str(),
-				GetFilePath().c_str());
-		}
-	}
-}
-
-/// @brief Mark the node as unreferenced (do not propagate)
-void BuildGraphNode::SetUnref()
-{
-	lock_guard<recursive_mutex> lock(m_mutex);
-	m_ref = false;
-}
-
-/// @brief Checks if the node is referenced (do not propagate)
-bool BuildGraphNode::IsReferenced()
-{
-	lock_guard<recursive_mutex> lock(m_mutex);
-	return m_ref;
-}
-
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Accessors
 
@@ -456,11 +431,38 @@ void BuildGraphNode::SetInvalidInput(string errors)
  */
 Job* BuildGraphNode::Build(Job::Priority prio)
 {
+	//Shared nodes are source files and libraries, there's nothing to build
+	if(IsShared())
+		return NULL;
+
+	//Lock the graph before ourself.
+	//This is the opposite order to finalization, so the caller must hold the graph's rebuild mutex (see
+	//BuildGraph::FinalizeNodes).
+	lock_guard<recursive_mutex> glock(m_graph->GetMutex());
 	lock_guard<recursive_mutex> lock(m_mutex);
 
 	if(m_invalidInput)
 		return NULL;
 
+	//If we were created since the graph was last rebuilt, our hash and dependencies aren't known yet.
+	//Finalize now (blocking on our scans); if that doesn't work we're out of date and can't be built.
+	if(!m_finalized)
+	{
+		Finalize();
+		if(!m_finalized)
+		{
+			LogWarning("Node %s could not be finalized, not building it\n", GetFilePath().c_str());
+			return NULL;
+		}
+	}
+
+	//If the last build was canceled (the client gave up on it), forget about it and start over
+	if( (m_job != NULL) && (m_job->GetStatus() == Job::STATUS_CANCELED) )
+	{
+		m_job->Unref();
+		m_job = NULL;
+	}
+
 	//If we're already building, return a new reference to the existing job
 	if(m_job != NULL)
 	{
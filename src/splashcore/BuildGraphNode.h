@@ -30,6 +30,8 @@
 #ifndef BuildGraphNode_h
 #define BuildGraphNode_h
 
+class BuildJob;
+
 /**
 	@brief A single node in the build graph
  */
@@ -70,6 +72,7 @@ public:
 	virtual ~BuildGraphNode();
 
 	void StartFinalization();
+	virtual void WaitForScans();
 	void Finalize();
 
 	/**
@@ -80,6 +83,12 @@ public:
 	BuildGraph* GetGraph()
 	{ return m_graph; }
 
+	/**
+		@brief Checks if we're shared by all working copies (see NodePool), rather than belonging to a single graph
+	 */
+	bool IsShared()
+	{ return (m_graph == NULL); }
+
 	/**
 		@brief Get the hash of the node
 
@@ -132,9 +141,9 @@ public:
 	/**
 		@brief Get the dependencies of the node
 
-		No mutexing needed as this is static after object creation
+		No mutexing needed as this is static once the node is finalized
 	 */
-	const std::set<std::string>& GetDependencies() const
+	const SymbolSet& GetDependencies() const
 	{ return m_dependencies; }
 
 	/**
@@ -160,9 +169,9 @@ public:
 	/**
 		@brief Gets the path of our node (relative to the working copy)
 
-		No mutexing needed as this is static after object creation
+		No mutexing needed as this is static once the node is finalized
 	 */
-	const std::set<std::string>& GetSources()
+	const SymbolSet& GetSources()
 	{ return m_sources; }
 
 	/**
@@ -186,19 +195,29 @@ public:
 
 	virtual Job* Build(Job::Priority prio = Job::PRIO_NORMAL);
 
+	/**
+		@brief Gets the amount of RAM building this node takes, in MB.
+
+		This is a rough worst-case guess per node type, used by the scheduler to avoid overloading a build server.
+	 */
+	virtual unsigned int GetMemoryRequirement()
+	{ return 256; }
+
+	/**
+		@brief Gets the time building this node can take before we assume the build is hung, in seconds.
+
+		The scheduler re-issues jobs which run past this (or three times their usual run time, whichever is longer)
+		to another build server.
+	 */
+	virtual double GetTimeout()
+	{ return 600; }
+
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Debug helpers
 
 	void PrintInfo(int indentLevel = 0);
 	std::string GetIndent(int level);
 
-	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-	// Garbage collection during graph rebuilds
-
-	void SetRef();
-	void SetUnref();
-	bool IsReferenced();
-
 protected:
 
 	void SetInvalidInput(std::string errors);
@@ -220,17 +239,14 @@ protected:
 	//Our mutex (need to be able to lock when already locked)
 	std::recursive_mutex m_mutex;
 
-	/// @brief Indicates if the node is referenced
-	bool m_ref;
-
 	/// @brief Pointer to our parent graph
 	BuildGraph* m_graph;
 
 	/// @brief The toolchain this node is built with (may be empty string if a source file, etc)
-	std::string m_toolchain;
+	Symbol m_toolchain;
 
 	/// @brief The hash of the toolchain we're using (must be set in constructor; immutable)
-	std::string m_toolchainHash;
+	Symbol m_toolchainHash;
 
 	/**
 		@brief The hash of this node.
@@ -242,16 +258,16 @@ protected:
 	std::string m_hash;
 
 	/// @brief Architecture of this node, or "generic" if independent (source file etc)
-	std::string m_arch;
+	Symbol m_arch;
 
 	/// @brief Configuration of this node, or "generic" if independent
-	std::string m_config;
+	Symbol m_config;
 
 	/// @brief Human-readable name of this node (for debug messages)
 	std::string m_name;
 
 	/// @brief Path to the build script this node was declared in (for debug messages and relative paths)
-	std::string m_script;
+	Symbol m_script;
 
 	/// @brief Path to the file this node creates (or the input file, for source nodes)
 	std::string m_path;
@@ -265,15 +281,17 @@ protected:
 		The dependency list consists of files used, directly or otherwise, by this build step only. For example:
 		* An object file depends on the source and headers (including headers included indirectly).
 		* An executable depends on objects, but not sources.
+
+		Shared with every other node that has the same dependencies (see SymbolSet).
 	 */
-	std::set<std::string> m_dependencies;
+	SymbolSet m_dependencies;
 
 	/**
 		@brief Set of named files we feed directly to the compiler.
 
 		This should always be a strict subset of m_dependencies.
 	 */
-	std::set<std::string> m_sources;
+	SymbolSet m_sources;
 
 	/**
 		@brief The type of build operation we're doing (important for us to use the correct flags)
@@ -281,7 +299,7 @@ protected:
 	BuildFlag::FlagUsage m_usage;
 
 	/// @brief The job we currently have pending to build us
-	Job* m_job;
+	BuildJob* m_job;
 
 	/// @brief Indicates that this node has started the finalization process
 	bool m_finalizationStarted;
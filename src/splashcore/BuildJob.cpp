@@ -38,7 +38,17 @@ BuildJob::BuildJob(Priority prio, BuildFlag::FlagUsage usage, BuildGraphNode* ou
 	: Job(prio, toolchain)
 	, m_usage(usage)
 	, m_output(output)
+	, m_outputPath(output->GetFilePath())
+	, m_memoryRequirement(output->GetMemoryRequirement())
+	, m_timeout(output->GetTimeout())
+	, m_workingCopy(output->GetGraph()->GetWorkingCopy())
+	, m_inputSize(0)
 {
+	//Until the output node is finalized we don't know all of our inputs (the scanned headers are most of them).
+	//The node fills the sizes in once it is (see BuildGraphNode::Finalize).
+	if(output->IsFinalized())
+		UpdateInputSizes();
+
 	//TODO: Mark the job as pending in the cache so we can share build status between multiple concurrent builds
 }
 
@@ -59,3 +69,98 @@ bool BuildJob::IsRunnable()
 	//Fall back to the base class to make the final decision otherwise
 	return Job::IsRunnable();
 }
+
+/**
+	@brief Jobs are classified by type of build and toolchain, and identified by output path within that class
+ */
+bool BuildJob::GetHistoryKeys(string& jobclass, string& key)
+{
+	char usage[16];
+	snprintf(usage, sizeof(usage), "%04x", m_usage);
+	jobclass = string(usage) + "!" + m_toolchainHash;
+	key = jobclass + "!" + m_outputPath;
+	return true;
+}
+
+/**
+	@brief The RAM we need depends on what kind of node we're building (see BuildGraphNode::GetMemoryRequirement)
+ */
+unsigned int BuildJob::GetMemoryRequirement()
+{
+	return m_memoryRequirement;
+}
+
+/**
+	@brief The time we may take depends on what kind of node we're building (see BuildGraphNode::GetTimeout)
+ */
+double BuildJob::GetTimeout()
+{
+	return m_timeout;
+}
+
+/**
+	@brief Sums up the size of all of our sources and dependencies which are in the given set of hashes
+ */
+uint64_t BuildJob::GetCachedInputSize(const unordered_set<string>& hashes)
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	uint64_t size = 0;
+	for(auto& it : m_inputSizes)
+	{
+		if(hashes.find(it.first) != hashes.end())
+			size += it.second;
+	}
+	return size;
+}
+
+/**
+	@brief Sums up the size of all of our sources and dependencies
+ */
+uint64_t BuildJob::GetInputSize()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_inputSize;
+}
+
+/**
+	@brief Looks up the hashes and sizes of everything we read, so the scheduler can send us where they're already
+	cached.
+
+	Must be called once our output node is finalized, and not with the scheduler's mutex held: the scheduler needs
+	the sizes while holding it, and that's no place for a stat().
+ */
+void BuildJob::UpdateInputSizes()
+{
+	set<string> hashes;
+	for(auto s : m_output->GetSources())
+		hashes.emplace(m_workingCopy->GetFileHash(s));
+	for(auto d : m_output->GetDependencies())
+		hashes.emplace(m_workingCopy->GetFileHash(d));
+
+	map<string, uint64_t> sizes;
+	uint64_t total = 0;
+	for(auto& h : hashes)
+	{
+		if(h.empty())
+			continue;
+		uint64_t size = g_cache->GetFileSize(h);
+		sizes[h] = size;
+		total += size;
+	}
+
+	lock_guard<mutex> lock(m_mutex);
+	m_inputSizes.swap(sizes);
+	m_inputSize = total;
+}
+
+/**
+	@brief Gets the working copy whose graph our output node is in
+
+	This is remembered when we're created, so it's safe to call even after the working copy (and our output node)
+	has been deleted - the scheduler needs it to find us in its queues (see Scheduler::RemoveWorkingCopy).
+ */
+WorkingCopy* BuildJob::GetWorkingCopy()
+{
+	return m_workingCopy;
+}
@@ -43,11 +43,23 @@ public:
 	BuildGraphNode* GetOutputNode()
 	{ return m_output; }
 
+	/// @brief Get the path of the node we build (safe to call even after the node has been deleted)
+	std::string GetOutputPath()
+	{ return m_outputPath; }
+
 	/// @brief Get the type of build we're doing
 	BuildFlag::FlagUsage GetFlagUsage()
 	{ return m_usage; }
 
 	virtual bool IsRunnable();
+	virtual bool GetHistoryKeys(std::string& jobclass, std::string& key);
+	virtual unsigned int GetMemoryRequirement();
+	virtual double GetTimeout();
+	virtual uint64_t GetCachedInputSize(const std::unordered_set<std::string>& hashes);
+	virtual uint64_t GetInputSize();
+	virtual WorkingCopy* GetWorkingCopy();
+
+	void UpdateInputSizes();
 
 protected:
 	//must delete via refcounter
@@ -64,6 +76,35 @@ protected:
 		@brief The object which is to be generated by this job
 	 */
 	BuildGraphNode* m_output;
+
+	/**
+		@brief Path of the object we generate (cached since the node may go away before we do)
+	 */
+	std::string m_outputPath;
+
+	/**
+		@brief RAM needed to build the output, in MB (cached since the node may go away before we do)
+	 */
+	unsigned int m_memoryRequirement;
+
+	/**
+		@brief Time the build can run before we assume it's hung, in seconds (cached for the same reason)
+	 */
+	double m_timeout;
+
+	/**
+		@brief The working copy we're building for (cached for the same reason)
+	 */
+	WorkingCopy* m_workingCopy;
+
+	/**
+		@brief Hashes of our sources and dependencies, and their sizes (see UpdateInputSizes).
+		Protected by m_mutex.
+	 */
+	std::map<std::string, uint64_t> m_inputSizes;
+
+	/// @brief Total size of our sources and dependencies. Protected by m_mutex.
+	uint64_t m_inputSize;
 };
 
 #endif
@@ -92,10 +92,10 @@ void CPPExecutableNode::DoStartFinalization()
 			"object",
 			src);
 
-		//Create a test node first to compute the hash.
-		//If another node with that hash already exists, delete it and use the old node instead.
-		//TODO: more efficient way of doing this? cache dependencies and do simpler parse or something?
-		auto obj = new CPPObjectNode(
+		//If another executable already created an object node for this source with the same flags,
+		//use it (and its dependency scan) rather than scanning the file again.
+		//Checking whether it's current locks it, so don't do that with the graph locked (see BuildGraph::FinalizeNodes).
+		string key = CPPObjectNode::GetScanKey(
 			m_graph,
 			m_arch,
 			src,
@@ -103,18 +103,33 @@ void CPPExecutableNode::DoStartFinalization()
 			m_toolchain,
 			m_script,
 			compileAndScanFlags);
+		auto found = dynamic_cast<CPPObjectNode*>(m_graph->GetNodeWithScanKey(key));
+		CPPObjectNode* obj = NULL;
+		if( (found != NULL) && found->IsCurrent() )
+			obj = found;
 
-		//If we have a node for this hash already, delete it and use the existing one
-		string h = obj->GetHash();
-		if(m_graph->HasNodeWithHash(h))
+		//Nope, or it's stale. Make a new one, unless another executable beat us to it while we were checking
+		else
 		{
-			delete obj;
-			obj = dynamic_cast<CPPObjectNode*>(m_graph->GetNodeWithHash(h));
-		}
+			lock_guard<recursive_mutex> lock(m_graph->GetMutex());
 
-		//It's new, keep it and add to the graph
-		else
-			m_graph->AddNode(obj);
+			auto latest = dynamic_cast<CPPObjectNode*>(m_graph->GetNodeWithScanKey(key));
+			if( (latest != NULL) && (latest != found) )
+				obj = latest;
+			else
+			{
+				obj = new CPPObjectNode(
+					m_graph,
+					m_arch,
+					src,
+					fname,
+					m_toolchain,
+					m_script,
+					compileAndScanFlags);
+				m_graph->AddNode(obj);
+				m_graph->SetNodeForScanKey(key, obj);
+			}
+		}
 
 		//Either way we have the node now. Add to our list of sources.
 		m_objects.emplace(obj);
@@ -123,10 +138,27 @@ void CPPExecutableNode::DoStartFinalization()
 
 		//Add the object file to our working copy.
 		//Don't worry about dirtying targets in other files, there shouldn't be any
-		wc->UpdateFile(fname, h, false, false, ignored);
+		wc->UpdateFile(fname, obj->GetHash(), false, false, ignored);
 	}
 }
 
+/**
+	@brief Block until the dependency scans of all of our object files are done
+ */
+void CPPExecutableNode::WaitForScans()
+{
+	set<CPPObjectNode*> objects;
+	{
+		lock_guard<recursive_mutex> lock(m_mutex);
+		if(m_finalized)
+			return;
+		objects = m_objects;
+	}
+
+	for(auto obj : objects)
+		obj->WaitForScans();
+}
+
 /**
 	@brief Calculate our final hash etc
  */
@@ -47,6 +47,15 @@ public:
 		YAML::Node& node);
 	virtual ~CPPExecutableNode();
 
+	//Linking large binaries (especially with debug info) is fairly memory hungry
+	virtual unsigned int GetMemoryRequirement()
+	{ return 1024; }
+
+	virtual double GetTimeout()
+	{ return 1800; }
+
+	virtual void WaitForScans();
+
 protected:
 	virtual void DoFinalize();
 	virtual void DoStartFinalization();
@@ -54,12 +54,19 @@ CPPObjectNode::CPPObjectNode(
 
 	//Add an automatic dependency for the source file itself
 	auto wc = graph->GetWorkingCopy();
-	auto h = wc->GetFileHash(fname);
-	if(!graph->HasNodeWithHash(h))
-		graph->AddNode(new SourceFileNode(graph, fname, h));
+	graph->AddSourceFileNode(fname, wc->GetFileHash(fname));
 	m_sources.emplace(fname);
 	m_dependencies.emplace(fname);
 
+	//If we scanned this file in a previous session and nothing it depends on changed since, no need to do it again
+	m_scanJob = NULL;
+	m_restored = graph->GetSavedScan(
+		GetScanKey(graph, arch, fname, path, toolchain, script, flags),
+		m_restoredDeps,
+		m_restoredFlags);
+	if(m_restored)
+		return;
+
 	//Run the dependency scanner on this file to see what other stuff we need to pull in.
 	//This will likely require pulling a lot of files from the golden node.
 	//If the scan fails, declare us un-buildable.
@@ -80,6 +87,25 @@ CPPObjectNode::~CPPObjectNode()
 {
 }
 
+/**
+	@brief Block until our dependency scan is done
+ */
+void CPPObjectNode::WaitForScans()
+{
+	//The job is freed by DoFinalize, so grab our own reference while it's known to be valid
+	DependencyScanJob* job;
+	{
+		lock_guard<recursive_mutex> lock(m_mutex);
+		if(m_finalized || (m_scanJob == NULL) )
+			return;
+		job = m_scanJob;
+		job->Ref();
+	}
+
+	job->WaitForCompletion();
+	job->Unref();
+}
+
 /**
 	@brief Get the results of our library search
  */
@@ -99,10 +125,19 @@ void CPPObjectNode::DoFinalize()
 {
 	auto wc = m_graph->GetWorkingCopy();
 
-	//Block until the scan completes
+	//Block until the scan completes (unless we already have the results)
 	set<string> deps;
 	set<BuildFlag> foundflags;
-	if(g_scheduler->BlockOnScanResults(m_scanJob, wc, deps, foundflags, m_errors))
+	bool scanned;
+	if(m_restored)
+	{
+		deps.swap(m_restoredDeps);
+		foundflags.swap(m_restoredFlags);
+		scanned = true;
+	}
+	else
+		scanned = g_scheduler->BlockOnScanResults(m_scanJob, wc, deps, foundflags, m_errors);
+	if(scanned)
 	{
 		//Dependencies scanned OK, update our stuff
 		//Update our flags with the HAVE_xx macros from the libraries we located
@@ -166,13 +201,7 @@ void CPPObjectNode::DoFinalize()
 				deps.erase(libpath);
 
 				//If it wasn't already in the graph, create a node for it
-				string hash = wc->GetFileHash(libpath);
-				if(!m_graph->HasNodeWithHash(hash))
-				{
-					//LogDebug("[1] Creating SystemLibraryNode %s\n  with hash %s, graph %p\n",
-					//	libpath.c_str(), hash.c_str(), graph);
-					m_graph->AddNode(new SystemLibraryNode(m_graph, libpath, hash));
-				}
+				m_graph->AddSystemLibraryNode(libpath, wc->GetFileHash(libpath));
 			}
 		}
 
@@ -194,25 +223,14 @@ void CPPObjectNode::DoFinalize()
 			//LogDebug("found object/library dep %s\n", d.c_str());
 
 			//If it wasn't already in the graph, create a node for it
-			string hash = wc->GetFileHash(d);
-			if(!m_graph->HasNodeWithHash(hash))
-			{
-				//LogDebug("[2] Creating SystemLibraryNode %s\n  with hash %s, graph %p\n",
-				//	d.c_str(), hash.c_str(), graph);
-				m_graph->AddNode(new SystemLibraryNode(m_graph, d, hash));
-			}
+			m_graph->AddSystemLibraryNode(d, wc->GetFileHash(d));
 		}
 
 		//Add source nodes if we don't have them already
 		for(auto d : deps)
 		{
-			auto h = wc->GetFileHash(d);
-
-			//See what type of file we got as a dependency.
-
 			//Create a new node if needed
-			if(!m_graph->HasNodeWithHash(h))
-				m_graph->AddNode(new SourceFileNode(m_graph, d, h));
+			m_graph->AddSourceFileNode(d, wc->GetFileHash(d));
 
 			//Either way, we have the node now. Add it to our list of inputs.
 			m_dependencies.emplace(d);
@@ -235,8 +253,23 @@ void CPPObjectNode::DoFinalize()
 	//	LogDebug("Flag: %s\n", static_cast<string>(f).c_str());
 
 	//Calculate our hash.
-	//Dependencies and flags are obvious
 	//NOTE: This needs to happen *even if our dependency scan failed* so that we can identify the scan errors
+	m_hash = CalculateHash();
+
+	//If the dependency scan failed, add a dummy cached file with the proper ID and stdout
+	//so we can query the result in the cache later on.
+	if(m_errors != "")
+		SetInvalidInput(m_errors);
+}
+
+/**
+	@brief Calculates our hash from the current state of our dependencies
+ */
+string CPPObjectNode::CalculateHash()
+{
+	auto wc = m_graph->GetWorkingCopy();
+
+	//Dependencies and flags are obvious
 	string hashin;
 	for(auto d : m_dependencies)
 		hashin += wc->GetFileHash(d);
@@ -251,10 +284,86 @@ void CPPObjectNode::DoFinalize()
 	//Having multiple files with identical inputs merged into a single node is *desirable*.
 
 	//Done, calculate final hash
-	m_hash = sha256(hashin);
+	return sha256(hashin);
+}
 
-	//If the dependency scan failed, add a dummy cached file with the proper ID and stdout
-	//so we can query the result in the cache later on.
-	if(m_errors != "")
-		SetInvalidInput(m_errors);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Pre-scan de-duplication
+
+/**
+	@brief Computes the identity of an object node from everything that is known before the dependency scan.
+
+	Two executables (or an executable and a library) sharing a source file with identical flags produce the same key,
+	so the second one can reuse the node (and the in-flight scan) of the first rather than scanning the file again.
+
+	The script is part of the key since dependency hints for the scanned headers are recorded against our script.
+
+	@param graph		The graph the node will be part of
+	@param arch			Target architecture
+	@param fname		Path to the source file
+	@param path			Path to the object file
+	@param toolchain	Name of the toolchain
+	@param script		Build script declaring the node
+	@param flags		Compile and scan flags
+ */
+string CPPObjectNode::GetScanKey(
+	BuildGraph* graph,
+	string arch,
+	string fname,
+	string path,
+	string toolchain,
+	string script,
+	const set<BuildFlag>& flags)
+{
+	auto wc = graph->GetWorkingCopy();
+
+	string hashin;
+	hashin += sha256(fname);
+	hashin += wc->GetFileHash(fname);
+	hashin += sha256(path);
+	hashin += sha256(script);
+	for(auto f : flags)
+		hashin += sha256(f);
+	hashin += g_nodeManager->GetToolchainHash(arch, toolchain);
+	hashin += sha256(arch);
+	return sha256(hashin);
+}
+
+/**
+	@brief Checks if we can be reused by a node with the same scan key.
+
+	A node still being scanned will pick up the current state of the working copy when it's finalized, so it's fine.
+	Once finalized, our hash is stale if any of the headers we found changed since.
+ */
+bool CPPObjectNode::IsCurrent()
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	if(!m_finalized)
+		return true;
+	return (CalculateHash() == m_hash);
+}
+
+/**
+	@brief Gets the results of our dependency scan, in the form BlockOnScanResults returns them
+
+	@return False if we haven't been scanned yet, the scan failed, or the results are stale
+ */
+bool CPPObjectNode::GetScanResults(set<string>& deps, set<BuildFlag>& flags)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	if(!m_finalized || (m_errors != "") )
+		return false;
+	if(CalculateHash() != m_hash)
+		return false;
+
+	//Libraries found by the scan were moved out of our dependency list
+	for(auto d : m_dependencies)
+		deps.emplace(d);
+	for(auto d : m_libdeps)
+		deps.emplace(d);
+	for(auto f : m_flags)
+		flags.emplace(f);
+	return true;
 }
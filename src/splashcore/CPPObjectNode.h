@@ -47,17 +47,46 @@ public:
 	);
 	virtual ~CPPObjectNode();
 
+	//Big template-heavy translation units can take a lot of RAM to compile
+	virtual unsigned int GetMemoryRequirement()
+	{ return 1024; }
+
+	virtual double GetTimeout()
+	{ return 900; }
+
 	void GetLibraryScanResults(
 		std::set<std::string>& libdeps,
 		std::set<BuildFlag>& libflags);
 
+	static std::string GetScanKey(
+		BuildGraph* graph,
+		std::string arch,
+		std::string fname,
+		std::string path,
+		std::string toolchain,
+		std::string script,
+		const std::set<BuildFlag>& flags);
+
+	bool IsCurrent();
+
+	bool GetScanResults(std::set<std::string>& deps, std::set<BuildFlag>& flags);
+
+	virtual void WaitForScans();
+
 protected:
 	virtual void DoFinalize();
 
+	std::string CalculateHash();
+
 	std::string m_errors;
 
 	DependencyScanJob* m_scanJob;
 
+	//Dependency scan results restored from a snapshot, used instead of m_scanJob if m_restored is set
+	bool m_restored;
+	std::set<std::string> m_restoredDeps;
+	std::set<BuildFlag> m_restoredFlags;
+
 	std::set<std::string> m_libdeps;
 	std::set<BuildFlag> m_libflags;
 };
@@ -231,6 +231,22 @@ string Cache::ReadCachedFile(string id)
 	return ret;
 }
 
+/**
+	@brief Gets the size of a file in the cache, in bytes (zero if not cached)
+ */
+uint64_t Cache::GetFileSize(string id)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	if(!IsCached(id))
+		return 0;
+
+	struct stat st;
+	if(0 != stat((GetStoragePath(id) + "/data").c_str(), &st))
+		return 0;
+	return st.st_size;
+}
+
 /**
 	@brief Reads the log from a file from the cache
  */
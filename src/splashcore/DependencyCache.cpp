@@ -35,6 +35,8 @@ using namespace std;
 // Construction / destruction
 
 DependencyCache::DependencyCache()
+	: m_storageLimit(0)
+	, m_writesSinceTrim(0)
 {
 
 }
@@ -44,23 +46,270 @@ DependencyCache::~DependencyCache()
 
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Storage management
+
+/**
+	@brief Sets the directory to persist entries in
+
+	@param path		Storage directory (empty = memory only)
+	@param limit	Maximum size of the storage directory, in bytes
+ */
+void DependencyCache::SetStoragePath(string path, uint64_t limit)
+{
+	m_storagePath = path;
+	m_storageLimit = limit;
+	m_writesSinceTrim = 0;
+}
+
+/**
+	@brief Deletes the least recently used entries in a storage directory if it's over the size limit
+
+	Several processes may trim the same directory at once. That's harmless: the worst case is that an entry somebody
+	else just wrote or read gets deleted, and it will simply be regenerated on the next miss.
+
+	@param path		Storage directory
+	@param limit	Maximum size of the storage directory, in bytes
+ */
+void DependencyCache::TrimStorage(string path, uint64_t limit)
+{
+	//Find every entry, along with its size and last use time
+	vector< pair<time_t, pair<uint64_t, string> > > entries;
+	uint64_t total = 0;
+	double now = GetTime();
+	for(unsigned int i=0; i<256; i++)
+	{
+		char hex[3];
+		snprintf(hex, sizeof(hex), "%02x", i);
+		string dirname = path + "/" + hex;
+		DIR* hdir = opendir(dirname.c_str());
+		if(!hdir)
+			continue;
+
+		dirent* pent;
+		while((pent = readdir(hdir)))
+		{
+			if(pent->d_name[0] == '.')
+				continue;
+
+			string fname = dirname + "/" + pent->d_name;
+			struct stat st;
+			if(0 != stat(fname.c_str(), &st))
+				continue;
+
+			//Leave temporary files alone unless they're left over from a crash
+			if( (strstr(pent->d_name, ".tmp") != NULL) && (now - st.st_mtime) < 3600)
+				continue;
+
+			total += st.st_size;
+			entries.push_back(pair<time_t, pair<uint64_t, string> >(
+				st.st_mtime, pair<uint64_t, string>(st.st_size, fname)));
+		}
+		closedir(hdir);
+	}
+
+	if(total <= limit)
+		return;
+
+	//Delete oldest first until we're at 80% of the limit, so we don't have to do this again right away
+	sort(entries.begin(), entries.end());
+	uint64_t target = limit / 5 * 4;
+	size_t ndeleted = 0;
+	for(auto& e : entries)
+	{
+		if(total <= target)
+			break;
+		unlink(e.second.second.c_str());
+		total -= e.second.first;
+		ndeleted ++;
+	}
+
+	LogDebug("Dependency cache %s was over its size limit, deleted %zu entries\n", path.c_str(), ndeleted);
+}
+
+/**
+	@brief Drops the in-memory copies of the least recently used entries, if needed, to make room for a new one
+
+	Anything persisted is still on disk and will be loaded again if it's needed.
+ */
+void DependencyCache::MakeRoomInMemory()
+{
+	while( (m_cache.size() >= MAX_MEMORY_ENTRIES) && !m_lru.empty() )
+	{
+		string hash = m_lru.back();
+		m_lru.pop_back();
+		m_lruPositions.erase(hash);
+		m_cache.erase(hash);
+	}
+}
+
+/**
+	@brief Marks an in-memory entry as the most recently used one
+ */
+void DependencyCache::Touch(string hash)
+{
+	auto it = m_lruPositions.find(hash);
+	if(it != m_lruPositions.end())
+		m_lru.erase(it->second);
+	m_lru.push_front(hash);
+	m_lruPositions[hash] = m_lru.begin();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Cache lookups
 
 /**
-	@brief
+	@brief Check if a given object is in the cache (in memory, or on disk if we have a storage path)
+ */
+bool DependencyCache::IsCached(string hash)
+{
+	if(m_cache.find(hash) != m_cache.end())
+	{
+		Touch(hash);
+		return true;
+	}
+
+	return LoadEntry(hash);
+}
+
+/**
+	@brief Adds a new scan result to the cache, and persists it if we have a storage path
  */
 void DependencyCache::AddEntry(string hash, CachedDependencies& deps)
 {
+	if(m_cache.find(hash) == m_cache.end())
+		MakeRoomInMemory();
 	m_cache[hash] = deps;
+	Touch(hash);
+
+	if(m_storagePath.empty())
+		return;
+
+	//Serialize it
+	DependencyResults entry;
+	entry.set_result(deps.m_ok);
+	entry.set_stdout(deps.m_stdout);
+	for(auto d : deps.m_deps)
+	{
+		auto rd = entry.add_deps();
+		rd->set_fname(d);
+		auto it = deps.m_filedeps.find(d);
+		if(it != deps.m_filedeps.end())
+			rd->set_hash(it->second);
+	}
+	for(auto f : deps.m_libflags)
+		entry.add_libflags(f);
+	string data;
+	if(!entry.SerializeToString(&data))
+		return;
+
+	//Write to a temporary file and move it into place, so other processes never see a partial entry
+	string path = GetStoragePath(hash);
+	MakeDirectoryRecursive(GetDirOfFile(path), 0700);
+	string tmp = path + ".tmp" + to_string(getpid());
+	if(!PutFileContents(tmp, data))
+		return;
+	if(0 != rename(tmp.c_str(), path.c_str()))
+	{
+		LogWarning("Couldn't store dependency cache entry %s\n", hash.c_str());
+		unlink(tmp.c_str());
+	}
+
+	//Every so often, make sure the directory hasn't grown too big
+	m_writesSinceTrim ++;
+	if(m_writesSinceTrim >= 256)
+	{
+		TrimStorage(m_storagePath, m_storageLimit);
+		m_writesSinceTrim = 0;
+	}
+}
+
+/**
+	@brief Loads a persisted entry into memory, if there is one
+ */
+bool DependencyCache::LoadEntry(string hash)
+{
+	if(m_storagePath.empty())
+		return false;
+
+	//Another process's TrimStorage() can delete the entry at any time, so open it once and read from the handle
+	//rather than checking whether it exists first. An empty file would parse as a valid (failed) scan, so treat a
+	//missing, empty or short file as a miss.
+	string path = GetStoragePath(hash);
+	FILE* fp = fopen(path.c_str(), "rb");
+	if(!fp)
+		return false;
+	fseek(fp, 0, SEEK_END);
+	long fsize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if(fsize <= 0)
+	{
+		fclose(fp);
+		return false;
+	}
+	string buf(fsize, '\0');
+	size_t len = fread(&buf[0], 1, fsize, fp);
+	fclose(fp);
+	if(len != (size_t)fsize)
+		return false;
+
+	DependencyResults entry;
+	if(!entry.ParseFromString(buf))
+	{
+		LogWarning("Dependency cache entry %s is corrupted, ignoring it\n", hash.c_str());
+		return false;
+	}
+
+	//Mark it as recently used so TrimStorage() keeps it
+	utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+
+	MakeRoomInMemory();
+	Touch(hash);
+	CachedDependencies& deps = m_cache[hash];
+	deps.m_ok = entry.result();
+	deps.m_stdout = entry.stdout();
+	for(int i=0; i<entry.deps_size(); i++)
+	{
+		auto& d = entry.deps(i);
+		deps.m_deps.emplace(d.fname());
+		if(!d.hash().empty())
+			deps.m_filedeps[d.fname()] = d.hash();
+	}
+	for(int i=0; i<entry.libflags_size(); i++)
+		deps.m_libflags.emplace(BuildFlag(entry.libflags(i)));
+	return true;
+}
+
+/**
+	@brief Gets the path used for persisting a particular entry
+ */
+string DependencyCache::GetStoragePath(string hash)
+{
+	return m_storagePath + "/" + hash.substr(0, 2) + "/" + hash;
 }
 
 /**
 	@brief Get the hash for a given input configuration
+
+	@param toolchain		Hash of the toolchain doing the scan
+	@param sysfingerprint	Fingerprint of the system include/library directories (Toolchain::GetSystemFingerprint)
+	@param filehash			SHA-256 of the content of the file being scanned
+	@param path				Path of the file being scanned, relative to the build root
+	@param triplet			Target triplet
+	@param flags			Flags for the scan
  */
-string DependencyCache::GetHash(string fname, string triplet, const set<BuildFlag>& flags)
+string DependencyCache::GetHash(
+	string toolchain,
+	string sysfingerprint,
+	string filehash,
+	string path,
+	string triplet,
+	const set<BuildFlag>& flags)
 {
-	string hashin = sha256_file(fname);
+	string hashin = toolchain;
+	hashin += sysfingerprint;
+	hashin += filehash;
+	hashin += sha256(path);
 	hashin += sha256(triplet);
 	for(auto f : flags)
 		hashin += sha256(f);
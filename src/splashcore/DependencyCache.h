@@ -52,6 +52,21 @@ public:
 
 /**
 	@brief A cache of dependency-scan results
+
+	Entries are keyed by the toolchain, the system fingerprint (see Toolchain::GetSystemFingerprint), the content hash
+	and path of the scanned file, the target triplet, and the flags.
+	If a storage path is set, entries are also written to disk there (one file per entry, a serialized
+	DependencyResults message, written atomically) and read back on a miss. Since entries are content addressed and
+	never modified, any number of processes may share one storage directory, and the results survive restarts.
+
+	The storage directory is kept under a size limit: reading an entry bumps its mtime, and every so often the
+	least recently used entries are deleted until the directory is comfortably under the limit. Only a bounded number
+	of entries are kept in memory (the most recently used ones); the rest are re-read from disk as needed.
+
+	Directory structure:
+	$STORAGE/
+		xx/				first octet of hash, as hex
+			hash		the cache entry
  */
 class DependencyCache
 {
@@ -59,15 +74,21 @@ public:
 	DependencyCache();
 	virtual ~DependencyCache();
 
-	std::string GetHash(std::string fname, std::string triplet, const std::set<BuildFlag>& flags);
+	void SetStoragePath(std::string path, uint64_t limit);
+
+	static void TrimStorage(std::string path, uint64_t limit);
+
+	std::string GetHash(
+		std::string toolchain,
+		std::string sysfingerprint,
+		std::string filehash,
+		std::string path,
+		std::string triplet,
+		const std::set<BuildFlag>& flags);
 
 	void AddEntry(std::string hash, CachedDependencies& deps);
 
-	/**
-		@brief Check if a given object is in the cache
-	 */
-	bool IsCached(std::string hash)
-	{ return m_cache.find(hash) != m_cache.end(); }
+	bool IsCached(std::string hash);
 
 	/**
 		@brief Get the cache results for a given hash index
@@ -76,7 +97,31 @@ public:
 	{ return m_cache[hash]; }
 
 protected:
+	std::string GetStoragePath(std::string hash);
+	bool LoadEntry(std::string hash);
+
+	void MakeRoomInMemory();
+	void Touch(std::string hash);
+
 	std::map<std::string, CachedDependencies> m_cache;
+
+	//Hashes of the entries in m_cache, most recently used first
+	std::list<std::string> m_lru;
+
+	//Position of each entry of m_cache in m_lru
+	std::map<std::string, std::list<std::string>::iterator> m_lruPositions;
+
+	//Maximum number of entries kept in memory
+	static const size_t MAX_MEMORY_ENTRIES = 4096;
+
+	//Directory that entries are persisted in
+	std::string m_storagePath;
+
+	//Maximum size of the storage directory, in bytes
+	uint64_t m_storageLimit;
+
+	//Number of entries written since we last trimmed the storage directory
+	unsigned int m_writesSinceTrim;
 };
 
 #endif
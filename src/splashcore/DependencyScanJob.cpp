@@ -45,6 +45,7 @@ DependencyScanJob::DependencyScanJob(
 	, m_workingCopy(wc)
 	, m_flags(flags)
 	, m_arch(arch)
+	, m_pinned(false)
 {
 }
 
@@ -85,6 +85,20 @@ public:
 	void SetErrors(const std::string& err)
 	{ m_errors = err; }
 
+	/// @brief True if the scan has to run on the golden node for its toolchain
+	bool IsPinned()
+	{ return m_pinned; }
+
+	void SetPinned(bool pinned)
+	{ m_pinned = pinned; }
+
+	/// @brief Key to remember the results under once the scan succeeds (see Scheduler::RecordScan)
+	std::string GetMemoKey()
+	{ return m_memoKey; }
+
+	void SetMemoKey(std::string key)
+	{ m_memoKey = key; }
+
 protected:
 
 	/// @brief Path of the input file
@@ -116,6 +130,12 @@ protected:
 		@brief Additional flags produced by the scan
 	 */
 	std::set<BuildFlag> m_foundFlags;
+
+	/// @brief True if the scan has to run on the golden node for its toolchain
+	bool m_pinned;
+
+	/// @brief Key to remember the results under (empty = don't)
+	std::string m_memoKey;
 };
 
 #endif
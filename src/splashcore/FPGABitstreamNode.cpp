@@ -158,8 +158,7 @@ bool FPGABitstreamNode::GenerateConstraintFile(
 	m_graph->GetWorkingCopy()->UpdateFile(path, hash, false, false, ignored);
 
 	//Create a source file node for it, if needed
-	if(!m_graph->HasNodeWithHash(hash))
-		m_graph->AddNode(new SourceFileNode(m_graph, path, hash));
+	m_graph->AddSourceFileNode(path, hash);
 
 	return true;
 }
@@ -52,6 +52,12 @@ public:
 		YAML::Node& node);
 	virtual ~FPGABitstreamNode();
 
+	virtual unsigned int GetMemoryRequirement()
+	{ return 2048; }
+
+	virtual double GetTimeout()
+	{ return 3600; }
+
 protected:
 	virtual void DoFinalize();
 	virtual void DoStartFinalization();
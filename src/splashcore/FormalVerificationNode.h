@@ -47,6 +47,13 @@ public:
 		YAML::Node& node);
 	virtual ~FormalVerificationNode();
 
+	//Solvers can blow up memory usage on hard proofs
+	virtual unsigned int GetMemoryRequirement()
+	{ return 4096; }
+
+	virtual double GetTimeout()
+	{ return 12 * 3600; }
+
 protected:
 	virtual void DoFinalize();
 	virtual void DoStartFinalization();
@@ -71,6 +71,14 @@ GNUCToolchain::GNUCToolchain(string basepath, string triplet)
 		vector<string> paths;
 		FindDefaultIncludePaths(paths, basepath, false, t);
 		m_defaultIncludePaths[t] = paths;
+
+		//Scan results depend on what's in the system include and library directories
+		for(auto p : paths)
+			AddSystemDirectory(t, p, true);
+		vector<string> libpaths;
+		FindDefaultLibraryPaths(libpaths, basepath, t);
+		for(auto p : libpaths)
+			AddSystemDirectory(t, p, false);
 		m_virtualSystemIncludePath[t] =
 			"__sysinclude__/" + str_replace(" ", "_", m_stringVersion) + "_" + t;
 	}
@@ -328,6 +328,38 @@ void GNUToolchain::FindDefaultIncludePaths(vector<string>& paths, string exe, bo
 	}
 }
 
+/**
+	@brief Ask the compiler which directories it searches for libraries
+ */
+void GNUToolchain::FindDefaultLibraryPaths(vector<string>& paths, string exe, string arch)
+{
+	//We must have valid flags for this arch
+	if(!VerifyFlags(arch))
+		return;
+	string aflags = m_archflags[arch];
+
+	//Looking for a line of the form "libraries: =/path/one/:/path/two/"
+	vector<string> lines;
+	ParseLines(ShellCommand(exe + " " + aflags + " -print-search-dirs"), lines);
+	for(auto line : lines)
+	{
+		if(line.find("libraries: =") != 0)
+			continue;
+
+		vector<string> dirs;
+		ParseLines(line.substr(strlen("libraries: =")), dirs, false, ':');
+		for(auto d : dirs)
+		{
+			//Most of these don't exist, and the rest usually have a few ../ in them
+			if(!DoesDirectoryExist(d))
+				continue;
+			string dir = CanonicalizePath(d);
+			if(find(paths.begin(), paths.end(), dir) == paths.end())
+				paths.push_back(dir);
+		}
+	}
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Meta-flag processing
 
@@ -771,6 +803,20 @@ bool GNUToolchain::FindLibraries(
 	fprintf(fp, "int main(){return 0;}\n");
 	fclose(fp);
 
+	//If a package was installed or removed since we last looked, any of our cached search results may be stale
+	string fingerprint = chain->GetSystemFingerprint(triplet);
+	if(m_libFingerprints[triplet] != fingerprint)
+	{
+		for(auto it = m_libpaths.begin(); it != m_libpaths.end(); )
+		{
+			if(it->first.first == triplet)
+				it = m_libpaths.erase(it);
+			else
+				++it;
+		}
+		m_libFingerprints[triplet] = fingerprint;
+	}
+
 	for(auto f : flags)
 	{
 		if(f.GetType() != BuildFlag::TYPE_LIBRARY)
@@ -46,6 +46,7 @@ public:
 	GNUToolchain(std::string arch, std::string exe, GNUType type);
 
 	void FindDefaultIncludePaths(std::vector<std::string>& paths, std::string exe, bool cpp, std::string arch);
+	void FindDefaultLibraryPaths(std::vector<std::string>& paths, std::string exe, std::string arch);
 
 	std::string ParseStringVersion(std::string basepath);
 
@@ -122,6 +123,11 @@ protected:
 	 */
 	std::map<std::pair<std::string, std::string>, std::string> m_libpaths;
 
+	/**
+		@brief System fingerprint of each architecture at the time m_libpaths was filled in
+	 */
+	std::map<std::string, std::string> m_libFingerprints;
+
 	/**
 		@brief Hashes for a bunch of libc stuff
 	 */
@@ -199,8 +199,7 @@ bool HDLNetlistNode::ScanDependencies(string fname)
 
 		//Add a source file node for it (if we don't have one already)
 		auto h = wc->GetFileHash(cpath);
-		if(!m_graph->HasNodeWithHash(h))
-			m_graph->AddNode(new SourceFileNode(m_graph, cpath, h));
+		m_graph->AddSourceFileNode(cpath, h);
 
 		//Pull it in
 		m_dependencies.emplace(cpath);
@@ -51,6 +51,13 @@ public:
 	);
 	virtual ~HDLNetlistNode();
 
+	//Synthesis of large designs needs a lot of RAM
+	virtual unsigned int GetMemoryRequirement()
+	{ return 4096; }
+
+	virtual double GetTimeout()
+	{ return 4 * 3600; }
+
 protected:
 	virtual void DoFinalize();
 
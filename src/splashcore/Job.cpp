@@ -39,7 +39,16 @@ Job::Job(Job::Priority prio, string toolchain)
 	, m_toolchainHash(toolchain)
 	, m_status(STATUS_PENDING)
 	, m_refcount(1)				//one ref, to our creator
+	, m_pendingDependencies(0)
+	, m_dependencyFailed(false)
 	, m_ok(false)
+	, m_resultClaimed(false)
+	, m_startTime(0)
+	, m_runTime(-1)
+	, m_sequence(0)
+	, m_estimatedDuration(0)
+	, m_criticalPath(0)
+	, m_readyTime(0)
 {
 
 }
@@ -48,7 +57,10 @@ Job::Job(Job::Priority prio, string toolchain)
 Job::~Job()
 {
 	for(auto d : m_dependencies)
+	{
+		d->RemoveDependent(this);
 		d->Unref();
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -87,92 +99,383 @@ void Job::SetPending()
 {
 	lock_guard<mutex> lock(m_mutex);
 	m_status = STATUS_PENDING;
+	m_resultClaimed = false;
+	m_worker = "";
 }
 
 void Job::SetDone(bool ok)
 {
-	lock_guard<mutex> lock(m_mutex);
-	m_status = STATUS_DONE;
-	m_ok = ok;
+	Finish(STATUS_DONE, ok);
 }
 
 void Job::SetCanceled()
 {
-	lock_guard<mutex> lock(m_mutex);
-	m_status = STATUS_CANCELED;
+	Finish(STATUS_CANCELED, false);
 }
 
 void Job::SetRunning()
 {
 	lock_guard<mutex> lock(m_mutex);
+
+	//If we're already running (duplicate copy of a straggler), keep the original start time.
+	//If we were canceled while waiting in a batch, stay that way.
+	if( (m_status == STATUS_RUNNING) || (m_status == STATUS_DONE) || (m_status == STATUS_CANCELED) )
+		return;
+
 	m_status = STATUS_RUNNING;
+	m_startTime = GetTime();
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Scheduling
+/**
+	@brief Gets the time we started running (zero if we haven't)
+ */
+double Job::GetStartTime()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_startTime;
+}
 
-void Job::AddDependency(Job* job)
+/**
+	@brief Claims the right to report results for this job.
+
+	A job may be running on more than one node at once (see Scheduler::PopStraggler). Whoever gets results back
+	first claims the job and reports them. Later copies must throw their results away, as must anyone reporting
+	back on a job which has been canceled (see Scheduler::CancelJobs).
+
+	@param worker	Hostname of the node the results came from
+
+	@return True if the caller is the first to claim the job
+ */
+bool Job::ClaimResult(string worker)
 {
 	lock_guard<mutex> lock(m_mutex);
+	if(m_resultClaimed || (m_status == STATUS_CANCELED) )
+		return false;
+	m_resultClaimed = true;
+	m_worker = worker;
+	return true;
+}
 
-	job->Ref();
-	m_dependencies.emplace(job);
+/**
+	@brief Gets the hostname of the node which reported our results (empty if nobody has yet)
+ */
+string Job::GetWorker()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_worker;
 }
 
 /**
-	@brief Checks if this job is runnable (all dependency jobs are complete)
+	@brief Gets the time we spent running, in seconds (negative if we didn't run to completion)
  */
-bool Job::IsRunnable()
+double Job::GetRunTime()
 {
 	lock_guard<mutex> lock(m_mutex);
+	return m_runTime;
+}
 
-	//Check each of our dependencies
-	for(auto d : m_dependencies)
+/**
+	@brief Gets the keys this job's run time should be filed under in the JobHistory
+
+	@return False if this job isn't tracked
+ */
+bool Job::GetHistoryKeys(string& /*jobclass*/, string& /*key*/)
+{
+	return false;
+}
+
+/**
+	@brief Gets the amount of RAM this job needs on the node running it, in MB
+
+	The default is zero (negligible, e.g. dependency scans).
+ */
+unsigned int Job::GetMemoryRequirement()
+{
+	return 0;
+}
+
+/**
+	@brief Gets the total size of the inputs to this job which are in a given set of hashes, in bytes
+
+	Used to find out how much data a node already has cached for running us. The default is zero (no inputs).
+ */
+uint64_t Job::GetCachedInputSize(const unordered_set<string>& /*hashes*/)
+{
+	return 0;
+}
+
+/**
+	@brief Gets the total size of the inputs to this job, in bytes (as far as the server's cache knows)
+ */
+uint64_t Job::GetInputSize()
+{
+	return 0;
+}
+
+/**
+	@brief Gets the working copy this job was submitted on behalf of (NULL if none)
+ */
+WorkingCopy* Job::GetWorkingCopy()
+{
+	return NULL;
+}
+
+/**
+	@brief Gets the time this job can run before we assume it's hung, in seconds
+
+	The default is zero (no timeout).
+ */
+double Job::GetTimeout()
+{
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Completion
+
+/**
+	@brief Marks the job as done or canceled, wakes up anyone waiting on it, and updates jobs depending on us
+ */
+void Job::Finish(Status status, bool ok)
+{
+	bool failed = (status == STATUS_CANCELED) || !ok;
+	vector<Job*> unblocked;
 	{
-		auto status = d->GetStatus();
+		lock_guard<mutex> lock(m_mutex);
 
-		//If the dependency was canceled we will never be runnable
-		if(status == STATUS_CANCELED)
-			return false;
+		//If we already finished, the first result sticks (we may have been run more than once, see Scheduler)
+		if( (m_status == STATUS_DONE) || (m_status == STATUS_CANCELED) )
+			return;
 
-		//If the dependency isn't done, no go
-		if(status != STATUS_DONE)
+		if( (status == STATUS_DONE) && (m_status == STATUS_RUNNING) )
+			m_runTime = GetTime() - m_startTime;
+		m_status = status;
+		m_ok = ok;
+		m_completionCondition.notify_all();
+		for(auto w : m_waiters)
+			w->OnJobCompleted();
+
+		//Update the dependency counters while holding our mutex, so dependents can't be freed under us.
+		//Lock ordering is always dependency first, then dependent.
+		for(auto d : m_dependents)
 		{
-			/*
-			auto bj = dynamic_cast<BuildJob*>(d);
-			if(bj)
-			{
-				LogDebug("Job is not runnable because dependency %s is not done\n",
-					bj->GetOutputNode()->GetFilePath().c_str());
-			}
-			*/
-			return false;
+			if(d->OnDependencyFinished(failed))
+				unblocked.push_back(d);
 		}
 	}
 
+	//Let the scheduler know, since jobs depending on us may be runnable (or dead) now.
+	//Must not hold our own mutex here, the scheduler may need to query our status.
+	if(g_scheduler)
+	{
+		for(auto d : unblocked)
+			g_scheduler->OnJobUnblocked(d);
+		g_scheduler->OnJobCompleted(this);
+	}
+}
+
+/**
+	@brief Checks if this job has finished running (either done or canceled)
+ */
+bool Job::IsFinished()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return (m_status == STATUS_DONE) || (m_status == STATUS_CANCELED);
+}
+
+/**
+	@brief Blocks the calling thread until this job is done or canceled
+ */
+void Job::WaitForCompletion()
+{
+	unique_lock<mutex> lock(m_mutex);
+	m_completionCondition.wait(lock, [this]
+		{ return (m_status == STATUS_DONE) || (m_status == STATUS_CANCELED); });
+}
+
+/**
+	@brief Blocks the calling thread until this job is done or canceled, or the timeout expires
+
+	@param timeout	Maximum time to wait, in seconds
+
+	@return True if the job finished, false if we timed out
+ */
+bool Job::WaitForCompletion(double timeout)
+{
+	unique_lock<mutex> lock(m_mutex);
+	if(timeout < 0)
+		timeout = 0;
+	return m_completionCondition.wait_for(
+		lock,
+		chrono::duration<double>(timeout),
+		[this]{ return (m_status == STATUS_DONE) || (m_status == STATUS_CANCELED); });
+}
+
+/**
+	@brief Blocks the calling thread until all of our dependencies are done or canceled, or the timeout expires
+
+	@param timeout	Maximum time to wait, in seconds
+
+	@return True if the dependencies all finished, false if we timed out
+ */
+bool Job::WaitForDependencies(double timeout)
+{
+	//Make a copy of the list so we don't hold our mutex while blocking.
+	//The dependencies can't go away under us since we hold a reference to each.
+	set<Job*> deps;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		deps = m_dependencies;
+	}
+
+	double deadline = GetTime() + timeout;
+	for(auto d : deps)
+	{
+		if(!d->WaitForCompletion(deadline - GetTime()))
+			return false;
+	}
 	return true;
 }
 
 /**
-	@brief Checks if this job is failed (at least one dependency job was canceled or failed)
+	@brief Registers a JobWaiter to be notified when we finish.
+
+	If we already finished, the waiter is notified right away.
  */
-bool Job::IsCanceledByDeps()
+void Job::AddWaiter(JobWaiter* waiter)
 {
 	lock_guard<mutex> lock(m_mutex);
+	if( (m_status == STATUS_DONE) || (m_status == STATUS_CANCELED) )
+		waiter->OnJobCompleted();
+	else
+		m_waiters.emplace(waiter);
+}
 
-	//Check each of our dependencies
-	for(auto d : m_dependencies)
+/**
+	@brief Stops notifying a JobWaiter. Must be called before the waiter is destroyed.
+ */
+void Job::RemoveWaiter(JobWaiter* waiter)
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_waiters.erase(waiter);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Scheduling
+
+void Job::AddDependency(Job* job)
+{
 	{
-		auto status = d->GetStatus();
+		lock_guard<mutex> lock(m_mutex);
+		if(!m_dependencies.emplace(job).second)
+			return;
+	}
 
-		//If the dependency was canceled we will never be runnable
-		if(status == STATUS_CANCELED)
-			return true;
+	job->Ref();
+	job->AddDependent(this);
+}
 
-		//If the dependency completed, but failed, we will never be runnable
-		if( (status == STATUS_DONE) && (!d->IsSuccessful()) )
-			return true;
+/**
+	@brief Registers a job which depends on us, and bumps its pending-dependency counter if we're not done yet
+
+	Called on the dependency with the dependent as the argument.
+ */
+void Job::AddDependent(Job* job)
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	//If we already finished, the dependent never has to wait on us
+	bool finished = (m_status == STATUS_DONE) || (m_status == STATUS_CANCELED);
+	if(!finished)
+		m_dependents.emplace(job);
+
+	lock_guard<mutex> lock2(job->m_mutex);
+	if(!finished)
+		job->m_pendingDependencies ++;
+	else if( (m_status == STATUS_CANCELED) || !m_ok )
+		job->m_dependencyFailed = true;
+}
+
+/**
+	@brief Forgets about a dependent job (called from the dependent's destructor)
+ */
+void Job::RemoveDependent(Job* job)
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_dependents.erase(job);
+}
+
+/**
+	@brief Updates our counters when one of our dependencies finishes.
+
+	Called with the dependency's mutex held.
+
+	@param failed	True if the dependency was canceled or failed
+
+	@return True if this was the last dependency we were waiting on, or the first one to fail
+ */
+bool Job::OnDependencyFinished(bool failed)
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	m_pendingDependencies --;
+
+	if(failed)
+	{
+		bool first_failure = !m_dependencyFailed;
+		m_dependencyFailed = true;
+		return first_failure;
 	}
 
+	return (m_pendingDependencies == 0);
+}
+
+/**
+	@brief Gets a copy of the list of jobs we depend on
+ */
+set<Job*> Job::GetDependencies()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_dependencies;
+}
+
+/**
+	@brief Checks if any of our dependencies are still waiting to run
+ */
+bool Job::HasPendingDependencies()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return (m_pendingDependencies != 0);
+}
+
+/**
+	@brief Checks if anything that depends on us is still waiting to run (i.e. somebody still needs our output)
+ */
+bool Job::HasPendingDependents()
+{
+	lock_guard<mutex> lock(m_mutex);
+	for(auto d : m_dependents)
+	{
+		if(!d->IsFinished())
+			return true;
+	}
 	return false;
 }
+
+/**
+	@brief Checks if this job is runnable (all dependency jobs are complete)
+ */
+bool Job::IsRunnable()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return (m_pendingDependencies == 0) && !m_dependencyFailed;
+}
+
+/**
+	@brief Checks if this job is failed (at least one dependency job was canceled or failed)
+ */
+bool Job::IsCanceledByDeps()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_dependencyFailed;
+}
@@ -30,6 +30,9 @@
 #ifndef Job_h
 #define Job_h
 
+class WorkingCopy;
+class JobWaiter;
+
 /**
 	@brief A job which needs to run on a build node
  */
@@ -84,6 +87,14 @@ public:
 	void SetCanceled();
 	void SetRunning();
 
+	bool IsFinished();
+	void WaitForCompletion();
+	bool WaitForCompletion(double timeout);
+	bool WaitForDependencies(double timeout);
+
+	void AddWaiter(JobWaiter* waiter);
+	void RemoveWaiter(JobWaiter* waiter);
+
 	//Reference counting for job status etc
 	void Ref();
 	void Unref();
@@ -95,15 +106,74 @@ public:
 
 	virtual bool IsRunnable();
 	bool IsCanceledByDeps();
+	bool HasPendingDependencies();
+	bool HasPendingDependents();
 
 	bool IsSuccessful()
 	{ return m_ok; }
 
+	std::set<Job*> GetDependencies();
+
+	double GetRunTime();
+
+	virtual bool GetHistoryKeys(std::string& jobclass, std::string& key);
+
+	virtual unsigned int GetMemoryRequirement();
+	virtual double GetTimeout();
+
+	double GetStartTime();
+	bool ClaimResult(std::string worker);
+	std::string GetWorker();
+
+	virtual uint64_t GetCachedInputSize(const std::unordered_set<std::string>& hashes);
+	virtual uint64_t GetInputSize();
+
+	virtual WorkingCopy* GetWorkingCopy();
+
+	/**
+		@brief Scheduler bookkeeping.
+
+		These are only touched by the Scheduler, with its mutex held, so no locking is needed here.
+		The one exception is the estimated duration, which progress estimation reads without the mutex
+		(see Scheduler::GetEstimatedTimeRemaining), so it's atomic.
+	 */
+	uint64_t GetSequence()
+	{ return m_sequence; }
+
+	void SetSequence(uint64_t sequence)
+	{ m_sequence = sequence; }
+
+	double GetEstimatedDuration()
+	{ return m_estimatedDuration; }
+
+	void SetEstimatedDuration(double duration)
+	{ m_estimatedDuration = duration; }
+
+	double GetCriticalPath()
+	{ return m_criticalPath; }
+
+	void SetCriticalPath(double length)
+	{ m_criticalPath = length; }
+
+	double GetReadyTime()
+	{ return m_readyTime; }
+
+	void SetReadyTime(double time)
+	{ m_readyTime = time; }
+
 protected:
+	void Finish(Status status, bool ok);
+
+	void AddDependent(Job* job);
+	void RemoveDependent(Job* job);
+	bool OnDependencyFinished(bool failed);
 
 	/// @brief The mutex used to synchronize updates
 	std::mutex m_mutex;
 
+	/// @brief Signaled (with m_mutex held) whenever the job becomes done or canceled
+	std::condition_variable m_completionCondition;
+
 	/**
 		@brief Priority of this build job
 	 */
@@ -121,8 +191,44 @@ protected:
 	/// @brief Jobs we depend on
 	std::set<Job*> m_dependencies;
 
+	/// @brief Threads to notify when we finish (not owned, they remove themselves when done waiting)
+	std::set<JobWaiter*> m_waiters;
+
+	/// @brief Jobs which depend on us (not refcounted, they remove themselves when destroyed)
+	std::set<Job*> m_dependents;
+
+	/// @brief Number of jobs in m_dependencies which have not yet finished
+	int m_pendingDependencies;
+
+	/// @brief True if at least one of our dependencies failed or was canceled
+	bool m_dependencyFailed;
+
 	/// @brief True if we completed successfully
 	bool m_ok;
+
+	/// @brief True if somebody has reported results for us
+	bool m_resultClaimed;
+
+	/// @brief Hostname of the node which reported our results (empty if nobody has)
+	std::string m_worker;
+
+	/// @brief Time we started running (or zero if we haven't)
+	double m_startTime;
+
+	/// @brief Time we spent running (or negative if we haven't finished)
+	double m_runTime;
+
+	/// @brief Order in which we were submitted to the scheduler
+	uint64_t m_sequence;
+
+	/// @brief Expected run time, in seconds
+	std::atomic<double> m_estimatedDuration;
+
+	/// @brief Expected time from when we start running until everything depending on us is done, in seconds
+	double m_criticalPath;
+
+	/// @brief Time we first went into a ready queue (or zero if we haven't)
+	double m_readyTime;
 };
 
 #endif
@@ -0,0 +1,281 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "splashcore.h"
+
+using namespace std;
+
+constexpr double JobHistory::DEFAULT_DURATION;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+/**
+	@brief Creates the history
+
+	@param name		Name of the history file to load and save (or empty to keep history in memory only)
+ */
+JobHistory::JobHistory(string name)
+	: m_log(NULL)
+	, m_lineCount(0)
+{
+	if(name == "")
+		return;
+
+	string home = getenv("HOME");
+	if(!DoesDirectoryExist(home))
+		LogFatal("home dir does not exist\n");
+	string dir = home + "/.splash";
+	if(!DoesDirectoryExist(dir))
+		MakeDirectoryRecursive(dir, 0600);
+	m_path = dir + "/history-" + name;
+
+	Load();
+
+	m_log = fopen(m_path.c_str(), "a");
+	if(!m_log)
+		LogWarning("Couldn't open job history %s, run times will not be saved\n", m_path.c_str());
+}
+
+JobHistory::~JobHistory()
+{
+	if(m_log)
+		fclose(m_log);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Serialization
+
+/**
+	@brief Replays the history file, then compacts it if it's mostly redundant
+ */
+void JobHistory::Load()
+{
+	if(!DoesFileExist(m_path))
+		return;
+
+	LogVerbose("Loading job history...\n");
+	LogIndenter li;
+
+	vector<string> lines;
+	ParseLines(GetFileContents(m_path), lines);
+	for(auto& line : lines)
+	{
+		vector<string> fields;
+		ParseLines(line, fields, false, '\t');
+		if(fields.size() != 6)
+		{
+			LogWarning("Ignoring malformed job history line \"%s\"\n", line.c_str());
+			continue;
+		}
+
+		RecordRun(
+			fields[4],
+			fields[5],
+			atof(fields[1].c_str()),
+			fields[3],
+			strtoull(fields[2].c_str(), NULL, 10),
+			fields[0] == "1");
+	}
+
+	LogVerbose("%zu runs of %zu jobs loaded\n", lines.size(), m_jobs.size());
+	m_lineCount = lines.size();
+
+	if(NeedsCompaction())
+		Compact();
+}
+
+/**
+	@brief Checks if most of the history file is old runs we've already averaged together
+ */
+bool JobHistory::NeedsCompaction()
+{
+	return m_lineCount > 2*m_jobs.size() + 1000;
+}
+
+/**
+	@brief Rewrites the history file with one line per job
+
+	The log must not be open while we do this (see AddRun).
+ */
+void JobHistory::Compact()
+{
+	LogVerbose("Compacting job history\n");
+
+	string tmppath = m_path + ".tmp";
+	FILE* fp = fopen(tmppath.c_str(), "w");
+	if(!fp)
+	{
+		LogWarning("Couldn't open %s to compact job history\n", tmppath.c_str());
+		return;
+	}
+
+	size_t count = 0;
+	for(auto& it : m_jobs)
+	{
+		auto& rec = it.second;
+
+		//Write the average as a single successful run, then the last failure (if any) so the outcome is preserved
+		if(rec.m_hasDuration)
+		{
+			WriteRun(fp, rec.m_class, it.first, rec.m_duration, rec.m_worker, rec.m_inputSize, true);
+			count ++;
+		}
+		if(!rec.m_ok)
+		{
+			WriteRun(fp, rec.m_class, it.first, 0, rec.m_worker, rec.m_inputSize, false);
+			count ++;
+		}
+	}
+	fclose(fp);
+
+	if(0 != rename(tmppath.c_str(), m_path.c_str()))
+		LogWarning("Couldn't replace job history %s\n", m_path.c_str());
+	else
+		m_lineCount = count;
+}
+
+void JobHistory::WriteRun(
+	FILE* fp,
+	const string& jobclass,
+	const string& key,
+	double duration,
+	const string& worker,
+	uint64_t inputSize,
+	bool ok)
+{
+	fprintf(fp, "%d\t%.3f\t%llu\t%s\t%s\t%s\n",
+		ok ? 1 : 0,
+		duration,
+		static_cast<unsigned long long>(inputSize),
+		worker.c_str(),
+		jobclass.c_str(),
+		key.c_str());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Recording
+
+/**
+	@brief Records a completed run of a job
+
+	@param jobclass		Class of the job (type and toolchain)
+	@param key			Unique identifier of the job
+	@param duration		Run time, in seconds
+	@param worker		Hostname of the node which ran the job
+	@param inputSize	Total size of the job's inputs, in bytes
+	@param ok			True if the job succeeded
+ */
+void JobHistory::AddRun(string jobclass, string key, double duration, string worker, uint64_t inputSize, bool ok)
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	RecordRun(jobclass, key, duration, worker, inputSize, ok);
+
+	if(m_log)
+	{
+		WriteRun(m_log, jobclass, key, duration, worker, inputSize, ok);
+		fflush(m_log);
+		m_lineCount ++;
+
+		//Don't let the log grow forever if we stay up for a long time
+		if(NeedsCompaction())
+		{
+			fclose(m_log);
+			Compact();
+			m_log = fopen(m_path.c_str(), "a");
+			if(!m_log)
+				LogWarning("Couldn't reopen job history %s, run times will not be saved\n", m_path.c_str());
+		}
+	}
+}
+
+/**
+	@brief Updates the in-memory history for a run.
+
+	The caller must hold m_mutex, unless we're still being constructed.
+ */
+void JobHistory::RecordRun(
+	const string& jobclass,
+	const string& key,
+	double duration,
+	const string& worker,
+	uint64_t inputSize,
+	bool ok)
+{
+	auto& rec = m_jobs[key];
+	rec.m_class = jobclass;
+	rec.m_worker = worker;
+	rec.m_inputSize = inputSize;
+	rec.m_ok = ok;
+
+	if(!ok)
+		return;
+
+	//First run is taken as-is, later runs are blended in
+	if(rec.m_hasDuration)
+		UpdateAverage(rec.m_duration, duration);
+	else
+		rec.m_duration = duration;
+	rec.m_hasDuration = true;
+
+	auto it = m_classDurations.find(jobclass);
+	if(it == m_classDurations.end())
+		m_classDurations[jobclass] = duration;
+	else
+		UpdateAverage(it->second, duration);
+}
+
+void JobHistory::UpdateAverage(double& average, double duration)
+{
+	average = 0.75*average + 0.25*duration;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Estimation
+
+/**
+	@brief Guesses how long a job will take to run, in seconds.
+
+	If we've run this exact job before, use its history. If not, use the average for similar jobs.
+ */
+double JobHistory::GetEstimatedDuration(string jobclass, string key)
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	auto it = m_jobs.find(key);
+	if( (it != m_jobs.end()) && it->second.m_hasDuration )
+		return it->second.m_duration;
+
+	auto ct = m_classDurations.find(jobclass);
+	if(ct != m_classDurations.end())
+		return ct->second;
+
+	return DEFAULT_DURATION;
+}
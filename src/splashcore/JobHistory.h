@@ -0,0 +1,144 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef JobHistory_h
+#define JobHistory_h
+
+/**
+	@brief Record of how long jobs took to run in the past, used to estimate how long they'll take next time.
+
+	Each run is filed under two keys:
+	* A class (type of job and toolchain, e.g. "compile with gcc 4.9.2") used for jobs we've never seen before
+	* A key identifying the specific job (class plus output path)
+
+	Durations are smoothed with an exponential moving average so one slow run (loaded node etc) doesn't skew things.
+	Failed runs are recorded but don't count towards the average (they usually die early).
+
+	If given a name, the history is persisted to ~/.splash/history-name so estimates survive a restart of the
+	server. The file is an append-only log with one tab-separated line per run:
+
+		ok	duration	input bytes	worker	class	key
+
+	and is compacted down to one line per job (when loaded, or as runs are added) once it's grown enough to be worth it.
+ */
+class JobHistory
+{
+public:
+	JobHistory(std::string name = "");
+	virtual ~JobHistory();
+
+	void AddRun(
+		std::string jobclass,
+		std::string key,
+		double duration,
+		std::string worker,
+		uint64_t inputSize,
+		bool ok);
+
+	double GetEstimatedDuration(std::string jobclass, std::string key);
+
+	/**
+		@brief Estimated duration of a job we know absolutely nothing about, in seconds
+	 */
+	static constexpr double DEFAULT_DURATION = 1;
+
+protected:
+
+	/**
+		@brief Everything we know about one job
+	 */
+	class JobRecord
+	{
+	public:
+		JobRecord()
+		: m_hasDuration(false)
+		, m_duration(0)
+		, m_inputSize(0)
+		, m_ok(false)
+		{}
+
+		/// @brief Class of the job
+		std::string m_class;
+
+		/// @brief True if we've seen at least one successful run (so m_duration is valid)
+		bool m_hasDuration;
+
+		/// @brief Average run time of successful runs, in seconds
+		double m_duration;
+
+		/// @brief Hostname of the node that ran the job most recently
+		std::string m_worker;
+
+		/// @brief Size of the inputs to the most recent run, in bytes
+		uint64_t m_inputSize;
+
+		/// @brief True if the most recent run succeeded
+		bool m_ok;
+	};
+
+	void Load();
+	bool NeedsCompaction();
+	void Compact();
+	void RecordRun(
+		const std::string& jobclass,
+		const std::string& key,
+		double duration,
+		const std::string& worker,
+		uint64_t inputSize,
+		bool ok);
+	static void UpdateAverage(double& average, double duration);
+	static void WriteRun(
+		FILE* fp,
+		const std::string& jobclass,
+		const std::string& key,
+		double duration,
+		const std::string& worker,
+		uint64_t inputSize,
+		bool ok);
+
+	/// @brief Mutex to synchronize access to the history
+	std::mutex m_mutex;
+
+	/// @brief Path to the history file (empty if we're not persisting)
+	std::string m_path;
+
+	/// @brief The history file, open for appending (NULL if we're not persisting)
+	FILE* m_log;
+
+	/// @brief Number of lines in the history file
+	size_t m_lineCount;
+
+	/// @brief History of each job
+	std::map<std::string, JobRecord> m_jobs;
+
+	/// @brief Average run time of each class of job
+	std::map<std::string, double> m_classDurations;
+};
+
+#endif
@@ -0,0 +1,87 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "splashcore.h"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+JobWaiter::JobWaiter()
+	: m_completions(0)
+{
+
+}
+
+JobWaiter::~JobWaiter()
+{
+
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Waiting
+
+/**
+	@brief Gets the number of watched jobs which have finished so far
+ */
+uint64_t JobWaiter::GetCompletionCount()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_completions;
+}
+
+/**
+	@brief Blocks until a watched job finishes, or the timeout expires.
+
+	@param count	Completion count read by GetCompletionCount() before the caller last checked on the jobs
+	@param timeout	Maximum time to wait, in seconds
+
+	@return True if a job finished, false if we timed out
+ */
+bool JobWaiter::Wait(uint64_t count, double timeout)
+{
+	unique_lock<mutex> lock(m_mutex);
+	if(timeout < 0)
+		timeout = 0;
+	return m_condition.wait_for(
+		lock,
+		chrono::duration<double>(timeout),
+		[this, count]{ return m_completions != count; });
+}
+
+/**
+	@brief Called by a watched job when it becomes done or canceled
+ */
+void JobWaiter::OnJobCompleted()
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_completions ++;
+	m_condition.notify_all();
+}
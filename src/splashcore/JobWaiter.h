@@ -0,0 +1,66 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef JobWaiter_h
+#define JobWaiter_h
+
+/**
+	@brief Lets a thread sleep until any one of a set of jobs finishes
+
+	Register with each job of interest (see Job::AddWaiter). Every time one of them becomes done or canceled, the
+	completion count goes up and anyone in Wait() wakes up. Read the count before checking on the jobs, then pass
+	it to Wait(), so a job finishing in between isn't missed.
+
+	Jobs may outlive the waiter, so it must be removed from every job it was added to (see Job::RemoveWaiter) before
+	being destroyed.
+ */
+class JobWaiter
+{
+public:
+	JobWaiter();
+	virtual ~JobWaiter();
+
+	uint64_t GetCompletionCount();
+	bool Wait(uint64_t count, double timeout);
+
+	void OnJobCompleted();
+
+protected:
+
+	/// @brief Mutex protecting m_completions
+	std::mutex m_mutex;
+
+	/// @brief Signaled whenever m_completions changes
+	std::condition_variable m_condition;
+
+	/// @brief Number of watched jobs which have finished so far
+	uint64_t m_completions;
+};
+
+#endif
@@ -0,0 +1,172 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "splashcore.h"
+
+using namespace std;
+
+MemoryBudget* g_memoryBudget = NULL;
+
+const uint64_t MemoryBudget::MIN_PAYLOAD;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+/**
+	@brief Creates a budget
+
+	@param limit	Maximum number of payload bytes to hold at once
+ */
+MemoryBudget::MemoryBudget(uint64_t limit)
+	: m_limit(limit)
+	, m_usage(0)
+	, m_peak(0)
+	, m_stalls(0)
+{
+}
+
+MemoryBudget::~MemoryBudget()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reservations
+
+/**
+	@brief Reserves memory for a payload, blocking until there's enough room.
+
+	Every call must be matched by a call to Release() with the same size (see PayloadReservation).
+ */
+void MemoryBudget::Reserve(uint64_t bytes)
+{
+	if(bytes < MIN_PAYLOAD)
+		return;
+
+	unique_lock<mutex> lock(m_mutex);
+
+	//Always let something through if nothing else is in flight, even if it's too big
+	if( (m_usage > 0) && (m_usage + bytes > m_limit) )
+	{
+		m_stalls ++;
+		LogDebug("Payload of %lu bytes has to wait (%lu of %lu bytes in use)\n",
+			(unsigned long)bytes, (unsigned long)m_usage, (unsigned long)m_limit);
+		while( (m_usage > 0) && (m_usage + bytes > m_limit) )
+			m_condition.wait(lock);
+	}
+
+	m_usage += bytes;
+	m_peak = max(m_peak, m_usage);
+}
+
+/**
+	@brief Releases memory previously reserved for a payload
+ */
+void MemoryBudget::Release(uint64_t bytes)
+{
+	if(bytes < MIN_PAYLOAD)
+		return;
+
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_usage -= bytes;
+	}
+	m_condition.notify_all();
+}
+
+/**
+	@brief Waits until some of the budget is free
+
+	@param timeout	Maximum time to wait, in seconds
+
+	@return True if there's room, false if we timed out
+ */
+bool MemoryBudget::WaitForSpace(double timeout)
+{
+	unique_lock<mutex> lock(m_mutex);
+	return m_condition.wait_for(
+		lock,
+		chrono::duration<double>(timeout),
+		[this]{ return m_usage < m_limit; });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics
+
+/**
+	@brief Gets the number of payload bytes currently in flight
+ */
+uint64_t MemoryBudget::GetUsage()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_usage;
+}
+
+/**
+	@brief Gets the highest number of payload bytes that have been in flight at once
+ */
+uint64_t MemoryBudget::GetPeakUsage()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_peak;
+}
+
+/**
+	@brief Gets the number of times a payload had to wait for room in the budget
+ */
+uint64_t MemoryBudget::GetStallCount()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_stalls;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// PayloadReservation
+
+/**
+	@brief Reserves memory for a payload in the global budget (if there is one), releasing anything held before
+ */
+void PayloadReservation::Reserve(uint64_t bytes)
+{
+	Release();
+	if(g_memoryBudget == NULL)
+		return;
+
+	g_memoryBudget->Reserve(bytes);
+	m_bytes = bytes;
+}
+
+/**
+	@brief Gives back whatever we have reserved
+ */
+void PayloadReservation::Release()
+{
+	if( (g_memoryBudget != NULL) && (m_bytes != 0) )
+		g_memoryBudget->Release(m_bytes);
+	m_bytes = 0;
+}
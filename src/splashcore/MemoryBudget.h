@@ -0,0 +1,109 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef MemoryBudget_h
+#define MemoryBudget_h
+
+/**
+	@brief Limit on how much file content the server holds in memory at once
+
+	Network messages carrying file data (bulk uploads from developers, build results, content responses) can be
+	large, and are held in RAM in full while we process them. Each one reserves its size here first; once the budget
+	is used up, threads wanting to receive more block until earlier payloads are released, and build nodes aren't
+	given new jobs (whose results would only add to the pile).
+
+	Small messages aren't counted, so control traffic (scan results etc) is never held back. A single payload bigger
+	than the whole budget is let through on its own rather than blocking forever.
+
+	All functions are thread safe.
+ */
+class MemoryBudget
+{
+public:
+	MemoryBudget(uint64_t limit);
+	virtual ~MemoryBudget();
+
+	void Reserve(uint64_t bytes);
+	void Release(uint64_t bytes);
+	bool WaitForSpace(double timeout);
+
+	uint64_t GetUsage();
+	uint64_t GetPeakUsage();
+	uint64_t GetStallCount();
+
+	uint64_t GetLimit()
+	{ return m_limit; }
+
+	/// @brief Payloads smaller than this (in bytes) aren't counted against the budget
+	static const uint64_t MIN_PAYLOAD = 64 * 1024;
+
+protected:
+
+	/// @brief Mutex protecting all of our state
+	std::mutex m_mutex;
+
+	/// @brief Signaled whenever a payload is released
+	std::condition_variable m_condition;
+
+	/// @brief Maximum number of payload bytes in flight (constant once created)
+	uint64_t m_limit;
+
+	/// @brief Number of payload bytes currently in flight
+	uint64_t m_usage;
+
+	/// @brief Highest value m_usage has reached
+	uint64_t m_peak;
+
+	/// @brief Number of times a thread had to wait for space
+	uint64_t m_stalls;
+};
+
+/**
+	@brief A reservation of some payload memory, released when it goes out of scope
+ */
+class PayloadReservation
+{
+public:
+	PayloadReservation()
+	: m_bytes(0)
+	{}
+
+	~PayloadReservation()
+	{ Release(); }
+
+	void Reserve(uint64_t bytes);
+	void Release();
+
+protected:
+	uint64_t m_bytes;
+};
+
+extern MemoryBudget* g_memoryBudget;
+
+#endif
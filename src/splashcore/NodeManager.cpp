@@ -37,6 +37,7 @@ NodeManager* g_nodeManager = NULL;
 // Construction / destruction
 
 NodeManager::NodeManager()
+	: m_nextSlot(0)
 {
 }
 
@@ -44,6 +45,83 @@ NodeManager::~NodeManager()
 {
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Persistence
+
+/**
+	@brief Gets the path of the snapshot file for a working copy, or the empty string if snapshots are disabled
+ */
+string NodeManager::GetSnapshotPath(clientID id)
+{
+	if(m_snapshotPath == "")
+		return "";
+
+	//The UUID comes from the client, make sure it's a sane file name
+	if(id == "")
+		return "";
+	for(auto c : id)
+	{
+		if(!isalnum(c) && (c != '-') )
+			return "";
+	}
+
+	return m_snapshotPath + "/" + id + ".snapshot";
+}
+
+/**
+	@brief Saves a working copy to its snapshot file.
+
+	Must be called with m_snapshotMutex locked.
+ */
+void NodeManager::SaveSnapshot(WorkingCopy* wc, clientID id)
+{
+	string path = GetSnapshotPath(id);
+	if(path == "")
+		return;
+
+	if(!wc->SaveSnapshot(path))
+		LogWarning("NodeManager: failed to save snapshot for %s\n", id.c_str());
+}
+
+/**
+	@brief Saves every working copy to its snapshot file.
+
+	Called periodically, and at shutdown.
+ */
+void NodeManager::SaveSnapshots()
+{
+	lock_guard<mutex> lock(m_snapshotMutex);
+
+	//Don't hold our mutex while saving, graphs can be big.
+	//Working copies are not deleted until we release m_snapshotMutex (see RemoveClient).
+	map<clientID, WorkingCopy*> wcs;
+	{
+		lock_guard<recursive_mutex> lock2(m_mutex);
+		wcs = m_workingCopies;
+	}
+
+	double start = GetTime();
+	for(auto it : wcs)
+		SaveSnapshot(it.second, it.first);
+	LogDebug("NodeManager: saved %d working copies in %.3f sec\n", (int)wcs.size(), GetTime() - start);
+}
+
+/**
+	@brief Restores the saved dependency scan results of a newly created working copy, if we have a snapshot.
+
+	The file map and build scripts come from the client's initial sync, which claims the saved scans as it goes.
+ */
+void NodeManager::LoadSnapshot(WorkingCopy* wc, clientID id)
+{
+	string path = GetSnapshotPath(id);
+	if(path == "")
+		return;
+
+	lock_guard<mutex> lock(m_snapshotMutex);
+	if(wc->LoadSnapshot(path))
+		LogVerbose("NodeManager: Restored dependency scans for %s from snapshot\n", id.c_str());
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Mutex operations
 
@@ -72,30 +150,129 @@ void NodeManager::unlock()
 // Database manipulation
 
 /**
-	@brief Marks a job as currently running on a given node
+	@brief Creates a new build slot on a node.
+
+	A build server running several jobs at once connects once per slot, and all of the connections share the node's
+	UUID (so they share its toolchains and RAM budget). Anything that has to be tracked per connection - which jobs
+	it's running, and thus what to reschedule when it goes away - uses the slot ID instead.
+
+	@return The slot ID
+ */
+clientID NodeManager::AllocateSlot(clientID id)
+{
+	lock_guard<mutex> lock(m_jobStatusMutex);
+	clientID slot = id + "/" + to_string(m_nextSlot ++);
+	m_slotOwners[slot] = id;
+	return slot;
+}
+
+/**
+	@brief Forgets about a build slot whose connection closed.
+
+	Anything still running on it must have been dealt with already (see Scheduler::RemoveSlot).
+ */
+void NodeManager::FreeSlot(clientID slot)
+{
+	lock_guard<mutex> lock(m_jobStatusMutex);
+	m_jobsRunningOnSlot.erase(slot);
+	m_slotOwners.erase(slot);
+}
+
+/**
+	@brief Gets the ID of the node a build slot belongs to
+ */
+clientID NodeManager::GetSlotOwner(clientID slot)
+{
+	lock_guard<mutex> lock(m_jobStatusMutex);
+	return m_slotOwners[slot];
+}
+
+/**
+	@brief Marks a job as currently running on a given build slot, and reserves its RAM on the slot's node
  */
-void NodeManager::AddJob(string id, Job* job)
+void NodeManager::AddJob(clientID slot, Job* job)
 {
 	lock_guard<mutex> lock(m_jobStatusMutex);
-	m_jobsRunningOnNode[id].emplace(job);
+	if(m_jobsRunningOnSlot[slot].emplace(job).second)
+		m_memoryInUse[m_slotOwners[slot]] += job->GetMemoryRequirement();
 }
 
 /**
-	@brief Marks a job as no longer running on the given node
+	@brief Marks a job as no longer running on the given build slot
  */
-void NodeManager::RemoveJob(string id, Job* job)
+void NodeManager::RemoveJob(clientID slot, Job* job)
 {
 	lock_guard<mutex> lock(m_jobStatusMutex);
-	m_jobsRunningOnNode[id].erase(job);
+	if(m_jobsRunningOnSlot[slot].erase(job))
+		m_memoryInUse[m_slotOwners[slot]] -= job->GetMemoryRequirement();
+	m_jobReleasedCondition.notify_all();
 }
 
 /**
-	@brief Gets the job currently running on a node
+	@brief Blocks until no build slot is running any job on behalf of a working copy.
+
+	The threads talking to build servers look at a job's working copy (and graph nodes) until they remove it from
+	their slot, so a working copy must not be deleted before then. Its jobs should have been canceled first (see
+	Scheduler::RemoveWorkingCopy), so nothing new can start and anything running is told to stop.
  */
-set<Job*> NodeManager::GetCurrentJobs(string id)
+void NodeManager::WaitForJobsToRelease(WorkingCopy* wc)
+{
+	unique_lock<mutex> lock(m_jobStatusMutex);
+	while(true)
+	{
+		bool busy = false;
+		for(auto& it : m_jobsRunningOnSlot)
+		{
+			for(auto job : it.second)
+			{
+				if(job->GetWorkingCopy() == wc)
+					busy = true;
+			}
+		}
+		if(!busy)
+			return;
+
+		//If a build server is slow to stop, say why we're stuck
+		if(cv_status::timeout == m_jobReleasedCondition.wait_for(lock, chrono::seconds(5)))
+			LogDebug("NodeManager: still waiting for build servers to let go of a deleted working copy's jobs\n");
+	}
+}
+
+/**
+	@brief Gets the jobs currently running on a build slot
+ */
+set<Job*> NodeManager::GetCurrentJobs(clientID slot)
 {
 	lock_guard<mutex> lock(m_jobStatusMutex);
-	return m_jobsRunningOnNode[id];
+	return m_jobsRunningOnSlot[slot];
+}
+
+/**
+	@brief Sets the amount of RAM a node has available for running jobs, in MB (zero for no limit)
+ */
+void NodeManager::SetMemoryBudget(clientID id, unsigned int budget)
+{
+	lock_guard<mutex> lock(m_jobStatusMutex);
+	m_memoryBudget[id] = budget;
+}
+
+/**
+	@brief Gets the amount of RAM a node has available for starting another job, in MB
+
+	If the node has no limit, or has no memory reserved by running jobs, returns UINT_MAX.
+	Jobs bigger than the whole budget can thus still run, but only by themselves.
+ */
+unsigned int NodeManager::GetFreeMemory(clientID id)
+{
+	lock_guard<mutex> lock(m_jobStatusMutex);
+
+	unsigned int budget = m_memoryBudget[id];
+	unsigned int used = m_memoryInUse[id];
+	if( (budget == 0) || (used == 0) )
+		return UINT_MAX;
+	if(used >= budget)
+		return 0;
+	return budget - used;
 }
 
 /**
@@ -103,21 +280,31 @@ set<Job*> NodeManager::GetCurrentJobs(string id)
  */
 void NodeManager::AllocateClient(string hostname, clientID id, int type)
 {
-	lock_guard<recursive_mutex> lock(m_mutex);
+	WorkingCopy* created = NULL;
+	{
+		lock_guard<recursive_mutex> lock(m_mutex);
 
-	//See if we had one already
-	if(m_nodeRefcounts.find(id) != m_nodeRefcounts.end())
-		m_nodeRefcounts[id] ++;
+		//See if we had one already
+		if(m_nodeRefcounts.find(id) != m_nodeRefcounts.end())
+			m_nodeRefcounts[id] ++;
 
-	//Nope, create a new one
-	else
-	{
-		m_nodeRefcounts[id] = 1;
-		m_workingCopies[id] = new WorkingCopy(hostname, id);
+		//Nope, create a new one
+		else
+		{
+			m_nodeRefcounts[id] = 1;
+			created = new WorkingCopy(hostname, id);
+			m_workingCopies[id] = created;
+		}
+
+		//Add to the working copy
+		m_workingCopies[id]->AddClient(type);
 	}
 
-	//Add to the working copy
-	m_workingCopies[id]->AddClient(type);
+	//If we knew this client in a previous session, pick up where we left off.
+	//This has to be done without holding our mutex since evaluating the build scripts starts dependency scans.
+	//The working copy can't go away in the meantime since the client we're allocating holds a reference to it.
+	if(created)
+		LoadSnapshot(created, id);
 }
 
 /**
@@ -125,7 +312,8 @@ void NodeManager::AllocateClient(string hostname, clientID id, int type)
  */
 void NodeManager::RemoveClient(clientID id, int type)
 {
-	lock_guard<recursive_mutex> lock(m_mutex);
+	WorkingCopy* dead = NULL;
+	m_mutex.lock();
 
 	//Remove from the working copy
 	m_workingCopies[id]->RemoveClient(type);
@@ -140,8 +328,14 @@ void NodeManager::RemoveClient(clientID id, int type)
 
 		m_nodeRefcounts.erase(id);
 
-		//Cancel all pending jobs for that node
+		//Cancel all pending jobs for that node.
+		//Jobs that were running on it were already rescheduled as each slot's connection closed.
 		g_scheduler->RemoveNode(id);
+		{
+			lock_guard<mutex> lock2(m_jobStatusMutex);
+			m_memoryBudget.erase(id);
+			m_memoryInUse.erase(id);
+		}
 
 		auto chains = m_toolchainsByNode[id];
 		for(auto x : chains)
@@ -155,7 +349,7 @@ void NodeManager::RemoveClient(clientID id, int type)
 		for(auto x : m_nodesByCompiler)
 			m_nodesByCompiler[x.first].erase(id);
 
-		delete m_workingCopies[id];
+		dead = m_workingCopies[id];
 		m_workingCopies.erase(id);
 
 		//Toolchains may have changed, recompute
@@ -166,6 +360,24 @@ void NodeManager::RemoveClient(clientID id, int type)
 		LogDebug("NodeManager: Keeping state for node %s as %d clients are still active\n",
 			id.c_str(), m_nodeRefcounts[id]);
 	}
+
+	m_mutex.unlock();
+
+	//Save the working copy so we don't have to start from scratch if the client comes back, then delete it.
+	//Any jobs for it that are still running have to stop first. Don't hold the snapshot lock while we wait.
+	if(dead)
+	{
+		{
+			lock_guard<mutex> lock(m_snapshotMutex);
+			SaveSnapshot(dead, id);
+		}
+
+		g_scheduler->RemoveWorkingCopy(dead);
+		WaitForJobsToRelease(dead);
+
+		lock_guard<mutex> lock(m_snapshotMutex);
+		delete dead;
+	}
 }
 
 /**
@@ -409,6 +621,19 @@ void NodeManager::ListClients(set<clientID>& clients)
 		clients.emplace(x.first);
 }
 
+/**
+	@brief Gets the number of build connections (one per slot on each build server) we currently have
+ */
+unsigned int NodeManager::GetBuildSlotCount()
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	unsigned int count = 0;
+	for(auto x : m_workingCopies)
+		count += x.second->GetClientCount(ClientHello::CLIENT_BUILD);
+	return count;
+}
+
 /**
 	@brief List all toolchains, by hash, we currently know about
  */
@@ -57,6 +57,14 @@ public:
 	void AllocateClient(std::string hostname, clientID id, int type);
 	void RemoveClient(clientID id, int type);
 
+	/**
+		@brief Sets the directory working copy snapshots are kept in. Snapshots are disabled if empty.
+	 */
+	void SetSnapshotPath(std::string path)
+	{ m_snapshotPath = path; }
+
+	void SaveSnapshots();
+
 	void AddToolchain(clientID id, Toolchain* chain, bool moreComing);
 
 	WorkingCopy* GetWorkingCopy(clientID id)
@@ -73,6 +81,7 @@ public:
 	clientID GetGoldenNodeForToolchain(std::string hash);
 
 	void ListClients(std::set<clientID>& clients);
+	unsigned int GetBuildSlotCount();
 
 	bool HasAnyToolchains();
 	void ListToolchains(std::set<std::string>& hashes);
@@ -80,14 +89,26 @@ public:
 	void ListClientsForToolchain(std::set<clientID>& nodes, std::string hash);
 	void ListToolchainsForClient(std::set<std::string>& toolchains, clientID id);
 
-	void AddJob(std::string id, Job* job);
-	void RemoveJob(std::string id, Job* job);
-	std::set<Job*> GetCurrentJobs(std::string id);
+	clientID AllocateSlot(clientID id);
+	void FreeSlot(clientID slot);
+	clientID GetSlotOwner(clientID slot);
+
+	void AddJob(clientID slot, Job* job);
+	void RemoveJob(clientID slot, Job* job);
+	std::set<Job*> GetCurrentJobs(clientID slot);
+	void WaitForJobsToRelease(WorkingCopy* wc);
+
+	void SetMemoryBudget(clientID id, unsigned int budget);
+	unsigned int GetFreeMemory(clientID id);
 
 protected:
 
 	void RecomputeCompilerHashes();
 
+	std::string GetSnapshotPath(clientID id);
+	void SaveSnapshot(WorkingCopy* wc, clientID id);
+	void LoadSnapshot(WorkingCopy* wc, clientID id);
+
 	//Reference counts for each node
 	std::map<clientID, int> m_nodeRefcounts;
 
@@ -110,11 +131,33 @@ protected:
 	//The working copies of the repository for each client
 	std::map<clientID, WorkingCopy*> m_workingCopies;
 
-	//Separate mutex for m_jobsRunningOnNode
+	//Directory working copy snapshots are kept in (empty if disabled)
+	std::string m_snapshotPath;
+
+	//Serializes reading and writing snapshots, and deletion of working copies (taken before m_mutex if both are needed)
+	std::mutex m_snapshotMutex;
+
+	//Separate mutex for m_jobsRunningOnSlot
 	std::mutex m_jobStatusMutex;
 
-	//The job(s) currently running on this node (if any)
-	std::map<std::string, std::set<Job*> > m_jobsRunningOnNode;
+	//Signaled (with m_jobStatusMutex held) whenever a job stops running on a slot
+	std::condition_variable m_jobReleasedCondition;
+
+	//The node each build slot (i.e. each connection from a splashbuild process) belongs to
+	//(also protected by m_jobStatusMutex)
+	std::map<clientID, clientID> m_slotOwners;
+
+	//Number used to name the next build slot (also protected by m_jobStatusMutex)
+	unsigned int m_nextSlot;
+
+	//The job(s) currently running on each build slot (if any)
+	std::map<clientID, std::set<Job*> > m_jobsRunningOnSlot;
+
+	//RAM available to jobs on each node, in MB (also protected by m_jobStatusMutex)
+	std::map<clientID, unsigned int> m_memoryBudget;
+
+	//RAM reserved by jobs currently running on each node, in MB (also protected by m_jobStatusMutex)
+	std::map<clientID, unsigned int> m_memoryInUse;
 };
 
 /**
@@ -0,0 +1,139 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "splashcore.h"
+
+using namespace std;
+
+NodePool* g_nodePool = NULL;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+NodePool::NodePool()
+	: m_references(0)
+{
+}
+
+NodePool::~NodePool()
+{
+	for(auto it : m_refcounts)
+		delete it.first;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Accessors
+
+/**
+	@brief Gets the number of distinct nodes in the pool
+ */
+size_t NodePool::GetNodeCount()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_refcounts.size();
+}
+
+/**
+	@brief Gets the number of graph references to nodes in the pool (i.e. how many nodes we'd have without sharing)
+ */
+size_t NodePool::GetReferenceCount()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_references;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Node management
+
+/**
+	@brief Gets a reference to the shared source file node for a given version of a file, creating it if needed.
+
+	Each call must be matched by a call to Release() when the caller is done with the node.
+ */
+BuildGraphNode* NodePool::GetSourceFileNode(string fname, string hash)
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	auto& node = m_sourceFileNodes[NodeKey(fname, hash)];
+	if(node == NULL)
+		node = new SourceFileNode(NULL, fname, hash);
+	AddReference(node);
+	return node;
+}
+
+/**
+	@brief Gets a reference to the shared system library node for a given version of a file, creating it if needed.
+
+	Each call must be matched by a call to Release() when the caller is done with the node.
+ */
+BuildGraphNode* NodePool::GetSystemLibraryNode(string fname, string hash)
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	auto& node = m_systemLibraryNodes[NodeKey(fname, hash)];
+	if(node == NULL)
+		node = new SystemLibraryNode(NULL, fname, hash);
+	AddReference(node);
+	return node;
+}
+
+/**
+	@brief Adds a reference to a node. Must be called with m_mutex locked.
+ */
+void NodePool::AddReference(BuildGraphNode* node)
+{
+	m_refcounts[node] ++;
+	m_references ++;
+}
+
+/**
+	@brief Drops a reference to a node, deleting it once no graph uses it any more
+ */
+void NodePool::Release(BuildGraphNode* node)
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	auto it = m_refcounts.find(node);
+	if(it == m_refcounts.end())
+	{
+		LogError("NodePool: released node %s which isn't in the pool\n", node->GetFilePath().c_str());
+		return;
+	}
+	m_references --;
+	if(--it->second != 0)
+		return;
+	m_refcounts.erase(it);
+
+	NodeKey key(node->GetFilePath(), node->GetHash());
+	if(dynamic_cast<SourceFileNode*>(node) != NULL)
+		m_sourceFileNodes.erase(key);
+	else
+		m_systemLibraryNodes.erase(key);
+	delete node;
+}
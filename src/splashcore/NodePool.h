@@ -0,0 +1,80 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef NodePool_h
+#define NodePool_h
+
+/**
+	@brief Leaf graph nodes shared by all working copies
+
+	Most nodes in a graph are source files (headers in particular) and system libraries. They are identical in every
+	working copy that has the same version of the file, and never change once created, so rather than each graph
+	having its own copy they're all handed out from here and reference counted.
+
+	Shared nodes don't belong to any graph (GetGraph() returns NULL) and are finalized from the start.
+
+	All functions are thread safe.
+ */
+class NodePool
+{
+public:
+	NodePool();
+	virtual ~NodePool();
+
+	BuildGraphNode* GetSourceFileNode(std::string fname, std::string hash);
+	BuildGraphNode* GetSystemLibraryNode(std::string fname, std::string hash);
+	void Release(BuildGraphNode* node);
+
+	size_t GetNodeCount();
+	size_t GetReferenceCount();
+
+protected:
+
+	//Identity of a shared node: path and hash
+	typedef std::pair<std::string, std::string> NodeKey;
+
+	void AddReference(BuildGraphNode* node);
+
+	//Mutex protecting all of our state
+	std::mutex m_mutex;
+
+	//The nodes, by type
+	std::map<NodeKey, BuildGraphNode*> m_sourceFileNodes;
+	std::map<NodeKey, BuildGraphNode*> m_systemLibraryNodes;
+
+	//Number of graphs referencing each node
+	std::map<BuildGraphNode*, unsigned int> m_refcounts;
+
+	//Sum of m_refcounts
+	size_t m_references;
+};
+
+extern NodePool* g_nodePool;
+
+#endif
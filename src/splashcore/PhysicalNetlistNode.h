@@ -50,6 +50,13 @@ public:
 	);
 	virtual ~PhysicalNetlistNode();
 
+	//Place-and-route of large FPGAs can use tens of GB
+	virtual unsigned int GetMemoryRequirement()
+	{ return 16384; }
+
+	virtual double GetTimeout()
+	{ return 12 * 3600; }
+
 protected:
 	virtual void DoFinalize();
 
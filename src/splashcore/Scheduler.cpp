@@ -33,176 +33,1056 @@ using namespace std;
 
 Scheduler* g_scheduler = NULL;
 
+constexpr double Scheduler::STRAGGLER_MIN_DELAY;
+constexpr double Scheduler::BATCH_MAX_DURATION;
+constexpr double Scheduler::RESERVATION_DELAY;
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Construction / destruction
 
-Scheduler::Scheduler()
+Scheduler::Scheduler()
+	: m_history("splashctl")
+{
+	m_tStart = GetTime();
+	m_running = false;
+	m_workGeneration = 0;
+	m_nextSequence = 0;
+}
+
+Scheduler::~Scheduler()
+{
+	//LogDebug("destroying scheduler\n");
+
+	for(auto it : m_pendingScanJobs)
+	{
+		for(auto job : it.second)
+			job->Unref();
+		it.second.clear();
+	}
+
+	for(auto it : m_pinnedScanJobs)
+	{
+		for(auto job : it.second)
+			job->Unref();
+		it.second.clear();
+	}
+
+	for(auto& it : m_readyJobs)
+	{
+		for(auto& ot : it.second)
+		{
+			for(auto& jt : ot.second)
+			{
+				for(auto kt : jt.second)
+					kt.second->Unref();
+			}
+		}
+	}
+	m_readyJobs.clear();
+
+	for(auto job : m_waitingJobs)
+		job->Unref();
+	m_waitingJobs.clear();
+
+	for(auto job : m_deferredJobs)
+		job->Unref();
+	m_deferredJobs.clear();
+
+	for(auto it : m_memoryReservations)
+		it.second->Unref();
+	m_memoryReservations.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// General scheduling
+
+/**
+	@brief Cancel scan jobs which can no longer run because a node is leaving the cluster
+
+	Jobs running on the node have already been rescheduled by RemoveSlot().
+ */
+void Scheduler::RemoveNode(clientID id)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+	lock_guard<NodeManager> nlock(*g_nodeManager);
+
+	LogVerbose("Splashbuild worker %s is shutting down\n", id.c_str());
+
+	//Cancel all scan jobs pinned to this node so anyone blocking on them wakes up
+	//New scan jobs will be created when the node comes back
+	for(auto job : m_pinnedScanJobs[id])
+	{
+		job->SetCanceled();
+		job->Unref();
+	}
+	m_pinnedScanJobs.erase(id);
+
+	//Cancel any other scan jobs which nobody else is able to run
+	set<string> toolchains;
+	g_nodeManager->ListToolchainsForClient(toolchains, id);
+	for(auto hash : toolchains)
+	{
+		set<clientID> nodes;
+		g_nodeManager->ListClientsForToolchain(nodes, hash);
+		nodes.erase(id);
+		if(!nodes.empty())
+			continue;
+
+		for(auto job : m_pendingScanJobs[hash])
+		{
+			job->SetCanceled();
+			job->Unref();
+		}
+		m_pendingScanJobs.erase(hash);
+	}
+
+	//Whatever we were saving RAM for here can go somewhere else
+	ReleaseReservation(id);
+
+	NotifyWorkAvailable();
+}
+
+/**
+	@brief Re-schedule jobs running on a build slot whose connection closed
+
+	This happens when a single slot of a build server crashes or disconnects, as well as when the whole server leaves
+	(each slot's connection closes before the node itself is removed). The jobs' RAM is released on the node.
+ */
+void Scheduler::RemoveSlot(clientID slot)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+	lock_guard<NodeManager> nlock(*g_nodeManager);
+
+	clientID id = g_nodeManager->GetSlotOwner(slot);
+	auto bjs = g_nodeManager->GetCurrentJobs(slot);
+	for(auto bj : bjs)
+	{
+		g_nodeManager->RemoveJob(slot, bj);
+
+		//If the job already finished (another copy won), there's nothing to reschedule
+		if(bj->IsFinished())
+		{
+			bj->Unref();
+			continue;
+		}
+
+		//If another slot is also running a copy of the job, let it finish.
+		//Just drop the ref our dying thread held.
+		auto rt = m_runningJobs.find(bj);
+		if(rt != m_runningJobs.end())
+		{
+			rt->second.erase(slot);
+			if(!rt->second.empty())
+			{
+				bj->Unref();
+				continue;
+			}
+			m_runningJobs.erase(rt);
+		}
+
+		//Scans go back to the head of the scan queue they came from.
+		//If the whole node is going away, RemoveNode() will cancel any that nobody else can run.
+		//The ref our dying thread held now belongs to the queue.
+		auto scan = dynamic_cast<DependencyScanJob*>(bj);
+		if(scan)
+		{
+			scan->SetPending();
+			if(scan->IsPinned())
+				m_pinnedScanJobs[id].push_front(scan);
+			else
+				m_pendingScanJobs[scan->GetToolchain()].push_front(scan);
+			continue;
+		}
+
+		//Remove the ref our dying thread held, mark it as pending again, and put it back in the run queue
+		bj->SetPending();
+		bj->Unref();
+		SubmitJob(bj);
+	}
+
+	NotifyWorkAvailable();
+}
+
+/**
+	@brief Forget about a working copy that's about to be deleted (along with its graph)
+
+	Every job still queued on its behalf is canceled and dequeued, since the jobs refer to graph nodes that won't
+	exist anymore. Jobs already running are canceled too, so their results get thrown away instead of being written
+	to those nodes (see Job::ClaimResult). The threads running them still look at the working copy until they let
+	go of the jobs, so the caller must wait for that before deleting it (see NodeManager::WaitForJobsToRelease).
+
+	The fair-share accounting goes as well, otherwise a new working copy allocated at the same address would inherit
+	its share.
+ */
+void Scheduler::RemoveWorkingCopy(WorkingCopy* wc)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	//Pull everything for this working copy out of the queues. The queues' references now belong to us.
+	vector<Job*> dead;
+	for(auto& it : m_readyJobs)
+	{
+		auto ot = it.second.find(wc);
+		if(ot == it.second.end())
+			continue;
+		for(auto& qt : ot->second)
+		{
+			for(auto& jt : qt.second)
+				dead.push_back(jt.second);
+		}
+		it.second.erase(ot);
+	}
+	for(auto it = m_waitingJobs.begin(); it != m_waitingJobs.end(); )
+	{
+		if((*it)->GetWorkingCopy() == wc)
+		{
+			dead.push_back(*it);
+			it = m_waitingJobs.erase(it);
+		}
+		else
+			it ++;
+	}
+	for(auto it = m_deferredJobs.begin(); it != m_deferredJobs.end(); )
+	{
+		if((*it)->GetWorkingCopy() == wc)
+		{
+			dead.push_back(*it);
+			it = m_deferredJobs.erase(it);
+		}
+		else
+			it ++;
+	}
+	for(auto& it : m_pendingScanJobs)
+	{
+		for(auto jt = it.second.begin(); jt != it.second.end(); )
+		{
+			if((*jt)->GetWorkingCopy() == wc)
+			{
+				dead.push_back(*jt);
+				jt = it.second.erase(jt);
+			}
+			else
+				jt ++;
+		}
+	}
+	for(auto& it : m_pinnedScanJobs)
+	{
+		for(auto jt = it.second.begin(); jt != it.second.end(); )
+		{
+			if((*jt)->GetWorkingCopy() == wc)
+			{
+				dead.push_back(*jt);
+				jt = it.second.erase(jt);
+			}
+			else
+				jt ++;
+		}
+	}
+
+	//Running jobs stay where they are (the slots running them hold their own references)
+	vector<Job*> running;
+	for(auto& it : m_runningJobs)
+	{
+		if(it.first->GetWorkingCopy() == wc)
+			running.push_back(it.first);
+	}
+
+	//Cancel only after we're done looking at the queues, since it calls back into us
+	for(auto job : dead)
+	{
+		job->SetCanceled();
+		job->Unref();
+	}
+	for(auto job : running)
+		job->SetCanceled();
+	if(!dead.empty() || !running.empty())
+	{
+		LogDebug("Canceled %zu queued and %zu running jobs for deleted working copy\n",
+			dead.size(), running.size());
+	}
+
+	for(auto& it : m_fairShareTime)
+		it.second.erase(wc);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Dependency scanning
+
+/**
+	@brief Get the next available scan job for a given build slot, if there is one available.
+
+	@return A scan job, or NULL if none are available.
+ */
+DependencyScanJob* Scheduler::PopScanJob(clientID slot)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+	clientID id = g_nodeManager->GetSlotOwner(slot);
+
+	//TODO: Check if the job is runnable and wait if it's not
+
+	//Jobs which can only run on this node go first
+	DependencyScanJob* ret = NULL;
+	auto& pinned = m_pinnedScanJobs[id];
+	if(!pinned.empty())
+	{
+		ret = pinned.front();
+		pinned.pop_front();
+	}
+
+	//Then anything we have the toolchain for
+	else
+	{
+		set<string> toolchains;
+		g_nodeManager->ListToolchainsForClient(toolchains, id);
+		for(auto& t : toolchains)
+		{
+			auto it = m_pendingScanJobs.find(t);
+			if( (it == m_pendingScanJobs.end()) || it->second.empty() )
+				continue;
+
+			ret = it->second.front();
+			it->second.pop_front();
+			break;
+		}
+	}
+	if(ret == NULL)
+		return NULL;
+
+	ret->Ref();
+	g_nodeManager->AddJob(slot, ret);
+	return ret;
+}
+
+/**
+	@brief Get the next available job for a given build slot, if there is one available.
+
+	@return A job, or NULL if none are available.
+ */
+Job* Scheduler::PopJob(clientID slot, const unordered_set<string>* cached)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+	clientID id = g_nodeManager->GetSlotOwner(slot);
+
+	//Look up the toolchains for this node
+	set<string> toolchains;
+	g_nodeManager->ListToolchainsForClient(toolchains, id);
+
+	//Don't start anything that would push the node past its memory budget.
+	//Since we hold our mutex until the job is registered with the node manager, other slots on the same node
+	//can't race us for the same RAM.
+	unsigned int memory = g_nodeManager->GetFreeMemory(id);
+
+	//If we're saving up RAM for a big job, start it as soon as it fits, and nothing else until then
+	bool draining = false;
+	Job* job = PopReservedJob(slot, memory, draining);
+	if(draining)
+		return NULL;
+
+	//Jobs which blew through their timeout are probably hung (or the node running them is), and are holding up
+	//everything depending on them. Send out another copy ahead of anything else.
+	if(!job)
+		job = PopStraggler(slot, toolchains, memory, true);
+
+	//Attempt to pop the job queue from each priority, from max to min priority
+	Job* starved = NULL;
+	for(int i=0; (i<Job::PRIO_COUNT) && !job; i++)
+		job = PopJob(static_cast<Job::Priority>(i), toolchains, memory, cached, starved);
+
+	//Nothing else to do? We're probably near the end of the build, with a few long jobs still running.
+	//If any of them are going a lot slower than expected, hedge our bets and run another copy here.
+	if(!job)
+		job = PopStraggler(slot, toolchains, memory, false);
+
+	//If a job we skipped for lack of RAM has been waiting too long, stop giving this node anything new until it's
+	//drained enough to run it (unless another node is already doing that).
+	if( (starved != NULL) && (m_memoryReservations.find(id) == m_memoryReservations.end()) )
+	{
+		bool reserved = false;
+		for(auto& it : m_memoryReservations)
+		{
+			if(it.second == starved)
+				reserved = true;
+		}
+
+		if(!reserved)
+		{
+			LogVerbose("Job %p (needs %u MB) has been waiting for %.1f sec, reserving RAM on %s\n",
+				starved, starved->GetMemoryRequirement(), GetTime() - starved->GetReadyTime(), id.c_str());
+			starved->Ref();
+			m_memoryReservations[id] = starved;
+		}
+	}
+
+	if(!job)
+		return NULL;
+
+	//This job is now running on the slot that requested it
+	g_nodeManager->AddJob(slot, job);
+	m_runningJobs[job].emplace(slot);
+	return job;
+}
+
+/**
+	@brief Gets the job a build slot's node is saving up RAM for, if it fits now
+
+	@param draining		Set to true if the node has a reservation which doesn't fit yet (so it must not start anything
+						else), false otherwise
+
+	@return The reserved job (out of the ready queue), or NULL if there's none or it doesn't fit yet
+ */
+Job* Scheduler::PopReservedJob(clientID slot, unsigned int memory, bool& draining)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+	clientID id = g_nodeManager->GetSlotOwner(slot);
+
+	draining = false;
+	auto it = m_memoryReservations.find(id);
+	if(it == m_memoryReservations.end())
+		return NULL;
+	Job* job = it->second;
+
+	//If it's not in a ready queue anymore, someone else got to it first (or it was canceled)
+	jobqueue* queue = GetReadyQueue(job);
+	if(queue == NULL)
+	{
+		ReleaseReservation(id);
+		return NULL;
+	}
+	auto qt = queue->find(GetJobKey(job));
+	if( (qt == queue->end()) || (qt->second != job) )
+	{
+		ReleaseReservation(id);
+		return NULL;
+	}
+
+	//Still doesn't fit? Keep waiting for jobs to finish
+	if(job->GetMemoryRequirement() > memory)
+	{
+		draining = true;
+		return NULL;
+	}
+
+	//It fits! The queue's reference goes to the caller
+	DequeueJob(job);
+	ReleaseReservation(id);
+	if(!job->IsRunnable())
+	{
+		m_deferredJobs.emplace(job);
+		return NULL;
+	}
+
+	m_fairShareTime[job->GetPriority()][job->GetWorkingCopy()] += job->GetEstimatedDuration();
+	return job;
+}
+
+/**
+	@brief Stops saving up RAM on a node (see PopJob)
+ */
+void Scheduler::ReleaseReservation(clientID id)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	auto it = m_memoryReservations.find(id);
+	if(it == m_memoryReservations.end())
+		return;
+	it->second->Unref();
+	m_memoryReservations.erase(it);
+}
+
+/**
+	@brief Adds more small jobs to a batch, so they can all be sent to a node in one round trip.
+
+	The batch must contain exactly one job, just returned by PopJob for the same node. If it's small (see
+	BATCH_MAX_DURATION), up to BATCH_MAX_SIZE-1 more small jobs of the same priority are taken from the ready queues
+	(in fair share and critical path order as usual) and appended. Each one is registered as running on the node,
+	and charged to its working copy's fair share, as if it had come from PopJob.
+
+	Only the first AFFINITY_WINDOW jobs we come across are considered, so this costs the same no matter how many
+	jobs are queued.
+ */
+void Scheduler::PopBatch(clientID slot, vector<Job*>& batch)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+	clientID id = g_nodeManager->GetSlotOwner(slot);
+
+	//Don't batch big jobs, or second copies of stragglers (they need to start right away).
+	//Don't add anything if the node is saving up RAM for a big job.
+	if(batch.size() != 1)
+		return;
+	if(m_memoryReservations.find(id) != m_memoryReservations.end())
+		return;
+	Job* first = batch[0];
+	if( (first->GetEstimatedDuration() > BATCH_MAX_DURATION) || (m_runningJobs[first].size() != 1) )
+		return;
+
+	set<string> toolchains;
+	g_nodeManager->ListToolchainsForClient(toolchains, id);
+
+	//Sort the working copies with jobs waiting by how much service they've had so far (see PopJob)
+	auto prio = first->GetPriority();
+	auto& owners = m_readyJobs[prio];
+	auto& shares = m_fairShareTime[prio];
+	vector< pair<double, WorkingCopy*> > order;
+	for(auto& it : owners)
+		order.push_back(pair<double, WorkingCopy*>(shares[it.first], it.first));
+	sort(order.begin(), order.end());
+
+	unsigned int scanned = 0;
+	for(auto& it : order)
+	{
+		if( (batch.size() >= BATCH_MAX_SIZE) || (scanned >= AFFINITY_WINDOW) )
+			break;
+
+		auto wc = it.second;
+		auto& queues = owners[wc];
+		for(auto& t : toolchains)
+		{
+			auto qt = queues.find(t);
+			if(qt == queues.end())
+				continue;
+
+			auto& queue = qt->second;
+			for(auto jt = queue.begin();
+				(jt != queue.end()) && (batch.size() < BATCH_MAX_SIZE) && (scanned < AFFINITY_WINDOW);
+				scanned ++)
+			{
+				//Leave anything big, or that won't fit, for someone else
+				Job* job = jt->second;
+				if( (job->GetEstimatedDuration() > BATCH_MAX_DURATION) ||
+					(job->GetMemoryRequirement() > g_nodeManager->GetFreeMemory(id)) )
+				{
+					jt ++;
+					continue;
+				}
+
+				jt = queue.erase(jt);
+				if(!job->IsRunnable())
+				{
+					m_deferredJobs.emplace(job);
+					continue;
+				}
+
+				m_fairShareClock[prio] = shares[wc];
+				shares[wc] += job->GetEstimatedDuration();
+				g_nodeManager->AddJob(slot, job);
+				m_runningJobs[job].emplace(slot);
+				batch.push_back(job);
+			}
+		}
+
+		//Clean out empty queues so we know when the working copy goes idle
+		for(auto qt = queues.begin(); qt != queues.end(); )
+		{
+			if(qt->second.empty())
+				qt = queues.erase(qt);
+			else
+				qt ++;
+		}
+		if(queues.empty())
+			owners.erase(wc);
+	}
+}
+
+/**
+	@brief Looks for a running job which should have a second copy run on the given build slot.
+
+	@param hung		If true, look for jobs which ran past their timeout.
+					If false, look for jobs running much slower than their estimate.
+
+	@return A new reference to the job, or NULL if none are available.
+ */
+Job* Scheduler::PopStraggler(clientID slot, const set<string>& toolchains, unsigned int memory, bool hung)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	double now = GetTime();
+	for(auto& it : m_runningJobs)
+	{
+		Job* job = it.first;
+
+		//Don't run more than two copies, don't run two copies on one slot, and make sure we can actually run it.
+		//(Other slots on the same node are fine: if a slot is hung, that may be the only place left to run it.)
+		if( (it.second.size() > 1) || (it.second.find(slot) != it.second.end()) )
+			continue;
+		if(toolchains.find(job->GetToolchain()) == toolchains.end())
+			continue;
+		if(job->GetMemoryRequirement() > memory)
+			continue;
+
+		//Not actually started yet? Can't be a straggler
+		double start = job->GetStartTime();
+		if(start == 0)
+			continue;
+		double elapsed = now - start;
+		double expected = job->GetEstimatedDuration();
+
+		if(hung)
+		{
+			double timeout = job->GetTimeout();
+			if( (timeout <= 0) || (elapsed < timeout) || (elapsed < 3*expected) )
+				continue;
+
+			LogWarning("Job %p has been running for %.1f sec (timeout %.1f), probably hung. Re-issuing to %s\n",
+				job, elapsed, timeout, slot.c_str());
+		}
+		else
+		{
+			if( (elapsed < 2*expected) || (elapsed < expected + STRAGGLER_MIN_DELAY) )
+				continue;
+
+			LogVerbose("Job %p has been running for %.1f sec (expected %.1f), running a second copy on %s\n",
+				job, elapsed, expected, slot.c_str());
+		}
+
+		job->Ref();
+		return job;
+	}
+
+	return NULL;
+}
+
+/**
+	@brief Get a ready job at a given priority which can run on any of the given toolchains without needing more
+	than the given amount of RAM.
+
+	Each working copy (i.e. developer) gets a fair share of the build farm: we track the estimated run time of all
+	jobs dispatched on behalf of each one, and serve whoever has received the least so far. A working copy which was
+	idle is brought up to date with the others when it submits work, so it can't save up credit (but one doing a
+	small incremental build still goes ahead of somebody in the middle of a full rebuild).
+
+	@param starved	Set to the job skipped for lack of RAM that's been waiting longest, if it's been waiting for more
+					than RESERVATION_DELAY (otherwise left unchanged)
+
+	@return A job, or NULL if none are available.
+ */
+Job* Scheduler::PopJob(
+	Job::Priority prio,
+	const set<string>& toolchains,
+	unsigned int memory,
+	const unordered_set<string>* cached,
+	Job*& starved)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	//Sort the working copies with jobs waiting by how much service they've had so far
+	auto& owners = m_readyJobs[prio];
+	auto& shares = m_fairShareTime[prio];
+	vector< pair<double, WorkingCopy*> > order;
+	for(auto& it : owners)
+		order.push_back(pair<double, WorkingCopy*>(shares[it.first], it.first));
+	sort(order.begin(), order.end());
+
+	//Serve the first one that has something we can run
+	for(auto& it : order)
+	{
+		auto wc = it.second;
+		auto& queues = owners[wc];
+		Job* job = PopJob(queues, toolchains, memory, cached, starved);
+
+		//Clean out empty queues so we know when the working copy goes idle
+		for(auto qt = queues.begin(); qt != queues.end(); )
+		{
+			if(qt->second.empty())
+				qt = queues.erase(qt);
+			else
+				qt ++;
+		}
+		if(queues.empty())
+			owners.erase(wc);
+
+		if(job)
+		{
+			m_fairShareClock[prio] = it.first;
+			shares[wc] = it.first + job->GetEstimatedDuration();
+			return job;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+	@brief Get the most urgent job from a set of ready queues which can run on any of the given toolchains
+	without needing more than the given amount of RAM.
+
+	Jobs too big to fit are skipped over so smaller ones can fill the remaining space, but only the first
+	AFFINITY_WINDOW jobs of each queue (big or not) are looked at. If one of the big ones has been waiting
+	too long, the caller reserves the node's RAM for it (see PopJob(clientID, ...)).
+	If the node gave us a set of file hashes it already has, we prefer (among the jobs nearly as urgent as the
+	first one) the job with the most input data already on that node.
+
+	@param starved	Set to the job skipped for lack of RAM that's been waiting longest, if it's been waiting for more
+					than RESERVATION_DELAY (otherwise left unchanged)
+
+	@return A job, or NULL if none are available.
+ */
+Job* Scheduler::PopJob(
+	toolchainqueues& queues,
+	const set<string>& toolchains,
+	unsigned int memory,
+	const unordered_set<string>* cached,
+	Job*& starved)
+{
+	double now = GetTime();
+
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	while(true)
+	{
+		//Collect the most urgent jobs that fit from each queue for the toolchains we have
+		typedef pair<jobqueue*, jobqueue::iterator> candidate;
+		map<jobkey, candidate> candidates;
+		for(auto& t : toolchains)
+		{
+			auto qt = queues.find(t);
+			if(qt == queues.end())
+				continue;
+
+			//Jobs skipped for lack of RAM count toward the window too, so a queue full of big jobs doesn't get
+			//scanned end to end on every pop
+			auto& queue = qt->second;
+			unsigned int count = 0;
+			for(auto it = queue.begin(); (it != queue.end()) && (count < AFFINITY_WINDOW); it++, count++)
+			{
+				Job* j = it->second;
+				if(j->GetMemoryRequirement() > memory)
+				{
+					double ready = j->GetReadyTime();
+					if( (now - ready > RESERVATION_DELAY) &&
+						( (starved == NULL) || (ready < starved->GetReadyTime()) ) )
+					{
+						starved = j;
+					}
+					continue;
+				}
+				candidates[it->first] = candidate(&queue, it);
+			}
+		}
+		if(candidates.empty())
+			return NULL;
+
+		//Default to the most urgent job.
+		//If the node has told us what it has cached, look through the next few for one that's nearly as urgent
+		//and needs less data shipped to it.
+		auto best = candidates.begin();
+		if( (cached != NULL) && !cached->empty() )
+		{
+			double minpath = AFFINITY_MIN_URGENCY * best->second.second->second->GetCriticalPath();
+			uint64_t bestsize = best->second.second->second->GetCachedInputSize(*cached);
+
+			unsigned int count = 0;
+			for(auto it = candidates.begin(); (it != candidates.end()) && (count < AFFINITY_WINDOW); it++, count++)
+			{
+				Job* j = it->second.second->second;
+				if(j->GetCriticalPath() < minpath)
+					break;
+
+				uint64_t size = j->GetCachedInputSize(*cached);
+				if(size > bestsize)
+				{
+					best = it;
+					bestsize = size;
+				}
+			}
+		}
+
+		Job* job = best->second.second->second;
+		best->second.first->erase(best->second.second);
+
+		//Prereqs are done, but the job might still not be runnable (output node not finalized etc).
+		//Park it and keep looking.
+		if(!job->IsRunnable())
+		{
+			m_deferredJobs.emplace(job);
+			continue;
+		}
+
+		//LogDebug("Popped job %p\n", job);
+		return job;
+	}
+}
+
+/**
+	@brief Puts a submitted job in the appropriate queue depending on the state of its prereqs
+
+	The scheduler must already hold a reference to the job.
+ */
+void Scheduler::EnqueueJob(Job* job)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	//If the job had a dependency fail, it can never run. Cancel it (and, in turn, anything depending on it)
+	if(job->IsCanceledByDeps())
+	{
+		job->SetCanceled();
+		job->Unref();
+	}
+
+	//Still blocking on something, wait for it to finish
+	else if(job->HasPendingDependencies())
+		m_waitingJobs.emplace(job);
+
+	//Ready to go
+	else if(job->IsRunnable())
+	{
+		auto prio = job->GetPriority();
+		auto wc = job->GetWorkingCopy();
+		auto& owners = m_readyJobs[prio];
+
+		//If the working copy had nothing ready, it was idle. Catch it up to everyone else (see PopJob)
+		if(owners.find(wc) == owners.end())
+		{
+			auto& share = m_fairShareTime[prio][wc];
+			share = max(share, m_fairShareClock[prio]);
+		}
+
+		//Keep the original time if we're going back in after being deferred, it's still been waiting all along
+		if(job->GetReadyTime() == 0)
+			job->SetReadyTime(GetTime());
+
+		owners[wc][job->GetToolchain()][GetJobKey(job)] = job;
+	}
+
+	//Prereqs are done, but we can't run yet for some other reason
+	else
+		m_deferredJobs.emplace(job);
+}
+
+/**
+	@brief Finds the ready queue a job would be in, if it exists (doesn't check if the job is actually there)
+ */
+Scheduler::jobqueue* Scheduler::GetReadyQueue(Job* job)
 {
-	m_tStart = GetTime();
-	m_running = false;
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	auto& owners = m_readyJobs[job->GetPriority()];
+	auto ot = owners.find(job->GetWorkingCopy());
+	if(ot == owners.end())
+		return NULL;
+	auto qt = ot->second.find(job->GetToolchain());
+	if(qt == ot->second.end())
+		return NULL;
+	return &qt->second;
 }
 
-Scheduler::~Scheduler()
+/**
+	@brief Removes a job from whichever waiting, ready, or deferred queue it's in.
+
+	@return True if the job was queued (in which case the scheduler's reference to it now belongs to the caller)
+ */
+bool Scheduler::DequeueJob(Job* job)
 {
-	//LogDebug("destroying scheduler\n");
+	lock_guard<recursive_mutex> lock(m_mutex);
 
-	for(auto it : m_pendingScanJobs)
-	{
-		for(auto job : it.second)
-			job->Unref();
-		it.second.clear();
-	}
+	if(m_waitingJobs.erase(job))
+		return true;
 
-	for(auto it : m_runnableJobs)
+	jobqueue* queue = GetReadyQueue(job);
+	if( (queue != NULL) && queue->erase(GetJobKey(job)) )
 	{
-		for(auto job : it.second)
-			job->Unref();
-		it.second.clear();
+		//Clean up empty queues so we know when the working copy goes idle (see PopJob)
+		if(queue->empty())
+		{
+			auto& owners = m_readyJobs[job->GetPriority()];
+			auto& queues = owners[job->GetWorkingCopy()];
+			queues.erase(job->GetToolchain());
+			if(queues.empty())
+				owners.erase(job->GetWorkingCopy());
+		}
+		return true;
 	}
+
+	if(m_deferredJobs.erase(job))
+		return true;
+
+	return false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// General scheduling
+// Work notification
 
 /**
-	@brief Remove and re-schedule jobs running on a node that's leaving the cluster
+	@brief Gets the current work generation.
+
+	Nodes should read this before trying to pop jobs, then pass it to WaitForWork() if nothing was available.
+	This ensures that a job submitted between the pop and the wait is not missed.
  */
-void Scheduler::RemoveNode(clientID id)
+uint64_t Scheduler::GetWorkGeneration()
 {
-	lock_guard<recursive_mutex> lock(m_mutex);
-	lock_guard<NodeManager> nlock(*g_nodeManager);
+	lock_guard<mutex> lock(m_workMutex);
+	return m_workGeneration;
+}
 
-	LogVerbose("Splashbuild worker %s is shutting down\n", id.c_str());
+/**
+	@brief Blocks until more work may be available, or the timeout expires.
 
-	//Destroy all pending scan jobs
-	//New scan jobs will be created when the node comes back
-	//(current Splash can only run scan jobs on one node at a time)
-	auto scans = m_pendingScanJobs[id];
-	for(auto job : scans)
-		job->Unref();
-	m_pendingScanJobs.erase(id);
+	@param generation	Work generation read by GetWorkGeneration() before the last unsuccessful pop
+	@param timeout		Maximum time to wait, in seconds
 
-	//See if the node currently has an active job
-	auto bjs = g_nodeManager->GetCurrentJobs(id);
-	for(auto bj : bjs)
+	@return True if new work may be available, false if we timed out
+ */
+bool Scheduler::WaitForWork(uint64_t generation, double timeout)
+{
+	unique_lock<mutex> lock(m_workMutex);
+	return m_workCondition.wait_for(
+		lock,
+		chrono::duration<double>(timeout),
+		[this, generation]{ return m_workGeneration != generation; });
+}
+
+/**
+	@brief Wakes up all idle nodes so they can check the queues again
+ */
+void Scheduler::NotifyWorkAvailable()
+{
+	lock_guard<mutex> lock(m_workMutex);
+	m_workGeneration ++;
+	m_workCondition.notify_all();
+}
+
+/**
+	@brief Called by a job when it becomes done or canceled.
+
+	Jobs blocking on this one may now be runnable (or canceled by dependencies), so wake up idle nodes.
+ */
+void Scheduler::OnJobCompleted(Job* job)
+{
+	//Not running anywhere anymore.
+	//If there's another copy still going, its thread will discard the results once they come in.
 	{
-		//Remove the ref our dying thread held, mark it as pending again, and put it back in the run queue
-		bj->SetPending();
-		bj->Unref();
-		SubmitJob(bj);
+		lock_guard<recursive_mutex> lock(m_mutex);
+		m_runningJobs.erase(job);
 	}
-}
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Dependency scanning
+	//Remember how long jobs took so we can schedule (and estimate build times) better next time
+	string jobclass;
+	string key;
+	double runtime = job->GetRunTime();
+	if( (runtime >= 0) && job->GetHistoryKeys(jobclass, key) )
+		m_history.AddRun(jobclass, key, runtime, job->GetWorker(), job->GetInputSize(), job->IsSuccessful());
+
+	NotifyWorkAvailable();
+}
 
 /**
-	@brief Get the next available scan job for a given node, if there is one available.
+	@brief Called when a job's last prereq finishes, or the first one fails.
 
-	@return A scan job, or NULL if none are available.
+	Moves the job from the waiting list to the ready queue, or cancels it.
  */
-DependencyScanJob* Scheduler::PopScanJob(clientID id)
+void Scheduler::OnJobUnblocked(Job* job)
 {
 	lock_guard<recursive_mutex> lock(m_mutex);
-	if(m_pendingScanJobs[id].empty())
-		return NULL;
 
-	//TODO: Check if the job is runnable and wait if it's not
+	//If the job isn't in our waiting list it hasn't been submitted yet. SubmitJob() will sort it out.
+	//Don't touch the job until we know we hold a reference to it!
+	auto it = m_waitingJobs.find(job);
+	if(it == m_waitingJobs.end())
+		return;
 
-	auto ret = *m_pendingScanJobs[id].begin();
-	m_pendingScanJobs[id].pop_front();
+	//Spurious wakeup, nothing to do
+	if(job->HasPendingDependencies() && !job->IsCanceledByDeps())
+		return;
 
-	ret->Ref();
-	g_nodeManager->AddJob(id, ret);
-	return ret;
+	m_waitingJobs.erase(it);
+	EnqueueJob(job);
 }
 
 /**
-	@brief Get the next available job for a given node, if there is one available.
+	@brief Called when whatever kept a job with no pending prereqs from running is resolved (for a build job, when
+	its output node is finalized).
 
-	@return A job, or NULL if none are available.
+	Moves the job to the ready queue if we had deferred it.
  */
-Job* Scheduler::PopJob(clientID id)
+void Scheduler::OnJobRunnable(Job* job)
 {
-	lock_guard<recursive_mutex> lock(m_mutex);
-
-	//Attempt to pop the job queue from each priority, from max to min priority
-	for(int i=0; i<Job::PRIO_COUNT; i++)
 	{
-		Job* job = PopJob(id, static_cast<Job::Priority>(i));
-		if(job)
-		{
-			//This job is now running on the node that requested it
-			g_nodeManager->AddJob(id, job);
-			return job;
-		}
+		lock_guard<recursive_mutex> lock(m_mutex);
+
+		//If the job isn't deferred, it was never held up (or hasn't been submitted yet). Nothing to do.
+		if(!m_deferredJobs.erase(job))
+			return;
+		EnqueueJob(job);
 	}
 
-	return NULL;
+	NotifyWorkAvailable();
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Build requests
+
 /**
-	@brief Get the next available job for a given node and priority, if there is one available.
+	@brief Records that a client is waiting on the output of a job
+ */
+void Scheduler::AddBuildRequest(Job* job)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+	m_buildRequests[job] ++;
+}
 
-	@return A job, or NULL if none are available.
+/**
+	@brief Records that a client is no longer waiting on the output of a job (it finished, or the client gave up)
  */
-Job* Scheduler::PopJob(clientID id, Job::Priority prio)
+void Scheduler::RemoveBuildRequest(Job* job)
 {
 	lock_guard<recursive_mutex> lock(m_mutex);
 
-	//Look up the toolchains for this node
-	set<string> toolchains;
-	g_nodeManager->ListToolchainsForClient(toolchains, id);
+	auto it = m_buildRequests.find(job);
+	if(it == m_buildRequests.end())
+		return;
+	if(--it->second == 0)
+		m_buildRequests.erase(it);
+}
 
-	//Go over the list from oldest to newest
-	jobqueue& jobs = m_runnableJobs[prio];
-	int n = 0;
-	for(auto it = jobs.begin(); it != jobs.end(); n++)
-	{
-		auto job = *it;
+/**
+	@brief Gives up on a set of jobs the caller requested (the client disconnected, or a fail-fast build failed).
 
-		//See if we have the toolchain this job needs
-		if(toolchains.find(job->GetToolchain()) == toolchains.end())
-		{
-			//LogDebug("[%d] PopJob rejecting job %p b/c toolchain %s not offered by client %s\n",
-			//	n, job, job->GetToolchain().c_str(), id.c_str());
-			it++;
-			continue;
-		}
+	The caller's build request for each job is dropped. Then we walk down the DAG, canceling everything that no
+	other request is still waiting on. Queued jobs are simply removed. Running jobs are marked as canceled, and the
+	thread talking to the node running them tells it to stop.
+ */
+void Scheduler::CancelJobs(const set<Job*>& jobs)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
 
-		//If the job had a dependency fail, delete it from the queue rather than wasting time spinning.
-		if(job->IsCanceledByDeps())
-		{
-			//LogDebug("[%d] PopJob cancelling job %p (canceled by dependencies)\n", n, job);
+	for(auto j : jobs)
+		RemoveBuildRequest(j);
 
-			//Mark the job as canceled
-			job->SetCanceled();
+	//Hold a reference to everything on the worklist, since canceling a job may free its prereqs
+	vector<Job*> worklist;
+	for(auto j : jobs)
+	{
+		j->Ref();
+		worklist.push_back(j);
+	}
 
-			//Delete it from the queue
-			auto old_it = it;
-			it++;
-			jobs.erase(old_it);
-			job->Unref();
-			continue;
-		}
+	unsigned int count = 0;
+	while(!worklist.empty())
+	{
+		Job* job = worklist.back();
+		worklist.pop_back();
 
-		//If we can't run the job b/c of dependencies, keep looking
-		if(!job->IsRunnable())
+		//Skip anything somebody else still wants
+		if( !job->IsFinished() &&
+			(m_buildRequests.find(job) == m_buildRequests.end()) &&
+			!job->HasPendingDependents() )
 		{
-			//LogDebug("[%d] PopJob rejecting job %p (%s) b/c not runnable (%d jobs in queue)\n",
-			//	n, job, dynamic_cast<BuildJob*>(job)->GetOutputNode()->GetFilePath().c_str(), jobs.size());
+			for(auto d : job->GetDependencies())
+			{
+				d->Ref();
+				worklist.push_back(d);
+			}
 
-			it++;
-			continue;
+			bool queued = DequeueJob(job);
+			job->SetCanceled();
+			if(queued)
+				job->Unref();
+			count ++;
 		}
 
-		//We're good, use this job
-		jobs.erase(it);
-		//LogDebug("Popped job %p (%d jobs in queue)\n", job, jobs.size());
-		return job;
+		job->Unref();
 	}
 
-	return NULL;
+	LogDebug("Canceled %u jobs\n", count);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -211,7 +1091,7 @@ Job* Scheduler::PopJob(clientID id, Job::Priority prio)
 /**
 	@brief Schedules a dependency-scan job and returns immediately after submitting it.
 
-	@return		The newly scheduled job
+	@return		The newly scheduled job (already completed, if the results of an earlier scan could be reused)
  */
 DependencyScanJob* Scheduler::ScanDependenciesNonblocking(
 	string fname,
@@ -231,30 +1111,176 @@ DependencyScanJob* Scheduler::ScanDependenciesNonblocking(
 	//	GetDT(), fname.c_str(), arch.c_str(), toolchain.c_str() );
 	//LogIndenter li;
 
-	//Need mutex locked during scheduling so that if the golden node leaves halfway through
+	//Look up the hash for the job
+	string hash;
+	{
+		lock_guard<NodeManager> lock(*g_nodeManager);
+		hash = g_nodeManager->GetToolchainHash(arch, toolchain);
+		if(hash == "")
+			return NULL;
+		auto chain = g_nodeManager->GetAnyToolchainForHash(hash);
+		if(chain == NULL)
+			return NULL;
+		//LogDebug("Compiler hash is %s (%s)\n", hash.c_str(), chain->GetVersionString().c_str());
+	}
+
+	//If we already did this exact scan (for this or any other working copy) and nothing it found has changed since,
+	//reuse the results without involving a build server at all.
+	//Relative includes resolve against the source file's directory, so the path is part of the key too.
+	string key;
+	string filehash = wc->GetFileHash(fname);
+	if(filehash != "")
+	{
+		string hashin = sha256(fname) + sha256(filehash) + sha256(hash) + sha256(arch);
+		for(auto f : flags)
+			hashin += sha256(f);
+		key = sha256(hashin);
+
+		auto job = LookupScan(key, fname, arch, hash, flags, wc);
+		if(job != NULL)
+			return job;
+	}
+
+	//Library lookups depend on what's installed on the specific machine running the scan, not just the compiler.
+	//Always do them on the golden node so results are consistent.
+	bool pinned = false;
+	for(auto f : flags)
+	{
+		if(f.GetType() == BuildFlag::TYPE_LIBRARY)
+			pinned = true;
+	}
+
+	//SubmitScan keeps the node manager locked during scheduling so that if the golden node leaves halfway through
 	//we remain in a consistent state
-	lock_guard<NodeManager> lock(*g_nodeManager);
+	auto job = SubmitScan(fname, arch, hash, flags, wc, pinned);
+	if(job != NULL)
+		job->SetMemoKey(key);
+	return job;
+}
 
-	//Look up the hash for the job
-	auto hash = g_nodeManager->GetToolchainHash(arch, toolchain);
-	if(hash == "")
-		return NULL;
-	auto chain = g_nodeManager->GetAnyToolchainForHash(hash);
-	if(chain == NULL)
-		return NULL;
-	//LogDebug("Compiler hash is %s (%s)\n", hash.c_str(), chain->GetVersionString().c_str());
+/**
+	@brief Creates an already completed scan job from the results of an earlier scan, if they're still valid
+
+	@param key		Scan key to look up
+	@param hash		Toolchain hash
+
+	@return		The completed job, or NULL if we have no usable results
+ */
+DependencyScanJob* Scheduler::LookupScan(
+	string key,
+	string fname,
+	string arch,
+	string hash,
+	set<BuildFlag> flags,
+	WorkingCopy* wc)
+{
+	ScanMemo memo;
+	{
+		lock_guard<mutex> lock(m_scanMemoMutex);
+		auto it = m_scanMemo.find(key);
+		if(it == m_scanMemo.end())
+			return NULL;
+		memo = it->second;
 
-	//Find which node is supposed to run this job
-	auto id = g_nodeManager->GetGoldenNodeForToolchain(hash);
-	if(id.empty())
+		//Move to the front of the LRU list
+		m_scanMemoLRU.splice(m_scanMemoLRU.begin(), m_scanMemoLRU, it->second.lru);
+	}
+
+	//The source file is part of the key, but headers it included may have changed since.
+	//System headers this working copy hasn't seen yet are fine, BlockOnScanResults() will add them.
+	for(auto it : memo.deps)
+	{
+		string cur = wc->GetFileHash(it.first);
+		if(cur == it.second)
+			continue;
+		if( (cur == "") && (it.first.find("__sys") != string::npos) )
+			continue;
 		return NULL;
-	//auto build_wc = g_nodeManager->GetWorkingCopy(id);
-	//string hostname = build_wc->GetHostname();
-	//LogDebug("Golden node for this toolchain is %s (%s)\n", id.c_str(), hostname.c_str());
+	}
+
+	//Results were checked against the golden node (if needed) before we recorded them, so mark as pinned
+	auto job = new DependencyScanJob(fname, wc, hash, arch, flags);
+	for(auto it : memo.deps)
+		job->AddDependency(it.first, it.second);
+	for(auto f : memo.flags)
+		job->AddFoundFlag(f);
+	job->SetPinned(true);
+	job->SetDone(true);
+	return job;
+}
+
+/**
+	@brief Remembers the results of a successful scan so LookupScan() can reuse them
+
+	Only the MAX_SCAN_MEMO most recently used results are kept.
+ */
+void Scheduler::RecordScan(DependencyScanJob* job)
+{
+	string key = job->GetMemoKey();
+	if(key == "")
+		return;
+
+	lock_guard<mutex> lock(m_scanMemoMutex);
+	auto it = m_scanMemo.find(key);
+	if(it == m_scanMemo.end())
+	{
+		m_scanMemoLRU.push_front(key);
+		it = m_scanMemo.emplace(key, ScanMemo()).first;
+	}
+	else
+		m_scanMemoLRU.splice(m_scanMemoLRU.begin(), m_scanMemoLRU, it->second.lru);
+
+	auto& memo = it->second;
+	memo.lru = m_scanMemoLRU.begin();
+	memo.deps = job->GetOutput();
+	memo.flags = job->GetFoundFlags();
+
+	//Forget the least recently used results if we're over the limit
+	while(m_scanMemo.size() > MAX_SCAN_MEMO)
+	{
+		m_scanMemo.erase(m_scanMemoLRU.back());
+		m_scanMemoLRU.pop_back();
+	}
+}
+
+/**
+	@brief Creates a dependency-scan job for a given toolchain and submits it
+
+	@param pinned	If true, the scan runs on the golden node for the toolchain.
+					If false, it can run on any node with the toolchain.
+
+	@return		The newly scheduled job, or NULL if nobody can run it
+ */
+DependencyScanJob* Scheduler::SubmitScan(
+	string fname,
+	string arch,
+	string hash,
+	set<BuildFlag> flags,
+	WorkingCopy* wc,
+	bool pinned)
+{
+	lock_guard<NodeManager> lock(*g_nodeManager);
+
+	DependencyScanJob* job = NULL;
+	if(pinned)
+	{
+		//Find which node is supposed to run this job
+		auto id = g_nodeManager->GetGoldenNodeForToolchain(hash);
+		if(id.empty())
+			return NULL;
+		//auto build_wc = g_nodeManager->GetWorkingCopy(id);
+		//string hostname = build_wc->GetHostname();
+		//LogDebug("Golden node for this toolchain is %s (%s)\n", id.c_str(), hostname.c_str());
 
-	//Create the scan job and submit it
-	DependencyScanJob* job = new DependencyScanJob(fname, wc, hash, arch, flags);
-	SubmitScanJob(id, job);
+		job = new DependencyScanJob(fname, wc, hash, arch, flags);
+		job->SetPinned(true);
+		SubmitScanJob(id, job);
+	}
+	else
+	{
+		job = new DependencyScanJob(fname, wc, hash, arch, flags);
+		SubmitScanJob(job);
+	}
 	return job;
 }
 
@@ -269,25 +1295,17 @@ bool Scheduler::BlockOnScanResults(
 	string& errors)
 {
 	//Block until the job is done
-	//TODO: make this more efficient
-	Job::Status status = Job::STATUS_PENDING;
-	while(status != Job::STATUS_DONE)
-	{
-		//If the job was canceled, our scan isn't going to happen so die
-		status = job->GetStatus();
-		if(status == Job::STATUS_CANCELED)
-		{
-			errors = job->GetErrors();
+	job->WaitForCompletion();
 
-			LogError("Dependency scan canceled: %s\n",
-				job->GetErrors().c_str());
-			job->Unref();
-			return false;
-		}
+	//If the job was canceled, our scan isn't going to happen so die
+	if(job->GetStatus() == Job::STATUS_CANCELED)
+	{
+		errors = job->GetErrors();
 
-		//Block for 2 ms (most jobs take way longer than this, the impact of waiting is miniscule)
-		//TODO: have some kind of true block vs busy-polling
-		usleep(2 * 1000);
+		LogError("Dependency scan canceled: %s\n",
+			job->GetErrors().c_str());
+		job->Unref();
+		return false;
 	}
 	//LogDebug("[%7.3f] Scan done\n", GetDT());
 
@@ -299,10 +1317,44 @@ bool Scheduler::BlockOnScanResults(
 		return false;
 	}
 
+	//System headers can differ between nodes with the same compiler (different versions of a library installed etc).
+	//If the scan ran on some other node and disagrees with what we already have, the golden node has the final say.
+	auto output = job->GetOutput();
+	if(!job->IsPinned())
+	{
+		for(auto it : output)
+		{
+			auto fname = it.first;
+			if(fname.find("__sys") == string::npos)
+				continue;
+
+			string old_hash = wc->GetFileHash(fname);
+			if( (old_hash == "") || (old_hash == it.second) )
+				continue;
+
+			LogWarning("System header %s differs between build servers, re-scanning %s on golden node\n",
+				fname.c_str(), job->GetPath().c_str());
+
+			auto retry = SubmitScan(
+				job->GetPath(), job->GetArch(), job->GetToolchain(), job->GetFlags(), wc, true);
+			if(retry != NULL)
+				retry->SetMemoKey(job->GetMemoKey());
+			job->Unref();
+			if(retry == NULL)
+			{
+				errors = "Golden node for toolchain went away\n";
+				return false;
+			}
+			return BlockOnScanResults(retry, wc, deps, foundflags, errors);
+		}
+	}
+
+	//The results are final now, remember them for next time
+	RecordScan(job);
+
 	//Add dependencies to the working copy as needed
 	//Don't worry about changing anything with newly added files.
 	//Note that we only care about system headers/libs, project code is already in the working copy
-	auto output = job->GetOutput();
 	set<string> ignored;
 	for(auto it : output)
 	{
@@ -334,8 +1386,25 @@ bool Scheduler::BlockOnScanResults(
  */
 void Scheduler::SubmitScanJob(clientID id, DependencyScanJob* job)
 {
-	lock_guard<recursive_mutex> lock(m_mutex);
-	m_pendingScanJobs[id].push_back(job);
+	{
+		lock_guard<recursive_mutex> lock(m_mutex);
+		m_pinnedScanJobs[id].push_back(job);
+	}
+
+	NotifyWorkAvailable();
+}
+
+/**
+	@brief Submit a dependency scan job for any node with the right toolchain
+ */
+void Scheduler::SubmitScanJob(DependencyScanJob* job)
+{
+	{
+		lock_guard<recursive_mutex> lock(m_mutex);
+		m_pendingScanJobs[job->GetToolchain()].push_back(job);
+	}
+
+	NotifyWorkAvailable();
 }
 
 /**
@@ -343,8 +1412,6 @@ void Scheduler::SubmitScanJob(clientID id, DependencyScanJob* job)
  */
 void Scheduler::SubmitJob(Job* job)
 {
-	lock_guard<recursive_mutex> lock(m_mutex);
-
 	if(job == NULL)
 		LogFatal("Submitted null job\n");
 	if(job->GetToolchain() == "")
@@ -352,15 +1419,138 @@ void Scheduler::SubmitJob(Job* job)
 	if(job->GetPriority() >= Job::PRIO_COUNT)
 		LogFatal("Submitted job with bad priority\n");
 
-	job->Ref();
-	m_runnableJobs[job->GetPriority()].push_back(job);
+	{
+		lock_guard<recursive_mutex> lock(m_mutex);
+		job->Ref();
+
+		//Figure out how long the job will take, then update critical paths of everything upstream of it.
+		//If the job is being resubmitted (node went offline) keep the old values.
+		if(job->GetSequence() == 0)
+		{
+			string jobclass;
+			string key;
+			double duration = JobHistory::DEFAULT_DURATION;
+			if(job->GetHistoryKeys(jobclass, key))
+				duration = m_history.GetEstimatedDuration(jobclass, key);
+			job->SetEstimatedDuration(duration);
+			job->SetCriticalPath(duration);
+			UpdateCriticalPaths(job);
+		}
+		job->SetSequence(++ m_nextSequence);
+
+		EnqueueJob(job);
+	}
+
+	NotifyWorkAvailable();
 
 	/*
 	LogDebug("[%6.3f] Submit job %p (%s), prio %d (%d total)\n",
 		GetDT(),
 		job,
-		dynamic_cast<BuildJob*>(job)->GetOutputNode()->GetFilePath().c_str(),
+		dynamic_cast<BuildJob*>(job)->GetOutputPath().c_str(),
 		job->GetPriority(),
-		m_runnableJobs[job->GetPriority()].size());
+		m_readyJobs[job->GetPriority()][job->GetWorkingCopy()][job->GetToolchain()].size());
 	*/
 }
+
+/**
+	@brief Propagates a newly submitted job's critical path to everything it depends on.
+
+	Each prereq has to finish before we can start, so its critical path is at least its own run time plus ours.
+	Walk up the DAG until nothing changes. Prereqs in the ready queues are re-sorted as needed.
+ */
+void Scheduler::UpdateCriticalPaths(Job* job)
+{
+	lock_guard<recursive_mutex> lock(m_mutex);
+
+	vector<Job*> worklist;
+	worklist.push_back(job);
+	while(!worklist.empty())
+	{
+		Job* j = worklist.back();
+		worklist.pop_back();
+
+		double length = j->GetCriticalPath();
+		for(auto d : j->GetDependencies())
+		{
+			//Already done, or not making it any longer? Nothing to do
+			if(d->IsFinished())
+				continue;
+			double dlength = d->GetEstimatedDuration() + length;
+			if(dlength <= d->GetCriticalPath())
+				continue;
+
+			//If it's in a ready queue, move it to the right spot
+			jobqueue* queue = GetReadyQueue(d);
+			bool queued = (queue != NULL) && (queue->erase(GetJobKey(d)) != 0);
+			d->SetCriticalPath(dlength);
+			if(queued)
+				(*queue)[GetJobKey(d)] = d;
+
+			worklist.push_back(d);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Progress estimation
+
+/**
+	@brief Guesses how long it'll be until a set of jobs (and everything they depend on) is done, in seconds.
+
+	We can't finish any faster than the longest chain of unfinished jobs, or than the total work left spread evenly
+	over every build slot we have. Take whichever is worse.
+
+	This walks every unfinished job the given ones depend on, so it does NOT take our mutex (UI clients call it every
+	second during a build, and nodes asking for work shouldn't have to wait on that). Everything it looks at is
+	either locked by the job itself or atomic, and the caller's references keep the whole DAG alive.
+ */
+double Scheduler::GetEstimatedTimeRemaining(const set<Job*>& jobs)
+{
+	unsigned int slots = g_nodeManager->GetBuildSlotCount();
+
+	double now = GetTime();
+	double work = 0;
+	double path = 0;
+	map<Job*, double> paths;
+	for(auto j : jobs)
+		path = max(path, GetRemainingPath(j, paths, work, now));
+
+	if(slots == 0)
+		return work;
+	return max(path, work / slots);
+}
+
+/**
+	@brief Finds the expected time until a job is done, following its unfinished dependencies.
+
+	@param job		The job to look at
+	@param paths	Results for jobs we've already looked at
+	@param work		Incremented by the remaining run time of each job we haven't seen before
+	@param now		Current time
+ */
+double Scheduler::GetRemainingPath(Job* job, map<Job*, double>& paths, double& work, double now)
+{
+	auto it = paths.find(job);
+	if(it != paths.end())
+		return it->second;
+
+	double length = 0;
+	if(!job->IsFinished())
+	{
+		//If it's already running, count only the time it's got left (but assume it's not done yet)
+		double self = job->GetEstimatedDuration();
+		double start = job->GetStartTime();
+		if(start != 0)
+			self = max(0.0, self - (now - start));
+		work += self;
+
+		double deps = 0;
+		for(auto d : job->GetDependencies())
+			deps = max(deps, GetRemainingPath(d, paths, work, now));
+		length = self + deps;
+	}
+
+	paths[job] = length;
+	return length;
+}
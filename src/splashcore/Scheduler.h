@@ -35,10 +35,26 @@
 
 	Basic design:
 
-	As a job comes in, determine if all of the pre-requisites have been met. If not, put it in the waiting list
-	blocking on the first prereq. Once this is met either block on another prereq or move to the run queue.
+	As a job comes in, determine if all of the pre-requisites have been met. If not, put it in the waiting list.
+	Each job keeps a count of unfinished prereqs which is decremented as they complete; when it hits zero the job
+	is moved to the ready queue for its priority, working copy, and toolchain (or canceled, if a prereq failed).
 
-	When a node is ready for work, it checks the the global run queue in decreasing priority order.
+	When a node is ready for work, it goes through the priorities in decreasing order. Within a priority, working
+	copies are served in order of how much build time they've been given so far (weighted fair queueing, so one
+	developer's full rebuild can't starve another's incremental build). It checks the head of the ready queue for
+	each toolchain it offers, and takes the job with the longest critical path (oldest first in case of a tie).
+	Jobs needing more RAM than the node has left (see NodeManager::GetFreeMemory) are skipped. If one of them has been
+	skipped for too long (see RESERVATION_DELAY), the node stops taking new jobs until enough RAM frees up to run it,
+	so a steady stream of small jobs can't starve it forever.
+
+	Straggler handling: if a running job goes past its timeout, the next node asking for work gets a second copy of
+	it ahead of anything else. If a node has nothing else to do (typically near the end of a build), it also gets a
+	second copy of any job running much slower than its history says it should. Whichever copy finishes first wins
+	(see Job::ClaimResult).
+
+	The critical path of a job is its own estimated run time (from the JobHistory) plus the longest critical path
+	of anything that depends on it. Since jobs are always submitted after their prereqs, it's updated
+	incrementally by walking up the DAG from each newly submitted job.
  */
 class Scheduler
 {
@@ -63,19 +79,55 @@ public:
 
 	//Node creation/deletion
 	void RemoveNode(clientID id);
+	void RemoveSlot(clientID slot);
+	void RemoveWorkingCopy(WorkingCopy* wc);
 
 	//Internal helpers
+	DependencyScanJob* SubmitScan(
+		std::string fname,
+		std::string arch,
+		std::string hash,
+		std::set<BuildFlag> flags,
+		WorkingCopy* wc,
+		bool pinned);
+	DependencyScanJob* LookupScan(
+		std::string key,
+		std::string fname,
+		std::string arch,
+		std::string hash,
+		std::set<BuildFlag> flags,
+		WorkingCopy* wc);
+	void RecordScan(DependencyScanJob* job);
 	void SubmitScanJob(clientID id, DependencyScanJob* job);
+	void SubmitScanJob(DependencyScanJob* job);
 	void SubmitJob(Job* job);
 
 	//Node interface
-	DependencyScanJob* PopScanJob(clientID id);
-	Job* PopJob(clientID id);
-	Job* PopJob(clientID id, Job::Priority prio);
+	DependencyScanJob* PopScanJob(clientID slot);
+	Job* PopJob(clientID slot, const std::unordered_set<std::string>* cached = NULL);
+	void PopBatch(clientID slot, std::vector<Job*>& batch);
+
+	uint64_t GetWorkGeneration();
+	bool WaitForWork(uint64_t generation, double timeout);
+
+	//Job interface
+	void OnJobCompleted(Job* job);
+	void OnJobUnblocked(Job* job);
+	void OnJobRunnable(Job* job);
+
+	//Build request interface
+	void AddBuildRequest(Job* job);
+	void RemoveBuildRequest(Job* job);
+	void CancelJobs(const std::set<Job*>& jobs);
 
 	double GetDT()
 	{ return GetTime() - m_tStart; }
 
+	JobHistory& GetHistory()
+	{ return m_history; }
+
+	double GetEstimatedTimeRemaining(const std::set<Job*>& jobs);
+
 protected:
 
 	/**
@@ -86,25 +138,195 @@ protected:
 	//A FIFO of scan jobs waiting to run
 	typedef std::list<DependencyScanJob*> scanqueue;
 
-	//A FIFO of jobs waiting to run
-	typedef std::list<Job*> jobqueue;
+	//Sort key for ready jobs: negated critical path (so longest is first), then submission order
+	typedef std::pair<double, uint64_t> jobkey;
+
+	//A queue of jobs ready to run (begin() is the one to run next)
+	typedef std::map<jobkey, Job*> jobqueue;
+
+	//Ready queues for each toolchain hash
+	typedef std::map<std::string, jobqueue> toolchainqueues;
+
+	//Ready queues for each working copy
+	typedef std::map<WorkingCopy*, toolchainqueues> ownerqueues;
+
+	/**
+		@brief Dependency scan jobs waiting to run on any node with the right toolchain, by toolchain hash
+	 */
+	std::map<std::string, scanqueue> m_pendingScanJobs;
+
+	/**
+		@brief Dependency scan jobs waiting to run on one specific node (the golden node for their toolchain)
+	 */
+	std::map<clientID, scanqueue> m_pinnedScanJobs;
+
+	/**
+		@brief Jobs whose prereqs are all done, grouped by priority, working copy, and toolchain.
+
+		Within each queue jobs are sorted by critical path length. Note that jobs may run out-of-order because
+		not all jobs can run on any given node.
+
+		Working copies with nothing ready are removed, so this also tells us who is waiting on the build farm.
+	 */
+	std::map<Job::Priority, ownerqueues> m_readyJobs;
+
+	/**
+		@brief Estimated run time of all jobs dispatched for each working copy so far, at each priority.
+
+		Used to share nodes fairly between developers (see PopJob).
+	 */
+	std::map<Job::Priority, std::map<WorkingCopy*, double> > m_fairShareTime;
+
+	/// @brief Service time of the working copy we most recently dispatched a job for, at each priority
+	std::map<Job::Priority, double> m_fairShareClock;
+
+	/**
+		@brief Jobs blocking on at least one prereq
+	 */
+	std::set<Job*> m_waitingJobs;
 
 	/**
-		@brief Dependency scan jobs waiting to run
+		@brief Jobs whose prereqs are done but which are not runnable for some other reason
+		(typically, the output node is not yet finalized). Moved to the ready queues by OnJobRunnable().
 	 */
-	std::map<clientID, scanqueue> m_pendingScanJobs;
+	std::set<Job*> m_deferredJobs;
+
+	/// @brief Sequence number for the next submitted job
+	uint64_t m_nextSequence;
+
+	/// @brief Run times of past jobs
+	JobHistory m_history;
 
 	/**
-		@brief TODO: Jobs currently executing on each node (need to push back to main run queue if the node disconnects)
+		@brief Build jobs which are currently running, and the build slots running them.
+
+		Normally each job runs on one slot, but stragglers may have a second copy running elsewhere.
+	 */
+	std::map<Job*, std::set<clientID> > m_runningJobs;
+
+	/**
+		@brief Jobs which clients have asked for the output of, and how many requests are waiting on each.
+
+		A job is only canceled (see CancelJobs) if nobody is waiting on it, or on anything depending on it.
 	 */
+	std::map<Job*, unsigned int> m_buildRequests;
 
 	/**
-		@brief Jobs which are currently waiting to run, grouped by priority.
+		@brief Minimum time a job has to run past its estimate before we consider it a straggler, in seconds
 
-		Within each queue jobs are sorted in FIFO order. Note that jobs may run out-of-order because
-		not all jobs can run on any given node and some may be blocking on dependencies
+		(keeps us from duplicating short jobs which are only slow due to noise)
 	 */
-	std::map<Job::Priority, jobqueue> m_runnableJobs;
+	static constexpr double STRAGGLER_MIN_DELAY = 15;
+
+	/**
+		@brief Number of ready jobs (the most urgent ones) we consider when looking for one whose inputs the
+		requesting node already has cached, or one small enough to fit in its free RAM
+	 */
+	static const unsigned int AFFINITY_WINDOW = 8;
+
+	/**
+		@brief Fraction of the most urgent job's critical path a job must have to be picked for cache affinity
+
+		(keeps us from starting something with plenty of slack ahead of the job actually holding up the build)
+	 */
+	static constexpr double AFFINITY_MIN_URGENCY = 0.75;
+
+	/**
+		@brief Time a job has to sit in a ready queue, skipped because it needs more RAM than the node asking for work
+		has free, before we hold the node's RAM for it, in seconds
+	 */
+	static constexpr double RESERVATION_DELAY = 60;
+
+	/**
+		@brief Big jobs each node is draining its RAM for (see PopJob). We hold a reference to each job.
+
+		A node with a reservation takes no new jobs until the reserved one fits.
+	 */
+	std::map<clientID, Job*> m_memoryReservations;
+
+	/// @brief Maximum number of jobs sent to a node in one batch (see PopBatch)
+	static const unsigned int BATCH_MAX_SIZE = 8;
+
+	/**
+		@brief Jobs estimated to run longer than this (in seconds) are never batched
+
+		(batching only pays off when the round trip is a big part of the job's run time)
+	 */
+	static constexpr double BATCH_MAX_DURATION = 0.5;
+
+	static jobkey GetJobKey(Job* job)
+	{ return jobkey(-job->GetCriticalPath(), job->GetSequence()); }
+
+	void EnqueueJob(Job* job);
+	Job* PopJob(
+		Job::Priority prio,
+		const std::set<std::string>& toolchains,
+		unsigned int memory,
+		const std::unordered_set<std::string>* cached,
+		Job*& starved);
+	Job* PopJob(
+		toolchainqueues& queues,
+		const std::set<std::string>& toolchains,
+		unsigned int memory,
+		const std::unordered_set<std::string>* cached,
+		Job*& starved);
+	Job* PopReservedJob(clientID slot, unsigned int memory, bool& draining);
+	void ReleaseReservation(clientID id);
+	jobqueue* GetReadyQueue(Job* job);
+	bool DequeueJob(Job* job);
+	Job* PopStraggler(clientID slot, const std::set<std::string>& toolchains, unsigned int memory, bool hung);
+	void UpdateCriticalPaths(Job* job);
+	double GetRemainingPath(Job* job, std::map<Job*, double>& paths, double& work, double now);
+
+	void NotifyWorkAvailable();
+
+	/**
+		@brief Mutex protecting m_workGeneration.
+
+		This is separate from m_mutex so that jobs can signal completion without contending for the queues.
+	 */
+	std::mutex m_workMutex;
+
+	/// @brief Signaled whenever m_workGeneration changes
+	std::condition_variable m_workCondition;
+
+	/**
+		@brief Counter incremented every time new work might be available for an idle node
+
+		(a job was submitted, or a job finished and may have unblocked others)
+	 */
+	uint64_t m_workGeneration;
+
+	/**
+		@brief Results of a successful dependency scan
+	 */
+	struct ScanMemo
+	{
+		/// @brief Map of <fname, hash> for everything the scan found
+		std::map<std::string, std::string> deps;
+
+		/// @brief Additional flags produced by the scan
+		std::set<BuildFlag> flags;
+
+		/// @brief Our position in m_scanMemoLRU
+		std::list<std::string>::iterator lru;
+	};
+
+	/**
+		@brief Results of past scans, for all working copies
+
+		Map from scan key (path and content hash of the source, toolchain, arch, and flags) to results.
+	 */
+	std::map<std::string, ScanMemo> m_scanMemo;
+
+	/// @brief Keys of m_scanMemo, most recently used first
+	std::list<std::string> m_scanMemoLRU;
+
+	/// @brief Maximum number of entries in m_scanMemo (least recently used ones are evicted past this)
+	static const size_t MAX_SCAN_MEMO = 65536;
+
+	/// @brief Mutex protecting m_scanMemo and m_scanMemoLRU
+	std::mutex m_scanMemoMutex;
 
 	/// @brief Time the scheduler was initialized
 	double m_tStart;
@@ -0,0 +1,77 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "splashcore.h"
+
+using namespace std;
+
+//The table of interned strings (unordered_set never moves its elements, so pointers to them stay valid).
+//Split into shards, each with its own lock, since nodes are created from several threads at once.
+#define SYMBOL_SHARDS 64
+
+struct SymbolShard
+{
+	mutex lock;
+	unordered_set<string> symbols;
+};
+
+static SymbolShard g_symbolShards[SYMBOL_SHARDS];
+
+/**
+	@brief Looks up the table entry for a string, adding it if needed
+ */
+const string* Symbol::Intern(const string& str)
+{
+	auto& shard = g_symbolShards[hash<string>()(str) % SYMBOL_SHARDS];
+	lock_guard<mutex> lock(shard.lock);
+	return &*shard.symbols.emplace(str).first;
+}
+
+/**
+	@brief Gets the table entry for the empty string, without locking anything after the first call
+ */
+const string* Symbol::GetEmpty()
+{
+	static const string* empty = Intern("");
+	return empty;
+}
+
+/**
+	@brief Gets the number of distinct strings interned so far
+ */
+size_t Symbol::GetTableSize()
+{
+	size_t size = 0;
+	for(auto& shard : g_symbolShards)
+	{
+		lock_guard<mutex> lock(shard.lock);
+		size += shard.symbols.size();
+	}
+	return size;
+}
@@ -0,0 +1,112 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef Symbol_h
+#define Symbol_h
+
+/**
+	@brief An interned, immutable string
+
+	Graph nodes store a handful of strings that take very few distinct values across the whole server (architecture,
+	configuration, toolchain name and hash, build script path), plus the paths of their inputs (see SymbolSet). Rather
+	than every node having its own heap allocated copy of each, they're kept once in a global table and nodes just hold
+	a pointer to the table entry.
+
+	Creating a Symbol locks one shard of the table, so nodes being created on several threads at once mostly don't
+	contend. Copying, comparing two Symbols, and reading the string are free. Table entries are never freed.
+ */
+class Symbol
+{
+public:
+	Symbol()
+	: m_str(GetEmpty())
+	{}
+
+	Symbol(const std::string& str)
+	: m_str(Intern(str))
+	{}
+
+	Symbol(const char* str)
+	: m_str(Intern(str))
+	{}
+
+	operator const std::string&() const
+	{ return *m_str; }
+
+	const std::string& str() const
+	{ return *m_str; }
+
+	const char* c_str() const
+	{ return m_str->c_str(); }
+
+	bool empty() const
+	{ return m_str->empty(); }
+
+	//Interned strings are equal if and only if they're the same table entry
+	bool operator==(const Symbol& rhs) const
+	{ return m_str == rhs.m_str; }
+
+	bool operator!=(const Symbol& rhs) const
+	{ return m_str != rhs.m_str; }
+
+	bool operator==(const std::string& rhs) const
+	{ return *m_str == rhs; }
+
+	bool operator!=(const std::string& rhs) const
+	{ return *m_str != rhs; }
+
+	bool operator==(const char* rhs) const
+	{ return *m_str == rhs; }
+
+	bool operator!=(const char* rhs) const
+	{ return *m_str != rhs; }
+
+	static size_t GetTableSize();
+
+protected:
+	static const std::string* Intern(const std::string& str);
+	static const std::string* GetEmpty();
+
+	/// @brief The table entry (never NULL)
+	const std::string* m_str;
+};
+
+inline bool operator==(const std::string& lhs, const Symbol& rhs)
+{ return rhs == lhs; }
+
+inline bool operator!=(const std::string& lhs, const Symbol& rhs)
+{ return rhs != lhs; }
+
+inline bool operator==(const char* lhs, const Symbol& rhs)
+{ return rhs == lhs; }
+
+inline bool operator!=(const char* lhs, const Symbol& rhs)
+{ return rhs != lhs; }
+
+#endif
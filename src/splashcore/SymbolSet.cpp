@@ -0,0 +1,248 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+#include "splashcore.h"
+
+using namespace std;
+
+//The table of interned sets, keyed by a hash of their contents so we can find an existing copy of a set without
+//interning all of its strings first. Entries are weak so sets nobody uses any more can be removed.
+//Each shard is only ever looked at under its own lock.
+#define SYMBOL_SET_SHARDS 16
+
+struct SymbolSetEntry
+{
+	const SymbolSet::Items* items;
+	weak_ptr<const SymbolSet::Items> ref;
+};
+
+struct SymbolSetShard
+{
+	mutex lock;
+	unordered_multimap<size_t, SymbolSetEntry> sets;
+};
+
+static SymbolSetShard g_symbolSetShards[SYMBOL_SET_SHARDS];
+
+/**
+	@brief Hashes the contents of a set (works for std::set<std::string> or SymbolSet::Items)
+ */
+template<class T> static size_t HashSymbolSet(const T& strs)
+{
+	size_t h = strs.size();
+	for(auto& s : strs)
+		h = (h * 31) ^ hash<string>()(s);
+	return h;
+}
+
+/**
+	@brief Checks if a table entry has the same contents as a set we're looking for
+ */
+static bool SymbolSetEqual(const SymbolSet::Items& items, const set<string>& strs)
+{
+	if(items.size() != strs.size())
+		return false;
+
+	auto it = strs.begin();
+	for(auto& s : items)
+	{
+		if(s != *it)
+			return false;
+		++it;
+	}
+	return true;
+}
+
+/**
+	@brief Looks for a live table entry with the given contents, must be called with the shard locked
+ */
+static shared_ptr<const SymbolSet::Items> FindSymbolSet(SymbolSetShard& shard, size_t h, const set<string>& strs)
+{
+	auto range = shard.sets.equal_range(h);
+	for(auto it = range.first; it != range.second; ++it)
+	{
+		//Expired entries are on their way out (see DeleteSymbolSet), skip them
+		auto existing = it->second.ref.lock();
+		if(existing && SymbolSetEqual(*existing, strs))
+			return existing;
+	}
+	return shared_ptr<const SymbolSet::Items>();
+}
+
+/**
+	@brief Removes a set from the table once the last reference to it is gone
+ */
+static void DeleteSymbolSet(const SymbolSet::Items* items)
+{
+	size_t h = HashSymbolSet(*items);
+	auto& shard = g_symbolSetShards[h % SYMBOL_SET_SHARDS];
+	{
+		lock_guard<mutex> lock(shard.lock);
+
+		auto range = shard.sets.equal_range(h);
+		for(auto it = range.first; it != range.second; ++it)
+		{
+			if(it->second.items == items)
+			{
+				shard.sets.erase(it);
+				break;
+			}
+		}
+	}
+
+	delete items;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SymbolSet::SymbolSet()
+	: m_pending(NULL)
+{
+	//All empty sets share one entry, which is never freed
+	static shared_ptr<const Items> empty(new Items);
+	m_items = empty;
+}
+
+SymbolSet::SymbolSet(const SymbolSet& rhs)
+	: m_items(rhs.m_items)
+	, m_pending(NULL)
+{
+	if(rhs.m_pending)
+		m_pending = new set<string>(*rhs.m_pending);
+}
+
+SymbolSet& SymbolSet::operator=(const SymbolSet& rhs)
+{
+	if(this == &rhs)
+		return *this;
+
+	m_items = rhs.m_items;
+
+	delete m_pending;
+	m_pending = NULL;
+	if(rhs.m_pending)
+		m_pending = new set<string>(*rhs.m_pending);
+
+	return *this;
+}
+
+SymbolSet::~SymbolSet()
+{
+	delete m_pending;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Modification
+
+/**
+	@brief Adds a string to the set
+
+	Sets are only added to before they're frozen (see BuildGraphNode::Finalize), but if a frozen set is added to it
+	goes back to having a private copy.
+ */
+void SymbolSet::emplace(const string& str)
+{
+	if(m_pending == NULL)
+	{
+		m_pending = new set<string>;
+		for(auto& s : *m_items)
+			m_pending->emplace(s.str());
+	}
+
+	m_pending->emplace(str);
+}
+
+/**
+	@brief Swaps the private copy of the set being built for the shared copy in the table
+ */
+void SymbolSet::Freeze()
+{
+	if(m_pending == NULL)
+		return;
+
+	m_items = Intern(*m_pending);
+	delete m_pending;
+	m_pending = NULL;
+}
+
+/**
+	@brief Looks up the table entry for a set, adding it if needed
+ */
+shared_ptr<const SymbolSet::Items> SymbolSet::Intern(const set<string>& strs)
+{
+	size_t h = HashSymbolSet(strs);
+	auto& shard = g_symbolSetShards[h % SYMBOL_SET_SHARDS];
+
+	//Most sets are already in the table (same target in another arch, config or working copy)
+	{
+		lock_guard<mutex> lock(shard.lock);
+		auto existing = FindSymbolSet(shard, h, strs);
+		if(existing)
+			return existing;
+	}
+
+	//Nope, intern the individual strings. Don't hold the shard lock while doing that, it's the slow part.
+	//std::set is sorted so the vector comes out in the same order we'd iterate the original set in.
+	auto items = new Items;
+	items->reserve(strs.size());
+	for(auto& s : strs)
+		items->push_back(Symbol(s));
+
+	//Someone else might have added it in the meantime
+	lock_guard<mutex> lock(shard.lock);
+	auto existing = FindSymbolSet(shard, h, strs);
+	if(existing)
+	{
+		delete items;
+		return existing;
+	}
+
+	shared_ptr<const Items> ret(items, DeleteSymbolSet);
+	SymbolSetEntry entry;
+	entry.items = items;
+	entry.ref = ret;
+	shard.sets.emplace(h, entry);
+	return ret;
+}
+
+/**
+	@brief Gets the number of distinct sets in use
+ */
+size_t SymbolSet::GetTableSize()
+{
+	size_t size = 0;
+	for(auto& shard : g_symbolSetShards)
+	{
+		lock_guard<mutex> lock(shard.lock);
+		size += shard.sets.size();
+	}
+	return size;
+}
@@ -0,0 +1,137 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* SPLASH build system v0.2                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2016 Andrew D. Zonenberg                                                                               *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+
+#ifndef SymbolSet_h
+#define SymbolSet_h
+
+/**
+	@brief A sorted set of interned strings, itself interned.
+
+	Used for the dependency and source lists of graph nodes, which are most of a node's size. The same list turns up
+	many times over: once for each architecture and configuration a target is built for, and once for each working
+	copy that has the target. Each distinct list is kept once in a global table as a vector of Symbols, and nodes hold
+	a reference counted pointer to it. Lists are removed from the table when the last set using them goes away.
+
+	While a node is being set up it adds paths one at a time, so a set starts out with a private std::set that emplace()
+	adds to. Freeze() swaps that for the shared copy; BuildGraphNode::Finalize does this once the node's inputs can't
+	change any more. Reading a set never changes it, whether it's frozen or not. As with any container, emplace() and
+	Freeze() must not race with readers, so only call them on a node other threads can't see yet or while finalizing.
+ */
+class SymbolSet
+{
+public:
+	typedef std::vector<Symbol> Items;
+
+	/**
+		@brief Iterates over the strings in a set, in sorted order
+	 */
+	class const_iterator
+	{
+	public:
+		const_iterator(Items::const_iterator it)
+		: m_it(it)
+		, m_pending(false)
+		{}
+
+		const_iterator(std::set<std::string>::const_iterator it)
+		: m_pit(it)
+		, m_pending(true)
+		{}
+
+		const std::string& operator*() const
+		{ return m_pending ? *m_pit : m_it->str(); }
+
+		const std::string* operator->() const
+		{ return &**this; }
+
+		const_iterator& operator++()
+		{
+			if(m_pending)
+				++m_pit;
+			else
+				++m_it;
+			return *this;
+		}
+
+		bool operator==(const const_iterator& rhs) const
+		{ return m_pending ? (m_pit == rhs.m_pit) : (m_it == rhs.m_it); }
+
+		bool operator!=(const const_iterator& rhs) const
+		{ return !(*this == rhs); }
+
+	protected:
+		Items::const_iterator m_it;
+		std::set<std::string>::const_iterator m_pit;
+
+		///@brief True if we're iterating over the pending set of an unfrozen SymbolSet
+		bool m_pending;
+	};
+
+	SymbolSet();
+	SymbolSet(const SymbolSet& rhs);
+	SymbolSet& operator=(const SymbolSet& rhs);
+	virtual ~SymbolSet();
+
+	void emplace(const std::string& str);
+	void Freeze();
+
+	const_iterator begin() const
+	{
+		if(m_pending)
+			return const_iterator(m_pending->cbegin());
+		return const_iterator(m_items->begin());
+	}
+
+	const_iterator end() const
+	{
+		if(m_pending)
+			return const_iterator(m_pending->cend());
+		return const_iterator(m_items->end());
+	}
+
+	size_t size() const
+	{ return m_pending ? m_pending->size() : m_items->size(); }
+
+	bool empty() const
+	{ return m_pending ? m_pending->empty() : m_items->empty(); }
+
+	static size_t GetTableSize();
+
+protected:
+	static std::shared_ptr<const Items> Intern(const std::set<std::string>& strs);
+
+	/// @brief The table entry (never NULL, but out of date if m_pending is set)
+	std::shared_ptr<const Items> m_items;
+
+	/// @brief Contents of the set while it's still being built, or NULL once frozen
+	std::set<std::string>* m_pending;
+};
+
+#endif
@@ -80,10 +80,21 @@ bool Toolchain::ScanDependencies(
 	map<string, string>& dephashes,
 	string& output,
 	set<string>& missingFiles,
-	set<BuildFlag>& libFlags)
+	set<BuildFlag>& libFlags,
+	string hash)
 {
-	//Check if we already ran this exact scan before
-	string scanhash = m_depCache.GetHash(path, triplet, flags);
+	//Check if we already ran this exact scan before.
+	//Use the content hash if the caller already knows it, so a cache hit doesn't have to read the file.
+	//Relative includes resolve against the file's location, so the path (within the build root) is part of the key.
+	if(hash.empty())
+		hash = sha256_file(path);
+	string scanhash = m_depCache.GetHash(
+		m_hash,
+		GetSystemFingerprint(triplet),
+		hash,
+		GetRelativePathOfFile(root, path),
+		triplet,
+		flags);
 	if(m_depCache.IsCached(scanhash))
 	{
 		//LogDebug("[Toolchain::ScanDependencies] Results for %s are in cache\n", path.c_str());
@@ -114,10 +125,9 @@ bool Toolchain::ScanDependencies(
 				}
 			}
 
-			//File is a system include/library etc.
-			//For now, don't check it. It is the sysadmin's responsibility to restart splashbuild after
-			//any compiler/lib/header package upgrades.
-			//TODO: see if this is a reasonable policy.
+			//File is a system include/library etc. Don't hash it on every hit: the key includes the system
+			//fingerprint, so any package install/upgrade/removal that touches these directories already
+			//sends us to a different entry (this holds for entries loaded from disk too).
 			else if(fname.find("__sys") != string::npos)
 				continue;
 
@@ -169,6 +179,97 @@ bool Toolchain::ScanDependencies(
 	return ok;
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// System fingerprinting
+
+/**
+	@brief Registers a system include/library directory that scan results for a given triplet depend on
+
+	@param triplet		Target triplet
+	@param path			Absolute path of the directory
+	@param recursive	True to fingerprint all subdirectories as well (include trees), false for just the
+						directory itself (library search paths)
+ */
+void Toolchain::AddSystemDirectory(string triplet, string path, bool recursive)
+{
+	auto& dirs = m_systemDirs[triplet];
+	dirs[path] = dirs[path] || recursive;
+}
+
+/**
+	@brief Appends the path and mtime of a directory (and optionally its subdirectories) to a fingerprint
+ */
+static void FingerprintDirectory(string path, bool recursive, string& hashin)
+{
+	struct stat st;
+	if(0 != lstat(path.c_str(), &st) || !S_ISDIR(st.st_mode))
+	{
+		hashin += path + " missing\n";
+		return;
+	}
+
+	char tmp[128];
+	snprintf(tmp, sizeof(tmp), " %ld.%09ld\n", (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+	hashin += path + tmp;
+	if(!recursive)
+		return;
+
+	DIR* hdir = opendir(path.c_str());
+	if(!hdir)
+		return;
+	vector<string> subdirs;
+	dirent* pent;
+	while((pent = readdir(hdir)))
+	{
+		string name = pent->d_name;
+		if( (name == ".") || (name == "..") )
+			continue;
+
+		//Don't follow symlinks, the tree they point to is either fingerprinted on its own or not ours to watch
+		if(pent->d_type == DT_DIR)
+			subdirs.push_back(path + "/" + name);
+		else if(pent->d_type == DT_UNKNOWN)
+		{
+			string fpath = path + "/" + name;
+			if( (0 == lstat(fpath.c_str(), &st)) && S_ISDIR(st.st_mode) )
+				subdirs.push_back(fpath);
+		}
+	}
+	closedir(hdir);
+
+	//Sort the list of directories to ensure determinism
+	sort(subdirs.begin(), subdirs.end());
+	for(auto d : subdirs)
+		FingerprintDirectory(d, true, hashin);
+}
+
+/**
+	@brief Gets a hash that changes whenever the system headers or libraries visible to a triplet change
+
+	This covers the directory modification times of every system include tree and library search directory. Package
+	managers install files by creating/renaming them, which updates the directory they live in, so installing,
+	upgrading, or removing a header or library package (or adding a library that previously wasn't found) changes the
+	fingerprint. It is part of the dependency cache key, so results that referred to the old system files are never
+	reused - including results persisted by an earlier splashbuild run.
+
+	Walking the include trees takes a few ms, so the result is reused for a few seconds.
+ */
+string Toolchain::GetSystemFingerprint(string triplet)
+{
+	double now = GetTime();
+	auto it = m_systemFingerprints.find(triplet);
+	if( (it != m_systemFingerprints.end()) && (now - it->second.first) < 5)
+		return it->second.second;
+
+	string hashin;
+	for(auto jt : m_systemDirs[triplet])
+		FingerprintDirectory(jt.first, jt.second, hashin);
+	string fingerprint = sha256(hashin);
+
+	m_systemFingerprints[triplet] = pair<double, string>(now, fingerprint);
+	return fingerprint;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Accessors
 
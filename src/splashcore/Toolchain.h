@@ -190,6 +190,14 @@ public:
 	const stringpairmap& GetFixes()
 	{ return m_fixes; }
 
+	/**
+		@brief Set the directory to persist dependency scan results in, and its size limit in bytes (see DependencyCache)
+	 */
+	void SetDependencyCachePath(std::string path, uint64_t limit)
+	{ m_depCache.SetStoragePath(path, limit); }
+
+	std::string GetSystemFingerprint(std::string triplet);
+
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Actual compilation stuff
 
@@ -197,6 +205,8 @@ public:
 
 	/**
 		@brief Find dependencies for the given file
+
+		If the SHA-256 of the file's content is already known, pass it as hash to skip re-reading the file.
 	 */
 	bool ScanDependencies(
 		std::string triplet,
@@ -207,7 +217,8 @@ public:
 		std::map<std::string, std::string>& dephashes,
 		std::string& output,
 		std::set<std::string>& missingFiles,
-		std::set<BuildFlag>& libFlags);
+		std::set<BuildFlag>& libFlags,
+		std::string hash = "");
 
 	virtual bool Build(
 		std::string triplet,
@@ -229,6 +240,8 @@ protected:
 		std::set<std::string>& missingFiles,
 		std::set<BuildFlag>& libFlags) =0;
 
+	void AddSystemDirectory(std::string triplet, std::string path, bool recursive);
+
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Internal state
 
@@ -301,6 +314,18 @@ protected:
 		Cache of dependency-scan results
 	 */
 	DependencyCache m_depCache;
+
+	/**
+		@brief System include/library directories for each triplet (see GetSystemFingerprint)
+
+		Map from triplet to (path, recursive) tuples.
+	 */
+	std::map<std::string, std::map<std::string, bool> > m_systemDirs;
+
+	/**
+		@brief Most recently computed system fingerprint for each triplet, and when it was computed
+	 */
+	std::map<std::string, std::pair<double, std::string> > m_systemFingerprints;
 };
 
 #endif
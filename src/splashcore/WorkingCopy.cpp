@@ -44,7 +44,7 @@ WorkingCopy::WorkingCopy(string hostname, clientID id)
 
 	//LogDebug("creating working copy %p for hostname %s, uuid %s\n", this, hostname.c_str(), id.c_str());
 
-	//TODO: How do we persist all of the state for output files etc?
+	//State is persisted across server restarts by NodeManager (see SaveSnapshot)
 }
 
 WorkingCopy::~WorkingCopy()
@@ -171,25 +171,125 @@ void WorkingCopy::RefreshToolchains()
 {
 	lock_guard<recursive_mutex> lock(m_mutex);
 
-	//Find build scripts
+	//Find build scripts, root dirs first so that we don't waste time doing multiple refreshes
 	vector<string> paths;
-	for(auto it : m_fileMap)
-	{
-		string fname = it.first;
-		if(GetBasenameOfFile(fname) == "build.yml")
-			paths.push_back(fname);
-	}
+	m_graph.GetScriptsBelow("", paths);
 
-	//Sort the paths lexically
-	//This way we do root dirs first so that we don't waste time doing multiple refreshes
-	sort(paths.begin(), paths.end());
+	//Run the YAML parser on all of them in parallel
+	set<string> hashes;
+	for(auto p : paths)
+		hashes.emplace(m_fileMap[p]);
+	m_graph.PreparseScripts(hashes);
 
 	//And evaluate them in that order.
+	//The inherited config keys don't know about toolchains, so force each script we run to re-run everything below
+	//it too, and skip anything we've already covered that way.
 	//Ignore dirty script hints because we're refreshing the entire graph
 	set<string> ignored;
+	set<string> dirs;
 	for(auto p : paths)
 	{
+		bool covered = false;
+		string dir = GetDirOfFile(p);
+		while(true)
+		{
+			if(dirs.find(dir) != dirs.end())
+			{
+				covered = true;
+				break;
+			}
+			if(dir == "")
+				break;
+			dir = GetDirOfFile(dir);
+		}
+		if(covered)
+			continue;
+
 		//LogDebug("Re-evaluating build script %s\n", p.c_str());
-		m_graph.UpdateScript(p, m_fileMap[p], true, true, ignored);
+		m_graph.UpdateScript(p, m_fileMap[p], true, true, ignored, true);
+		dirs.emplace(GetDirOfFile(p));
 	}
+
+	m_graph.ClearParsedScripts();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Persistence
+
+/**
+	@brief Saves the dependency scan results of our graph to disk
+
+	Neither the file map nor the graph is saved: the client sends us its full file state when it reconnects, and the
+	graph can be regenerated from the build scripts quickly once we know the results of the (slow) dependency scans.
+
+	@param fname	Path of the snapshot file
+
+	@return True on success
+ */
+bool WorkingCopy::SaveSnapshot(string fname)
+{
+	WorkingCopySnapshot snap;
+	snap.set_version(1);
+	{
+		lock_guard<recursive_mutex> lock(m_mutex);
+
+		//Nothing to save for build servers etc
+		if(m_fileMap.empty())
+			return true;
+
+		snap.set_hostname(m_hostname);
+		snap.set_uuid(m_id);
+	}
+	m_graph.SaveScanResults(snap);
+
+	string buf;
+	if(!snap.SerializeToString(&buf))
+	{
+		LogWarning("WorkingCopy: failed to serialize snapshot for %s\n", m_id.c_str());
+		return false;
+	}
+
+	//Write to a temporary file first so a crash in the middle doesn't leave us with a truncated snapshot
+	string tmp = fname + ".tmp";
+	if(!PutFileContents(tmp, buf))
+		return false;
+	if(0 != rename(tmp.c_str(), fname.c_str()))
+	{
+		LogWarning("WorkingCopy: failed to rename %s to %s\n", tmp.c_str(), fname.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+/**
+	@brief Loads a snapshot written by SaveSnapshot
+
+	Only the dependency scan results are restored. The file map is rebuilt by the client's initial sync, so files
+	deleted while we were down are never resurrected; saved scans are checked against the synced hashes when claimed.
+
+	@param fname	Path of the snapshot file
+
+	@return True if the snapshot was loaded
+ */
+bool WorkingCopy::LoadSnapshot(string fname)
+{
+	if(!DoesFileExist(fname))
+		return false;
+
+	WorkingCopySnapshot snap;
+	if(!snap.ParseFromString(GetFileContents(fname)))
+	{
+		LogWarning("WorkingCopy: snapshot %s is corrupted, ignoring it\n", fname.c_str());
+		return false;
+	}
+	if( (snap.version() != 1) || (snap.uuid() != m_id) )
+	{
+		LogWarning("WorkingCopy: snapshot %s is not for this working copy, ignoring it\n", fname.c_str());
+		return false;
+	}
+
+	m_graph.LoadScanResults(snap);
+
+	return true;
 }
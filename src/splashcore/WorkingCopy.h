@@ -50,6 +50,9 @@ public:
 
 	void RefreshToolchains();
 
+	bool SaveSnapshot(std::string fname);
+	bool LoadSnapshot(std::string fname);
+
 	std::string GetHostname()
 	{ return m_hostname; }
 
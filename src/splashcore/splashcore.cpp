@@ -30,7 +30,9 @@
 #include "splashcore.h"
 #include "../log/log.h"
 
+#include <sys/socket.h>
 #include <sys/wait.h>
+#include <signal.h>
 
 using namespace std;
 
@@ -99,6 +101,28 @@ bool SendMessage(Socket& s, const SplashMsg& msg, string hostname)
  */
 bool RecvMessage(Socket& s, SplashMsg& msg, string hostname)
 {
+	PayloadReservation payload;
+	return RecvMessage(s, msg, hostname, payload);
+}
+
+/**
+	@brief Receives a protobuf message, reserving memory for it in the global budget (if there is one) first.
+
+	The reservation is held by the caller until it's done with the message. If the budget is used up, we don't read
+	anything off the socket until there's room.
+ */
+bool RecvMessage(Socket& s, SplashMsg& msg, string hostname, PayloadReservation& payload)
+{
+	payload.Release();
+	if(g_memoryBudget != NULL)
+	{
+		//Peek at the length header so we know how much we're in for
+		uint32_t len;
+		if(recv(s, &len, sizeof(len), MSG_PEEK | MSG_WAITALL) != sizeof(len))
+			return false;
+		payload.Reserve(len);
+	}
+
 	string buf;
 	if(!s.RecvPascalString(buf))
 	{
@@ -113,6 +137,53 @@ bool RecvMessage(Socket& s, SplashMsg& msg, string hostname)
 	return true;
 }
 
+//Builds the server asked us to cancel while we were waiting on a reply (see RecvReply)
+static mutex g_canceledBuildsMutex;
+static set<string> g_canceledBuilds;
+
+/**
+	@brief Receives the reply to a request we sent to the server.
+
+	The server may ask us to cancel a build at any time, and keeps asking until we report back. If that happens
+	while we're waiting on a reply (fetching a build's inputs, etc), remember which build it was (see
+	TakeCanceledBuilds) and keep waiting for the reply.
+ */
+bool RecvReply(Socket& s, SplashMsg& msg, string hostname)
+{
+	PayloadReservation payload;
+	return RecvReply(s, msg, hostname, payload);
+}
+
+/**
+	@brief Receives the reply to a request we sent to the server, holding a reservation for it in the memory budget
+	(see RecvMessage)
+ */
+bool RecvReply(Socket& s, SplashMsg& msg, string hostname, PayloadReservation& payload)
+{
+	while(true)
+	{
+		if(!RecvMessage(s, msg, hostname, payload))
+			return false;
+		if(msg.Payload_case() != SplashMsg::kCancelBuild)
+			return true;
+
+		lock_guard<mutex> lock(g_canceledBuildsMutex);
+		g_canceledBuilds.emplace(msg.cancelbuild().fname());
+	}
+}
+
+/**
+	@brief Gets the builds the server canceled while we were waiting on replies, and forgets about them
+
+	@param fnames	Output file names of the canceled builds are added here
+ */
+void TakeCanceledBuilds(set<string>& fnames)
+{
+	lock_guard<mutex> lock(g_canceledBuildsMutex);
+	fnames.insert(g_canceledBuilds.begin(), g_canceledBuilds.end());
+	g_canceledBuilds.clear();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // System info etc
 
@@ -138,8 +209,49 @@ string ShellCommand(string cmd, bool trimNewline)
 	return retval;
 }
 
+//Process groups of commands currently running, so they can be killed (see CancelShellCommands)
+static mutex g_shellCommandMutex;
+static set<pid_t> g_shellCommandGroups;
+static bool g_shellCommandsCanceled = false;
+
+/**
+	@brief Kills all commands currently being run by ShellCommand(), and makes any new ones fail immediately,
+	until ResetShellCommands() is called.
+
+	Each command runs in its own process group, so anything it spawns (cc1, as, ld etc) is killed too.
+	Safe to call from any thread.
+ */
+void CancelShellCommands()
+{
+	lock_guard<mutex> lock(g_shellCommandMutex);
+	g_shellCommandsCanceled = true;
+	for(auto pgid : g_shellCommandGroups)
+		kill(-pgid, SIGKILL);
+}
+
+/**
+	@brief Allows commands to run again after CancelShellCommands()
+ */
+void ResetShellCommands()
+{
+	lock_guard<mutex> lock(g_shellCommandMutex);
+	g_shellCommandsCanceled = false;
+}
+
+/**
+	@brief Checks if CancelShellCommands() has been called since the last ResetShellCommands()
+ */
+bool ShellCommandsCanceled()
+{
+	lock_guard<mutex> lock(g_shellCommandMutex);
+	return g_shellCommandsCanceled;
+}
+
 /**
 	@brief Runs a shell command and returns the exit code, putting stdout/stderr (merged) in an argument
+
+	The command runs in its own process group so it can be killed by CancelShellCommands(), in which case we
+	return -1.
  */
 int ShellCommand(string cmd, string& stdout)
 {
@@ -152,7 +264,16 @@ int ShellCommand(string cmd, string& stdout)
 	int write_end = stdout_pipes[1];
 	int read_end = stdout_pipes[0];
 
-	//Fork off the background process
+	//Fork off the background process.
+	//Hold the lock until it's registered so a cancel can't slip in between.
+	unique_lock<mutex> lock(g_shellCommandMutex);
+	if(g_shellCommandsCanceled)
+	{
+		close(write_end);
+		close(read_end);
+		stdout += "Command canceled\n";
+		return -1;
+	}
 	pid_t pid = fork();
 	if(pid < 0)
 		LogFatal("Fork failed\n");
@@ -160,6 +281,9 @@ int ShellCommand(string cmd, string& stdout)
 	//We're the child process? Set up the pipes then exec the commands
 	if(pid == 0)
 	{
+		//Put ourself in a new process group so we can be killed along with all of our children
+		setpgid(0, 0);
+
 		//We're not using stdin, so close it
 		close(STDIN_FILENO);
 
@@ -184,6 +308,11 @@ int ShellCommand(string cmd, string& stdout)
 	//Parent process, crunch it
 	else
 	{
+		//Set the child's process group from our side too, so it's valid by the time anyone tries to kill it
+		setpgid(pid, pid);
+		g_shellCommandGroups.emplace(pid);
+		lock.unlock();
+
 		//Close the write end of the pipe at our end
 		close(write_end);
 
@@ -204,6 +333,14 @@ int ShellCommand(string cmd, string& stdout)
 		//Process has terminated, clean up
 		if(waitpid(pid, &code, 0) <= 0)
 			LogFatal("waitpid failed\n");
+
+		lock.lock();
+		g_shellCommandGroups.erase(pid);
+		if(g_shellCommandsCanceled)
+		{
+			stdout += "Command canceled\n";
+			return -1;
+		}
 	}
 
 	//Get the exit code
@@ -328,13 +465,19 @@ bool CanonicalizePathThatMightNotExist(string& fname)
 	//Canonicalize the path segments
 	//Can't use realpath() as the file doesn't actually exist in the local filesystem
 	vector<string> outsegs;
-	for(auto s : segments)
+	for(size_t i=0; i<segments.size(); i++)
 	{
+		auto s = segments[i];
+
+		//Skip "." and doubled slashes, but keep the empty first segment of an absolute path
+		if( (s == ".") || ( (s == "") && (i != 0) ) )
+			continue;
+
 		if(s == "..")
 		{
-			//Don't canonicalize off the beginning of the array
+			//Don't canonicalize off the beginning of the array (or above the root of an absolute path)
 			//We don't want another MS08-067 ;)
-			if(outsegs.empty())
+			if(outsegs.empty() || (outsegs.back() == "") )
 				return false;
 
 			else
@@ -345,6 +488,10 @@ bool CanonicalizePathThatMightNotExist(string& fname)
 			outsegs.push_back(s);
 	}
 
+	//Nothing left (e.g. "foo/..")
+	if(outsegs.empty())
+		return false;
+
 	//Combine the segments for the final output fname
 	fname = "";
 	for(auto s : outsegs)
@@ -729,7 +876,8 @@ bool GetRemoteFileByHash(Socket& sock, string hostname, string hash, string& con
 
 	//Wait for a response
 	SplashMsg dat;
-	if(!RecvMessage(sock, dat, hostname))
+	PayloadReservation payload;
+	if(!RecvReply(sock, dat, hostname, payload))
 		return false;
 	if(dat.Payload_case() != SplashMsg::kContentResponse)
 	{
@@ -773,7 +921,7 @@ bool GetRemoteHashesByPath(Socket& sock, string hostname, set<string> fnames, ma
 
 	//Wait for response
 	SplashMsg hresp;
-	if(!RecvMessage(sock, hresp, hostname))
+	if(!RecvReply(sock, hresp, hostname))
 		return false;
 	if(hresp.Payload_case() != SplashMsg::kBulkHashResponse)
 	{
@@ -849,7 +997,8 @@ bool RefreshRemoteFilesByHash(Socket& sock, string hostname, map<string, string>
 
 	//Wait for a response
 	SplashMsg dat;
-	if(!RecvMessage(sock, dat, hostname))
+	PayloadReservation payload;
+	if(!RecvReply(sock, dat, hostname, payload))
 		return false;
 	if(dat.Payload_case() != SplashMsg::kContentResponse)
 	{
@@ -888,6 +1037,13 @@ bool ProcessContentRequest(Socket& s, string remote, SplashMsg& msg)
 {
 	auto creq = msg.contentrequestbyhash();
 
+	//Make sure we have room for everything before pulling it into memory
+	uint64_t size = 0;
+	for(int i=0; i<creq.hash_size(); i++)
+		size += g_cache->GetFileSize(creq.hash(i));
+	PayloadReservation payload;
+	payload.Reserve(size);
+
 	//Create the response message
 	SplashMsg reply;
 	auto replym = reply.mutable_contentresponse();
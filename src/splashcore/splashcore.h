@@ -52,10 +52,16 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // libstdc++ includes
 
+#include <atomic>
+#include <condition_variable>
 #include <list>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
@@ -89,8 +95,14 @@
 bool SendMessage(Socket& s, const SplashMsg& msg);
 bool RecvMessage(Socket& s, SplashMsg& msg);
 
+class PayloadReservation;
+
 bool SendMessage(Socket& s, const SplashMsg& msg, std::string hostname);
 bool RecvMessage(Socket& s, SplashMsg& msg, std::string hostname);
+bool RecvMessage(Socket& s, SplashMsg& msg, std::string hostname, PayloadReservation& payload);
+bool RecvReply(Socket& s, SplashMsg& msg, std::string hostname);
+bool RecvReply(Socket& s, SplashMsg& msg, std::string hostname, PayloadReservation& payload);
+void TakeCanceledBuilds(std::set<std::string>& fnames);
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Performance profiling
@@ -101,6 +113,8 @@ double GetTime();
 // Project includes
 
 #include "Cache.h"
+#include "Symbol.h"
+#include "SymbolSet.h"
 
 #include "BuildFlag.h"
 #include "BuildConfiguration.h"
@@ -126,6 +140,7 @@ double GetTime();
 #include "YosysToolchain.h"
 
 #include "Job.h"
+#include "JobWaiter.h"
 
 #include "BoardInfoFile.h"
 
@@ -137,6 +152,7 @@ double GetTime();
 
 #include "SourceFileNode.h"
 #include "SystemLibraryNode.h"
+#include "NodePool.h"
 
 #include "ConstantTableNode.h"
 #include "CPPObjectNode.h"
@@ -149,7 +165,9 @@ double GetTime();
 
 #include "WorkingCopy.h"
 
+#include "MemoryBudget.h"
 #include "NodeManager.h"
+#include "JobHistory.h"
 #include "Scheduler.h"
 
 #include "ClientSettings.h"
@@ -162,6 +180,9 @@ std::string MakeStringLowercase(std::string str);
 
 std::string ShellCommand(std::string cmd, bool trimNewline = true);
 int ShellCommand(std::string cmd, std::string& stdout);
+void CancelShellCommands();
+void ResetShellCommands();
+bool ShellCommandsCanceled();
 
 std::string GetTargetTriplet ();
 
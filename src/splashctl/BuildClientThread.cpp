@@ -32,11 +32,18 @@
 
 using namespace std;
 
-bool ProcessScanJob(Socket& s, string& hostname, DependencyScanJob* job, bool& ok);
-bool ProcessBuildJob(Socket& s, string& hostname, Job* job, bool& ok);
+//Maximum number of file hashes we remember sending to a build slot (see BuildClientThread)
+#define MAX_CACHED_HASHES 16384
+
+bool ProcessScanJob(Socket& s, string& hostname, DependencyScanJob* job, bool& ok, unordered_set<string>& cached);
+bool ProcessBuildJob(Socket& s, string& hostname, Job* job, bool& ok, bool& discarded, unordered_set<string>& cached);
+bool ProcessBuildBatch(Socket& s, string& hostname, clientID slot, vector<Job*>& batch, unordered_set<string>& cached);
+bool FillBuildRequest(BuildJob* bj, NodeBuildRequest* reqm, unordered_set<string>& cached);
 bool ProcessDependencyResults(Socket& s, string& hostname, SplashMsg& msg, DependencyScanJob* job, bool& ok);
 bool ProcessBulkHashRequest(Socket& s, string& hostname, SplashMsg& msg, DependencyScanJob* job);
-bool ProcessBuildResults(Socket& s, string& hostname, SplashMsg& msg, Job* job, bool& ok);
+bool ProcessBuildResults(Socket& s, string& hostname, SplashMsg& msg, Job* job, bool& ok, bool& discarded);
+bool WaitForBuildResponse(Socket& s, string& hostname, const vector<Job*>& jobs);
+bool WaitUntilRunnable(Socket& s, Job* job);
 
 void BuildClientThread(Socket& s, string& hostname, clientID id)
 {
@@ -69,6 +76,14 @@ void BuildClientThread(Socket& s, string& hostname, clientID id)
 		binfom.ramsize(),
 		binfom.numchains()
 		);
+	LogVerbose("Build server %s runs %d jobs at once, RAM budget %d MB\n",
+		hostname.c_str(),
+		binfom.slots(),
+		binfom.rambudget()
+		);
+
+	//All slots on the node share one budget, so just take whatever the latest one says
+	g_nodeManager->SetMemoryBudget(id, binfom.rambudget());
 
 	//If no toolchains, just quit now
 	if(binfom.numchains() == 0)
@@ -121,11 +136,28 @@ void BuildClientThread(Socket& s, string& hostname, clientID id)
 		g_nodeManager->AddToolchain(id, toolchain, moreToolchains);
 	}
 
+	//Hashes of files we've sent to this client so far (so it has them in its cache).
+	//This is per connection since each slot on a build server has its own cache.
+	//We don't hear about what the client evicts, so this only tells us what it probably still has.
+	unordered_set<string> cached;
+
+	//Jobs are tracked per connection, so if this one goes away we know exactly what to reschedule
+	//(other slots of the same server may still be connected)
+	clientID slot = g_nodeManager->AllocateSlot(id);
+
 	//double lastJob = -1;
 	while(true)
 	{
+		//Note the work generation before looking at the queues, so we don't miss anything submitted in between
+		uint64_t generation = g_scheduler->GetWorkGeneration();
+
+		//Once we've sent the client a lot of files, the oldest ones are likely gone from its cache.
+		//Start over rather than steer jobs here on the strength of stale data (and grow without bound).
+		if(cached.size() > MAX_CACHED_HASHES)
+			cached.clear();
+
 		//See if we have any scan jobs to process
-		DependencyScanJob* djob = g_scheduler->PopScanJob(id);
+		DependencyScanJob* djob = g_scheduler->PopScanJob(slot);
 		if(djob != NULL)
 		{
 			/*
@@ -136,19 +168,26 @@ void BuildClientThread(Socket& s, string& hostname, clientID id)
 				g_scheduler->GetDT(), hostname.c_str(), dt);
 			*/
 
+			//If the job is not runnable, block until it is (or can't ever be).
+			//If the client disconnects in the meantime, the job gets rescheduled below.
+			if(!WaitUntilRunnable(s, djob))
+				break;
+
 			//If the job was canceled by dependencies, we cannot run it (ever)
 			if(djob->IsCanceledByDeps())
 			{
+				g_nodeManager->RemoveJob(slot, djob);
 				djob->SetCanceled();
 				djob->Unref();
 				continue;
 			}
 
-			//If the job is not runnable, block until it is
-			while(!djob->IsRunnable())
+			//If it was canceled since we popped it, don't bother
+			if(djob->IsFinished())
 			{
-				LogWarning("Job is not runnable yet!\n");
-				usleep(50 * 1000);
+				g_nodeManager->RemoveJob(slot, djob);
+				djob->Unref();
+				continue;
 			}
 
 			//Tell the dev client that the scan is in progress
@@ -156,75 +195,131 @@ void BuildClientThread(Socket& s, string& hostname, clientID id)
 
 			//Push the job out to the client and run it
 			bool ok = true;
-			if(ProcessScanJob(s, hostname, djob, ok))
+			if(ProcessScanJob(s, hostname, djob, ok, cached))
 			{
+				g_nodeManager->RemoveJob(slot, djob);
 				djob->SetDone(ok);
 				djob->Unref();
 				//LogDebug("[%7.3f] Job completed\n", g_scheduler->GetDT());
 				//lastJob = GetTime();
-				g_nodeManager->RemoveJob(id, djob);
 				continue;
 			}
 
 			//Job FAILED to run! The client probably disconnected.
-			//Abort, let Scheduler::RemoveNode reschedule it
-			return;
+			//Abort, the job gets rescheduled below
+			break;
 		}
 
 		//Look for actual compile jobs
-		Job* bj = g_scheduler->PopJob(id);
+		//(preferring ones whose inputs the client already has).
+		//If the server is short on memory, don't start anything new: the results would only add to the pile.
+		Job* bj = NULL;
+		if(g_memoryBudget->WaitForSpace(0.25))
+			bj = g_scheduler->PopJob(slot, &cached);
 		if(bj != NULL)
 		{
+			//If the job is not runnable, figure out what to do.
+			//For now, just block until it is (or can't ever be), unless the client disconnects.
+			if(!WaitUntilRunnable(s, bj))
+				break;
+
 			//If the job was canceled by dependencies, we cannot run it (ever)
 			if(bj->IsCanceledByDeps())
 			{
+				g_nodeManager->RemoveJob(slot, bj);
 				bj->SetCanceled();
 				bj->Unref();
-				g_nodeManager->RemoveJob(id, bj);
 				continue;
 			}
 
-			//If the job is not runnable, figure out what to do
-			//For now, just block
-			while(!bj->IsRunnable())
+			//If it was canceled since we popped it, don't bother
+			if(bj->IsFinished())
 			{
-				LogWarning("Job is not runnable yet!\n");
-
-				pollfd pfd;
-				pfd.fd = s;
-				pfd.events = POLLRDHUP;
-				if(0 != poll(&pfd, 1, 2))
-					return;
+				g_nodeManager->RemoveJob(slot, bj);
+				bj->Unref();
+				continue;
 			}
 
 			//We've kicked off the job, let others know
 			bj->SetRunning();
 
+			//If it's a small job, send a few more along with it to save on round trips
+			vector<Job*> batch(1, bj);
+			g_scheduler->PopBatch(slot, batch);
+			if(batch.size() > 1)
+			{
+				if(ProcessBuildBatch(s, hostname, slot, batch, cached))
+					continue;
+				break;
+			}
+
 			//Push the job out to the client and run it
 			bool ok = true;
-			if(ProcessBuildJob(s, hostname, bj, ok))
+			bool discarded = false;
+			if(ProcessBuildJob(s, hostname, bj, ok, discarded, cached))
 			{
-				bj->SetDone(ok);
+				//Release the job's RAM before marking it done, so slots woken up by the completion can use it.
+				//If another copy of the job won, it's up to that copy's thread to finish the job.
+				g_nodeManager->RemoveJob(slot, bj);
+				if(!discarded)
+					bj->SetDone(ok);
 				bj->Unref();
-				g_nodeManager->RemoveJob(id, bj);
 				continue;
 			}
 
 			//Job FAILED to run! The client probably disconnected.
-			//Abort, let Scheduler::RemoveNode reschedule it
-			return;
+			//Abort, the job gets rescheduled below
+			break;
 		}
 
-		//Check if our client disconnected. Wait up to 50 ms for disconnection to avoid busy-polling
+		//Nothing to do. Sleep until new work is submitted (or a job finishes and unblocks others),
+		//waking up every so often to check if our client disconnected.
+		g_scheduler->WaitForWork(generation, 0.25);
 		pollfd pfd;
 		pfd.fd = s;
 		pfd.events = POLLRDHUP;
-		if(0 != poll(&pfd, 1, 50))
-			return;
+		if(0 != poll(&pfd, 1, 0))
+			break;
 
 		if(g_quitting)
 			break;
 	}
+
+	//Put back anything we were in the middle of, and release its RAM
+	g_scheduler->RemoveSlot(slot);
+	g_nodeManager->FreeSlot(slot);
+}
+
+/**
+	@brief Blocks until a job we were handed is runnable, it's canceled, or a dependency fails.
+
+	We're woken up as soon as the dependencies finish, but a build job may also be waiting on its output node to be
+	finalized, so keep checking every so often. The caller has to check why we returned.
+
+	@return False if the client disconnected while we were waiting
+ */
+bool WaitUntilRunnable(Socket& s, Job* job)
+{
+	if(job->IsRunnable())
+		return true;
+
+	LogWarning("Job is not runnable yet!\n");
+	while(!job->IsRunnable() && !job->IsCanceledByDeps() && !job->IsFinished())
+	{
+		//If the dependencies are done, we're waiting on something we don't get notified about. Don't spin.
+		bool depsDone = job->WaitForDependencies(0.25);
+
+		pollfd pfd;
+		pfd.fd = s;
+		pfd.events = POLLRDHUP;
+		if(0 != poll(&pfd, 1, depsDone ? 50 : 0))
+			return false;
+
+		if(g_quitting)
+			return false;
+	}
+
+	return true;
 }
 
 /**
@@ -232,7 +327,7 @@ void BuildClientThread(Socket& s, string& hostname, clientID id)
 
 	@return True if we can continue. False only on unrecoverable error.
  */
-bool ProcessScanJob(Socket& s, string& hostname, DependencyScanJob* job, bool& ok)
+bool ProcessScanJob(Socket& s, string& hostname, DependencyScanJob* job, bool& ok, unordered_set<string>& cached)
 {
 	//LogDebug("[%7.3f] ProcessScanJob on %s\n", g_scheduler->GetDT(), hostname.c_str());
 
@@ -250,6 +345,7 @@ bool ProcessScanJob(Socket& s, string& hostname, DependencyScanJob* job, bool& o
 	reqm->set_fname(path);
 	reqm->set_hash(hash);
 	reqm->set_arch(job->GetArch());
+	cached.emplace(hash);
 	for(auto f : flags)
 		reqm->add_flags(f);
 	if(!SendMessage(s, req, hostname))
@@ -416,8 +512,11 @@ bool ProcessBulkHashRequest(Socket& s, string& hostname, SplashMsg& msg, Depende
 
 /**
 	@brief Runs a build job
+
+	@param ok			Indicates success/failure of the build
+	@param discarded	Set to true if the results were thrown away (see ProcessBuildResults)
  */
-bool ProcessBuildJob(Socket& s, string& hostname, Job* job, bool& ok)
+bool ProcessBuildJob(Socket& s, string& hostname, Job* job, bool& ok, bool& discarded, unordered_set<string>& cached)
 {
 	//Make sure it's a build job (if not, it was somehow put in the wrong queue)
 	BuildJob* bj = dynamic_cast<BuildJob*>(job);
@@ -427,20 +526,72 @@ bool ProcessBuildJob(Socket& s, string& hostname, Job* job, bool& ok)
 		return false;
 	}
 
+	LogDebug("[%6.3f] Run build job %p (%s)\n", g_scheduler->GetDT(), job, bj->GetOutputPath().c_str());
+	//LogIndenter li;
+
+	//Build the request
+	SplashMsg req;
+	if(!FillBuildRequest(bj, req.mutable_nodebuildrequest(), cached))
+		return false;
+
+	//Send the request to the client
+	if(!SendMessage(s, req, hostname))
+		return false;
+
+	//Let the client do its thing
+	while(true)
+	{
+		//Get a response. It's either "done" or "get more files"
+		SplashMsg rxm;
+		PayloadReservation payload;
+		if(!WaitForBuildResponse(s, hostname, vector<Job*>(1, job)))
+			return false;
+		if(!RecvMessage(s, rxm, hostname, payload))
+			return false;
+
+		auto type = rxm.Payload_case();
+
+		switch(type)
+		{
+			//Asking for more data
+			case SplashMsg::kContentRequestByHash:
+				if(!ProcessContentRequest(s, hostname, rxm))
+					return false;
+				break;
+
+			//Done, we have the compiled files
+			case SplashMsg::kNodeBuildResults:
+				return ProcessBuildResults(s, hostname, rxm, job, ok, discarded);
+
+			//Whatever it is, it makes no sense
+			default:
+				LogError("Unknown / garbage message type\n");
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+	@brief Fills out a NodeBuildRequest for a build job
+
+	@param bj		The job to build
+	@param reqm		The request to fill out
+	@param cached	Hashes of files the client has cached (the job's inputs are added)
+
+	@return False if the job can't be built
+ */
+bool FillBuildRequest(BuildJob* bj, NodeBuildRequest* reqm, unordered_set<string>& cached)
+{
 	BuildGraphNode* node = bj->GetOutputNode();
 	auto wc = node->GetGraph()->GetWorkingCopy();
 	auto path = node->GetFilePath();
 
-	LogDebug("[%6.3f] Run build job %p (%s)\n", g_scheduler->GetDT(), job, path.c_str());
-	//LogIndenter li;
-
 	//Look up the flags
 	set<BuildFlag> flags;
 	node->GetFlagsForUseAt(bj->GetFlagUsage(), flags);
 
-	//Build the request
-	SplashMsg req;
-	auto reqm = req.mutable_nodebuildrequest();
 	reqm->set_arch(node->GetArch());
 	reqm->set_toolchain(node->GetToolchainHash());
 	for(auto src : node->GetSources())
@@ -455,6 +606,7 @@ bool ProcessBuildJob(Socket& s, string& hostname, Job* job, bool& ok)
 		auto dep = reqm->add_sources();
 		dep->set_fname(src);
 		dep->set_hash(hash);
+		cached.emplace(hash);
 	}
 	for(auto src : node->GetDependencies())
 	{
@@ -468,6 +620,7 @@ bool ProcessBuildJob(Socket& s, string& hostname, Job* job, bool& ok)
 		auto dep = reqm->add_deps();
 		dep->set_fname(src);
 		dep->set_hash(hash);
+		cached.emplace(hash);
 	}
 	for(auto f : flags)
 		reqm->add_flags(f);
@@ -480,16 +633,54 @@ bool ProcessBuildJob(Socket& s, string& hostname, Job* job, bool& ok)
 		return false;
 	}
 
+	return true;
+}
+
+/**
+	@brief Runs a batch of (small) build jobs in one round trip.
+
+	The first job has already been started. The client runs the jobs in order and sends back results for each one
+	as it finishes, so we mark each job done as soon as we hear about it and start the clock on the next one.
+
+	@return True if we can continue. False only on unrecoverable error (the remaining jobs are then rescheduled
+	by Scheduler::RemoveSlot).
+ */
+bool ProcessBuildBatch(Socket& s, string& hostname, clientID slot, vector<Job*>& batch, unordered_set<string>& cached)
+{
+	LogDebug("[%6.3f] Run batch of %zu build jobs\n", g_scheduler->GetDT(), batch.size());
+
+	//Build the request
+	SplashMsg req;
+	auto reqm = req.mutable_nodebuildbatch();
+	map<string, size_t> indexes;
+	for(size_t i=0; i<batch.size(); i++)
+	{
+		BuildJob* bj = dynamic_cast<BuildJob*>(batch[i]);
+		if(!bj)
+		{
+			LogError("ProcessBuildBatch called with a non-build job\n");
+			return false;
+		}
+		if(!FillBuildRequest(bj, reqm->add_requests(), cached))
+			return false;
+		indexes[bj->GetOutputPath()] = i;
+	}
+
 	//Send the request to the client
 	if(!SendMessage(s, req, hostname))
 		return false;
 
 	//Let the client do its thing
-	while(true)
+	size_t next = 0;
+	while(next < batch.size())
 	{
-		//Get a response. It's either "done" or "get more files"
+		//Get a response. It's either "one job done" or "get more files"
 		SplashMsg rxm;
-		if(!RecvMessage(s, rxm, hostname))
+		PayloadReservation payload;
+		vector<Job*> pending(batch.begin() + next, batch.end());
+		if(!WaitForBuildResponse(s, hostname, pending))
+			return false;
+		if(!RecvMessage(s, rxm, hostname, payload))
 			return false;
 
 		auto type = rxm.Payload_case();
@@ -502,9 +693,35 @@ bool ProcessBuildJob(Socket& s, string& hostname, Job* job, bool& ok)
 					return false;
 				break;
 
-			//Done, we have the compiled files
+			//Done with one of the jobs
 			case SplashMsg::kNodeBuildResults:
-				return ProcessBuildResults(s, hostname, rxm, job, ok);
+				{
+					auto it = indexes.find(rxm.nodebuildresults().fname());
+					if( (it == indexes.end()) || (it->second != next) )
+					{
+						LogError("Got build results for an unexpected node\n");
+						return false;
+					}
+
+					Job* job = batch[next];
+					bool ok = true;
+					bool discarded = false;
+					if(!ProcessBuildResults(s, hostname, rxm, job, ok, discarded))
+						return false;
+
+					//Release the job's RAM before marking it done, so slots woken up by the completion can use it.
+					//If another copy of the job won, it's up to that copy's thread to finish the job.
+					g_nodeManager->RemoveJob(slot, job);
+					if(!discarded)
+						job->SetDone(ok);
+					job->Unref();
+
+					//The client starts on the next job right away
+					next ++;
+					if(next < batch.size())
+						batch[next]->SetRunning();
+				}
+				break;
 
 			//Whatever it is, it makes no sense
 			default:
@@ -516,15 +733,74 @@ bool ProcessBuildJob(Socket& s, string& hostname, Job* job, bool& ok)
 	return true;
 }
 
+/**
+	@brief Waits for a client running one or more build jobs to send us something.
+
+	If any of the jobs are canceled, or another copy of one finishes first, while we're waiting, tell the client to
+	stop (or skip it, if it hasn't been started yet). It may be busy fetching files and not see the first request,
+	so keep asking until it answers.
+
+	@return False if the client disconnected
+ */
+bool WaitForBuildResponse(Socket& s, string& hostname, const vector<Job*>& jobs)
+{
+	double last_cancel = 0;
+	while(true)
+	{
+		pollfd pfd;
+		pfd.fd = s;
+		pfd.events = POLLIN;
+		int ret = poll(&pfd, 1, 250);
+		if(ret > 0)
+			return true;
+		if( (ret < 0) && (errno != EINTR) )
+			return false;
+
+		if(GetTime() - last_cancel < 1)
+			continue;
+		for(auto job : jobs)
+		{
+			if(!job->IsFinished())
+				continue;
+
+			SplashMsg cancel;
+			auto cancelm = cancel.mutable_cancelbuild();
+			cancelm->set_fname(dynamic_cast<BuildJob*>(job)->GetOutputPath());
+			if(!SendMessage(s, cancel, hostname))
+				return false;
+			last_cancel = GetTime();
+		}
+	}
+}
+
 /**
 	@brief Deal with an incoming BuildResults message
+
+	@param ok			Indicates success/failure of the build
+	@param discarded	Set to true if the results were thrown away because another copy of the job got there first, or
+						the job was canceled. The caller must then leave the job alone: only whoever claimed the results
+						gets to mark it as done, once they're all stored.
+
+	@return True if we can continue. False only on unrecoverable error.
  */
-bool ProcessBuildResults(Socket& /*s*/, string& /*hostname*/, SplashMsg& msg, Job* job, bool& ok)
+bool ProcessBuildResults(Socket& /*s*/, string& hostname, SplashMsg& msg, Job* job, bool& ok, bool& discarded)
 {
 	auto res = msg.nodebuildresults();
-	ok = res.success();
+	discarded = false;
 	//LogIndenter li;
 
+	//If this job was a straggler and another copy already reported back, throw our results away.
+	//Outputs are content addressed so they'd be the same anyway, but we don't want to update things twice.
+	//Same if the job was canceled: the build was probably killed partway and we don't want to cache the failure.
+	if(!job->ClaimResult(hostname))
+	{
+		LogDebug("Discarding results from %s (for %s), job was canceled or already done\n",
+			hostname.c_str(), res.fname().c_str());
+		discarded = true;
+		return true;
+	}
+	ok = res.success();
+
 	//Look up the build job
 	BuildJob* bj = dynamic_cast<BuildJob*>(job);
 	if(bj == NULL)
@@ -63,13 +63,17 @@ void DevClientThread(Socket& s, string& hostname, clientID id)
 	while(true)
 	{
 		//Expect fileChanged or fileRemoved messages
+		//(counting them against the memory budget until we're done with them)
 		SplashMsg msg;
-		if(!RecvMessage(s, msg, hostname))
+		PayloadReservation payload;
+		if(!RecvMessage(s, msg, hostname, payload))
 			break;
 
 		switch(msg.Payload_case())
 		{
+			//This may need to wait for more data, don't count against ourselves while we do
 			case SplashMsg::kBulkFileChanged:
+				payload.Release();
 				if(!OnBulkFileChanged(s, msg.bulkfilechanged(), hostname, id))
 					return;
 				break;
@@ -189,7 +193,8 @@ bool OnBulkFileChanged(Socket& s, const BulkFileChanged& msg, string& hostname,
 	if(missingFiles)
 	{
 		SplashMsg msg;
-		if(!RecvMessage(s, msg, hostname))
+		PayloadReservation payload;
+		if(!RecvMessage(s, msg, hostname, payload))
 			return false;
 		if(msg.Payload_case() != SplashMsg::kBulkFileData)
 		{
@@ -217,14 +222,35 @@ bool OnBulkFileChanged(Socket& s, const BulkFileChanged& msg, string& hostname,
 			g_nodeManager->GetWorkingCopy(id)->UpdateFile(mfc.fname(), mfc.hash(), mfc.body(), mfc.config(), dirtyScripts);
 	}
 
-	//Process build scripts once the files they depend on are done
+	//Process build scripts once the files they depend on are done.
+	//Shallowest first, so each script sees the final recursive configuration of its parents when it's executed
+	//rather than getting re-run when a parent shows up later in the list.
+	vector<int> scripts;
+	set<string> scriptHashes;
 	for(int i=0; i<msg.files_size(); i++)
 	{
 		auto mfc = msg.files(i);
-		string fname = mfc.fname();
-		if(GetBasenameOfFile(fname) == "build.yml")
-			g_nodeManager->GetWorkingCopy(id)->UpdateFile(mfc.fname(), mfc.hash(), mfc.body(), mfc.config(), dirtyScripts);
+		if(GetBasenameOfFile(mfc.fname()) != "build.yml")
+			continue;
+		scripts.push_back(i);
+		scriptHashes.emplace(mfc.hash());
+	}
+	stable_sort(scripts.begin(), scripts.end(), [&](int a, int b)
+		{
+			auto& fa = msg.files(a).fname();
+			auto& fb = msg.files(b).fname();
+			return count(fa.begin(), fa.end(), '/') < count(fb.begin(), fb.end(), '/');
+		});
+
+	//Run the YAML parser on all of them in parallel, then execute them one by one
+	auto& graph = g_nodeManager->GetWorkingCopy(id)->GetGraph();
+	graph.PreparseScripts(scriptHashes);
+	for(auto i : scripts)
+	{
+		auto mfc = msg.files(i);
+		g_nodeManager->GetWorkingCopy(id)->UpdateFile(mfc.fname(), mfc.hash(), mfc.body(), mfc.config(), dirtyScripts);
 	}
+	graph.ClearParsedScripts();
 
 	//If this change caused a script to become dirty, re-run that script.
 	//TODO: Recursively update scripts (but don't update ones we've updated during this round)
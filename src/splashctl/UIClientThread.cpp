@@ -28,6 +28,7 @@
 ***********************************************************************************************************************/
 
 #include "splashctl.h"
+#include <poll.h>
 
 using namespace std;
 
@@ -35,11 +36,13 @@ bool OnInfoRequest(Socket& s, const InfoRequest& msg, string& hostname, clientID
 
 bool OnBuildRequest(Socket& s, const BuildRequest& msg, string& hostname, clientID id);
 
+bool OnAffectedTargetsRequest(Socket& s, const InfoRequest& msg, string& hostname, clientID id);
 bool OnArchListRequest(Socket& s, string query, string& hostname, clientID id);
 bool OnBuildPathListRequest(Socket& s, string& hostname, clientID id);
 bool OnClientListRequest(Socket& s, string& hostname, clientID id);
 bool OnConfigListRequest(Socket& s, string& hostname, clientID id);
 bool OnNodeListRequest(Socket& s, string& hostname, clientID id);
+bool OnServerStatusRequest(Socket& s, string& hostname, clientID id);
 bool OnTargetListRequest(Socket& s, string& hostname, clientID id);
 bool OnToolchainListRequest(Socket& s, string& hostname, clientID id);
 
@@ -126,8 +129,10 @@ bool OnBuildRequest(Socket& s, const BuildRequest& msg, string& hostname, client
 	//Dispatch the build
 	{
 		//Look up our graph
+		//Wait for any rebuild in progress so every node we're about to build has been finalized
 		auto wc = g_nodeManager->GetWorkingCopy(id);
 		BuildGraph& graph = wc->GetGraph();
+		lock_guard<mutex> rlock(graph.GetRebuildMutex());
 		lock_guard<recursive_mutex> lock(graph.GetMutex());
 
 		//If we have no toolchains, fail the build instantly
@@ -210,6 +215,7 @@ bool OnBuildRequest(Socket& s, const BuildRequest& msg, string& hostname, client
 			}
 
 			jobs.emplace(j);
+			g_scheduler->AddBuildRequest(j);
 		}
 	}
 
@@ -219,8 +225,18 @@ bool OnBuildRequest(Socket& s, const BuildRequest& msg, string& hostname, client
 	unsigned int tasks_finished = 0;
 	unsigned int tasks_failed = 0;
 	double last_update_sent = GetTime();
+	bool canceled = false;
+	JobWaiter waiter;
+	for(auto j : jobs)
+		j->AddWaiter(&waiter);
+	uint64_t completions = 0;
 	while(!jobs.empty())
 	{
+		//Block until any of the outstanding jobs finishes, or it's time to send another progress update.
+		//Read the count before looking at the jobs, so anything finishing while we do is seen next time around.
+		waiter.Wait(completions, last_update_sent + 1 - GetTime());
+		completions = waiter.GetCompletionCount();
+
 		//See what's finished this pass
 		set<Job*> done;
 		for(auto j : jobs)
@@ -234,7 +250,13 @@ bool OnBuildRequest(Socket& s, const BuildRequest& msg, string& hostname, client
 			}
 			else if(status == BuildJob::STATUS_DONE)
 			{
-				tasks_finished ++;
+				if(j->IsSuccessful())
+					tasks_finished ++;
+				else
+				{
+					tasks_failed ++;
+					failed = true;
+				}
 				done.emplace(j);
 			}
 		}
@@ -243,16 +265,40 @@ bool OnBuildRequest(Socket& s, const BuildRequest& msg, string& hostname, client
 		for(auto j : done)
 		{
 			jobs.erase(j);
+			j->RemoveWaiter(&waiter);
+			if(!canceled)
+				g_scheduler->RemoveBuildRequest(j);
 			j->Unref();
 		}
 
-		//Wait a little while (TODO: wait until one of the jobs has finished with an event or something?)
-		usleep(50 * 1000);
+		//If the client went away, nobody cares about the results anymore. Stop wasting time on them.
+		pollfd pfd;
+		pfd.fd = s;
+		pfd.events = POLLRDHUP;
+		if( !canceled && (0 != poll(&pfd, 1, 0)) )
+		{
+			LogVerbose("UI client %s disconnected during build, canceling it\n", hostname.c_str());
+			g_scheduler->CancelJobs(jobs);
+			for(auto j : jobs)
+			{
+				j->RemoveWaiter(&waiter);
+				j->Unref();
+			}
+			return false;
+		}
+
+		//Fail-fast build and something broke? Give up on the rest
+		if(failed && msg.failfast() && !canceled && !jobs.empty())
+		{
+			LogDebug("UI client: Build failed, canceling remaining jobs\n");
+			g_scheduler->CancelJobs(jobs);
+			canceled = true;
+		}
 
 		//Send an update to the client every second, or at the end
 		//(so we get a nice full progress bar after completion)
 		double dt = GetTime() - last_update_sent;
-		if( (dt > 1) || jobs.empty() )
+		if( (dt >= 1) || jobs.empty() )
 		{
 			unsigned int tasks_pending = tasks_started - (tasks_finished + tasks_failed);
 
@@ -261,9 +307,19 @@ bool OnBuildRequest(Socket& s, const BuildRequest& msg, string& hostname, client
 			updatem->set_tasks_pending(tasks_pending);
 			updatem->set_tasks_completed(tasks_finished);
 			updatem->set_tasks_failed(tasks_failed);
+			updatem->set_time_remaining(g_scheduler->GetEstimatedTimeRemaining(jobs));
 
 			if(!SendMessage(s, update, hostname))
+			{
+				if(!canceled)
+					g_scheduler->CancelJobs(jobs);
+				for(auto j : jobs)
+				{
+					j->RemoveWaiter(&waiter);
+					j->Unref();
+				}
 				return false;
+			}
 
 			last_update_sent = GetTime();
 		}
@@ -387,6 +443,14 @@ bool OnInfoRequest(Socket& s, const InfoRequest& msg, string& hostname, clientID
 		case InfoRequest::BPATH_LIST:
 			return OnBuildPathListRequest(s, hostname, id);
 
+		//status request
+		case InfoRequest::SERVER_STATUS:
+			return OnServerStatusRequest(s, hostname, id);
+
+		//affected request
+		case InfoRequest::AFFECTED_TARGETS:
+			return OnAffectedTargetsRequest(s, msg, hostname, id);
+
 		//Something garbage
 		default:
 			LogWarning("Connection to %s [%s] dropped (bad InfoRequest type)\n",
@@ -447,6 +511,27 @@ bool OnBuildPathListRequest(Socket& s, string& hostname, clientID id)
 	return true;
 }
 
+/**
+	@brief Processes a "splash status" request
+ */
+bool OnServerStatusRequest(Socket& s, string& hostname, clientID /*id*/)
+{
+	SplashMsg result;
+	auto resultm = result.mutable_serverstatus();
+	resultm->set_payloadbytes(g_memoryBudget->GetUsage());
+	resultm->set_payloadpeak(g_memoryBudget->GetPeakUsage());
+	resultm->set_payloadlimit(g_memoryBudget->GetLimit());
+	resultm->set_payloadstalls(g_memoryBudget->GetStallCount());
+	resultm->set_sharednodes(g_nodePool->GetNodeCount());
+	resultm->set_sharednoderefs(g_nodePool->GetReferenceCount());
+	resultm->set_symbols(Symbol::GetTableSize());
+	resultm->set_symbolsets(SymbolSet::GetTableSize());
+	if(!SendMessage(s, result, hostname))
+		return false;
+
+	return true;
+}
+
 /**
 	@brief Processes a "splash list-clients" request
  */
@@ -540,12 +625,15 @@ bool OnNodeListRequest(Socket& s, string& hostname, clientID id)
 	SplashMsg result;
 	auto resultm = result.mutable_nodelist();
 
+	//Wait for any rebuild in progress so we don't report nodes that haven't been finalized.
+	//This has to come before locking the node manager since finalizing nodes needs it.
+	auto wc = g_nodeManager->GetWorkingCopy(id);
+	BuildGraph& graph = wc->GetGraph();
+	lock_guard<mutex> rlock(graph.GetRebuildMutex());
+
 	//Need to lock node manager during interaction in case other stuff comes/goes
 	g_nodeManager->lock();
 
-		auto wc = g_nodeManager->GetWorkingCopy(id);
-		BuildGraph& graph = wc->GetGraph();
-
 		set<string> hashes;
 		graph.GetNodes(hashes);
 
@@ -586,6 +674,7 @@ bool OnTargetListRequest(Socket& s, string& hostname, clientID id)
 	//No need to lock the node manager etc b/c once we connect the state is refcounted and can't be deletd
 	auto wc = g_nodeManager->GetWorkingCopy(id);
 	BuildGraph& graph = wc->GetGraph();
+	lock_guard<mutex> rlock(graph.GetRebuildMutex());
 	set<string> targets;
 	graph.GetTargets(targets);
 
@@ -605,6 +694,37 @@ bool OnTargetListRequest(Socket& s, string& hostname, clientID id)
 	return true;
 }
 
+/**
+	@brief Processes a "splash affected" request
+ */
+bool OnAffectedTargetsRequest(Socket& s, const InfoRequest& msg, string& hostname, clientID id)
+{
+	//No need to lock the node manager etc b/c once we connect the state is refcounted and can't be deletd
+	auto wc = g_nodeManager->GetWorkingCopy(id);
+	BuildGraph& graph = wc->GetGraph();
+	lock_guard<mutex> rlock(graph.GetRebuildMutex());
+	set<string> files;
+	for(int i=0; i<msg.files_size(); i++)
+		files.emplace(msg.files(i));
+	set<BuildGraphNode*> targets;
+	graph.GetAffectedTargets(files, targets);
+
+	//Go send the list to the client
+	SplashMsg result;
+	auto resultm = result.mutable_affectedtargetlist();
+	for(auto t : targets)
+	{
+		auto info = resultm->add_targets();
+		info->set_name(t->GetName());
+		info->set_arch(t->GetArch());
+		info->set_config(t->GetConfig());
+	}
+	if(!SendMessage(s, result, hostname))
+		return false;
+
+	return true;
+}
+
 /**
 	@brief Processes a "splash list-toolchains" request
  */
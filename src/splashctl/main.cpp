@@ -35,6 +35,7 @@ void sig_handler(int sig);
 
 void ShowUsage();
 void ShowVersion();
+void SnapshotThread(int interval);
 
 bool g_quitting = false;
 Socket* g_server;
@@ -49,6 +50,12 @@ int main(int argc, char* argv[])
 {
 	int port = 49000;
 
+	//Limit on file content held in memory at once (see MemoryBudget)
+	uint64_t payloadBudget = 1024;
+
+	//Seconds between periodic saves of working copy state (0 to only save at shutdown and client disconnect)
+	int snapshotInterval = 300;
+
 	Severity console_verbosity = Severity::NOTICE;
 
 	//Parse command-line arguments
@@ -72,6 +79,26 @@ int main(int argc, char* argv[])
 			return 0;
 		}
 
+		else if( (s == "--payload-budget") && (i+1 < argc) )
+		{
+			payloadBudget = strtoull(argv[++i], NULL, 10);
+			if(payloadBudget == 0)
+			{
+				fprintf(stderr, "ERROR: --payload-budget must be a positive number of MB\n");
+				return 1;
+			}
+		}
+
+		else if( (s == "--snapshot-interval") && (i+1 < argc) )
+		{
+			snapshotInterval = atoi(argv[++i]);
+			if(snapshotInterval < 0)
+			{
+				fprintf(stderr, "ERROR: --snapshot-interval must not be negative\n");
+				return 1;
+			}
+		}
+
 		//Last arg without a switch is the port number
 		//TODO: mandatory arguments to introduce this?
 		else
@@ -109,9 +136,20 @@ int main(int argc, char* argv[])
 
 	//Initialize global data structures
 	g_cache = new Cache("splashctl");
+	g_memoryBudget = new MemoryBudget(payloadBudget * 1024 * 1024);
+	g_nodePool = new NodePool;
 	g_nodeManager = new NodeManager;
 	g_scheduler = new Scheduler;
 
+	//Working copy snapshots, so a restart doesn't lose all of our dependency scan results
+	string snapshotPath = string(getenv("HOME")) + "/.splash/snapshots-splashctl";
+	if(!DoesDirectoryExist(snapshotPath))
+		MakeDirectoryRecursive(snapshotPath, 0700);
+	g_nodeManager->SetSnapshotPath(snapshotPath);
+	thread snapshotThread;
+	if(snapshotInterval > 0)
+		snapshotThread = thread(SnapshotThread, snapshotInterval);
+
 	//Socket server
 	LogDebug("Listening on TCP port %d...\n", port);
 	Socket server(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
@@ -131,13 +169,41 @@ int main(int argc, char* argv[])
 		t.detach();
 	}
 
+	//Save state for next time
+	if(snapshotThread.joinable())
+		snapshotThread.join();
+	g_nodeManager->SaveSnapshots();
+
 	//Cleanup
 	delete g_nodeManager;
 	delete g_scheduler;
+	delete g_nodePool;
 	delete g_cache;
+	delete g_memoryBudget;
 	return 0;
 }
 
+/**
+	@brief Thread for saving working copy state periodically, in case we crash
+ */
+void SnapshotThread(int interval)
+{
+	#ifdef _GNU_SOURCE
+	pthread_setname_np(pthread_self(), "SNAPSHOT");
+	#endif
+
+	double last = GetTime();
+	while(!g_quitting)
+	{
+		usleep(1000 * 1000);
+		if(GetTime() - last < interval)
+			continue;
+
+		g_nodeManager->SaveSnapshots();
+		last = GetTime();
+	}
+}
+
 void ShowVersion()
 {
 	printf(
@@ -150,7 +216,14 @@ void ShowVersion()
 
 void ShowUsage()
 {
-	printf("Usage: splashctl [control_port]\n");
+	printf(
+		"Usage: splashctl [options] [control_port]\n"
+		"\n"
+		"options may be zero or more of the following:\n"
+		"    --payload-budget <MB>          Maximum amount of file content to hold in memory at once\n"
+		"                                   (uploads, build results, etc). Defaults to 1024.\n"
+		"    --snapshot-interval <sec>      How often to save working copy state to disk, in addition to\n"
+		"                                   shutdown and client disconnect. 0 to disable. Defaults to 300.\n");
 	exit(0);
 }
 
@@ -44,6 +44,7 @@ map<int, string> g_watchMap;
 
 int ProcessInitCommand(const vector<string>& args);
 
+int ProcessAffectedCommand(Socket& s, const vector<string>& args);
 int ProcessBuildCommand(Socket& s, const vector<string>& args);
 int ProcessCleanCommand(Socket& s, const vector<string>& args);
 
@@ -53,6 +54,7 @@ int ProcessListConfigsCommand(Socket& s, const vector<string>& args);
 int ProcessListTargetsCommand(Socket& s, const vector<string>& args, bool pretty);
 int ProcessListToolchainsCommand(Socket& s, const vector<string>& args);
 int ProcessDumpGraphCommand(Socket& s, const vector<string>& args, bool suppressSystemIncludes = true);
+int ProcessStatusCommand(Socket& s, const vector<string>& args);
 
 string GetShortHash(string hash);
 
@@ -133,7 +135,9 @@ int main(int argc, char* argv[])
 		return 1;
 
 	//Process other commands once the link is up and running
-	if(cmd == "build")
+	if(cmd == "affected")
+		return ProcessAffectedCommand(sock, args);
+	else if(cmd == "build")
 		return ProcessBuildCommand(sock, args);
 	else if(cmd == "clean")
 		return ProcessCleanCommand(sock, args);
@@ -151,6 +155,8 @@ int main(int argc, char* argv[])
 		return ProcessListTargetsCommand(sock, args, false);
 	else if(cmd == "list-toolchains")
 		return ProcessListToolchainsCommand(sock, args);
+	else if(cmd == "status")
+		return ProcessStatusCommand(sock, args);
 	else
 		LogError("Unknown command \"%s\"\n", cmd.c_str());
 
@@ -169,12 +175,16 @@ int ProcessBuildCommand(Socket& s, const vector<string>& args)
 	vector<string> targets;
 	string config;
 	string arch;
+	bool failfast = false;
 
 	for(size_t i=0; i<args.size(); i++)
 	{
 		if( (args[i] == "--config") && (i+1 < args.size()) )
 			config = args[++i];
 
+		else if(args[i] == "--fail-fast")
+			failfast = true;
+
 		else if( (args[i] == "--arch") && (i+1 < args.size()) )
 			arch = args[++i];
 
@@ -193,10 +203,11 @@ int ProcessBuildCommand(Socket& s, const vector<string>& args)
 	cmdm->set_arch(arch);
 	cmdm->set_config(config);
 	cmdm->set_rebuild(false);
+	cmdm->set_failfast(failfast);
 	if(!SendMessage(s, cmd))
 		return 1;
 
-	string backspaces(150, '\b');
+	string backspaces(200, '\b');
 
 	//Receive progress updates, showing a progress bar until the build completes
 	SplashMsg msg;
@@ -238,6 +249,15 @@ int ProcessBuildCommand(Socket& s, const vector<string>& args)
 
 			//Status
 			LogNotice(" %u/%d done, %u failed", update.tasks_completed(), (int)total, update.tasks_failed());
+
+			//Estimated time left (pad with spaces so we don't leave junk behind as it gets shorter)
+			if(update.tasks_pending() != 0)
+			{
+				int eta = static_cast<int>(update.time_remaining() + 0.5);
+				LogNotice(", about %d:%02d left   ", eta / 60, eta % 60);
+			}
+			else
+				LogNotice("%20s", "");
 		}
 
 		else if(msg.Payload_case() == SplashMsg::kBuildResults)
@@ -762,6 +782,147 @@ int ProcessListArchesCommand(Socket& s, const vector<string>& args)
 	return 0;
 }
 
+/**
+	@brief Handles "splash status"
+ */
+int ProcessStatusCommand(Socket& s, const vector<string>& args)
+{
+	//Sanity check
+	if(args.size() != 0)
+	{
+		LogError("Extra arguments. Usage:  \"splash status\"\n");
+		return 1;
+	}
+
+	//Format the command
+	SplashMsg cmd;
+	auto cmdm = cmd.mutable_inforequest();
+	cmdm->set_type(InfoRequest::SERVER_STATUS);
+	if(!SendMessage(s, cmd))
+		return 1;
+
+	//Get the response back
+	SplashMsg msg;
+	if(!RecvMessage(s, msg))
+		return 1;
+	if(msg.Payload_case() != SplashMsg::kServerStatus)
+	{
+		LogError("Got wrong message type back\n");
+		return 1;
+	}
+
+	//and process it
+	auto st = msg.serverstatus();
+	double mb = 1024 * 1024;
+	LogNotice("Payload memory:  %.1f MB in use, %.1f MB peak, %.1f MB limit\n",
+		st.payloadbytes() / mb,
+		st.payloadpeak() / mb,
+		st.payloadlimit() / mb);
+	LogNotice("Payload stalls:  %lu\n", (unsigned long)st.payloadstalls());
+	LogNotice("Shared nodes:    %lu (used %lu times by all working copies)\n",
+		(unsigned long)st.sharednodes(),
+		(unsigned long)st.sharednoderefs());
+	LogNotice("Symbols:         %lu interned strings\n", (unsigned long)st.symbols());
+	LogNotice("Symbol sets:     %lu interned path sets\n", (unsigned long)st.symbolsets());
+
+	//all good
+	return 0;
+}
+
+/**
+	@brief Handles "splash affected"
+ */
+int ProcessAffectedCommand(Socket& s, const vector<string>& args)
+{
+	//Parse arguments
+	vector<string> files;
+	bool pretty = true;
+	for(auto a : args)
+	{
+		if(a == "--simple")
+			pretty = false;
+		else
+			files.push_back(a);
+	}
+
+	//Sanity check
+	if(files.empty())
+	{
+		LogError("No files specified. Usage:  \"splash affected [--simple] <files>\"\n");
+		return 1;
+	}
+
+	//Format the command, with paths relative to the project root like splashdev sends them
+	SplashMsg cmd;
+	auto cmdm = cmd.mutable_inforequest();
+	cmdm->set_type(InfoRequest::AFFECTED_TARGETS);
+	string root = g_clientSettings->GetProjectRoot();
+	string cwd = CanonicalizePath(".");
+	for(auto f : files)
+	{
+		//Deleted files can't be canonicalized by realpath(), so resolve them against the current directory by hand
+		string path = CanonicalizePath(f);
+		if(path.empty())
+		{
+			path = f;
+			if(path[0] != '/')
+				path = cwd + "/" + f;
+			if(!CanonicalizePathThatMightNotExist(path))
+				path = "";
+		}
+
+		if(path.find(root + "/") == 0)
+			path = path.substr(root.length() + 1);
+		else
+		{
+			LogError("File %s is not within project root\n", f.c_str());
+			return 1;
+		}
+		cmdm->add_files(path);
+	}
+	if(!SendMessage(s, cmd))
+		return 1;
+
+	//Get the response back
+	SplashMsg msg;
+	if(!RecvMessage(s, msg))
+		return 1;
+	if(msg.Payload_case() != SplashMsg::kAffectedTargetList)
+	{
+		LogError("Got wrong message type back\n");
+		return 1;
+	}
+
+	//Pretty-print
+	auto lt = msg.affectedtargetlist();
+	if(pretty)
+	{
+		LogNotice("%-50s %-30s %-15s\n", "Target", "Architecture", "Config");
+		for(int i=0; i<lt.targets_size(); i++)
+		{
+			auto info = lt.targets(i);
+			LogNotice(
+				"%-50s %-30s %-15s\n",
+				info.name().c_str(),
+				info.arch().c_str(),
+				info.config().c_str());
+		}
+	}
+
+	//Simple print (one target name per line, suitable for passing to "splash build")
+	else
+	{
+		set<string> names;
+		for(int i=0; i<lt.targets_size(); i++)
+			names.emplace(lt.targets(i).name());
+		for(auto n : names)
+			LogNotice("%s\n", n.c_str());
+	}
+
+	//all good
+	return 0;
+}
+
 /**
 	@brief Handles "splash dump-graph"
  */
@@ -903,6 +1064,8 @@ void ShowUsage()
 		"    --verbose                      Sets log level to verbose\n"
 		"\n"
 		"command must be exactly one of the following:\n"
+		"    affected [--simple] <files>    List all targets which have to be rebuilt if\n"
+		"                                   any of the specified files change.\n"
 		"    build                          Builds one or more targets\n"
 		"    clean                          Deletes all generated files in your local working copy\n"
 		"    dump-graph                     Print the entire dependency graph to stdout\n"
@@ -919,10 +1082,14 @@ void ShowUsage()
 		"    list-targets-simple            List all targets in the working copy,\n"
 		"                                   with one target name per line\n"
 		"    list-toolchains                List all toolchains the server knows about.\n"
+		"    status                         Show resource usage of the server.\n"
 		"\n"
-		"spmake build \n"
+		"spmake build [--arch arch] [--config config] [--fail-fast] [targets]\n"
 		"    Builds one or more targets (docs TODO)\n"
 		"\n"
+		"    --fail-fast: Stop the rest of the build as soon as anything fails to build.\n"
+		"    Interrupting spmake cancels the build on the server.\n"
+		"\n"
 		"spmake init <control server> [port]\n"
 		"    Initializes the .splash directory within this working copy to store\n"
 		"    client-side configuration. This must be the first Splash command\n"